@@ -0,0 +1,207 @@
+#include "boards.h"
+#include "report.h"
+#include "sysfs.h"
+#include "transport.h"
+#include <errno.h>
+#include <hidapi/hidapi.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct sdp_board_
+{
+    sdp_stages *stages;
+    bool initial_wait;
+    char *usb_path;
+    pthread_t thread;
+    atomic_bool done;
+    int result;
+    double duration;
+};
+
+static double elapsed(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void *board_worker(void *arg)
+{
+    sdp_board *board = arg;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // Several boards print their progress at the same time
+    sdp_report_prefix(board->usb_path);
+    board->result = sdp_run_stages(board->stages, board->initial_wait, board->usb_path);
+    board->duration = elapsed(&start);
+    atomic_store(&board->done, true);
+    return NULL;
+}
+
+// Start running the stages on a board in a separate thread. Expects the
+// transport to be initialized already.
+sdp_board *sdp_start_board(sdp_stages *stages, bool initial_wait, const char *usb_path)
+{
+    sdp_board *board = calloc(1, sizeof(sdp_board));
+    if (!board)
+    {
+        fprintf(stderr, "ERROR: Failed to allocate board\n");
+        return NULL;
+    }
+
+    board->stages = stages;
+    board->initial_wait = initial_wait;
+    board->result = 1;
+    atomic_init(&board->done, false);
+    board->usb_path = strdup(usb_path);
+    if (!board->usb_path)
+    {
+        fprintf(stderr, "ERROR: Failed to allocate USB path\n");
+        goto free_board;
+    }
+
+    int err = pthread_create(&board->thread, NULL, board_worker, board);
+    if (err)
+    {
+        fprintf(stderr, "ERROR: Failed to start worker for %s: %s\n", usb_path, strerror(err));
+        goto free_path;
+    }
+
+    return board;
+
+free_path:
+    free(board->usb_path);
+free_board:
+    free(board);
+    return NULL;
+}
+
+const char *sdp_board_usb_path(const sdp_board *board)
+{
+    return board->usb_path;
+}
+
+bool sdp_board_done(sdp_board *board)
+{
+    return atomic_load(&board->done);
+}
+
+// Wait for the board to finish and free it; returns the result of the stages
+int sdp_join_board(sdp_board *board, double *duration)
+{
+    pthread_join(board->thread, NULL);
+    int result = board->result;
+    if (duration)
+        *duration = board->duration;
+    free(board->usb_path);
+    free(board);
+    return result;
+}
+
+// Find the USB paths of all devices matching the first stage
+char **sdp_find_boards(sdp_stages *stages, int *count)
+{
+    char **result = NULL;
+    *count = 0;
+
+    if (hid_init())
+    {
+        fprintf(stderr, "ERROR: hidapi init failed\n");
+        return NULL;
+    }
+
+    struct hid_device_info *const enumerator = hid_enumerate(sdp_stage_vid(stages), sdp_stage_pid(stages));
+    for (struct hid_device_info *i = enumerator; i; i = i->next)
+    {
+        char *usb_path = sdp_sysfs_usb_path(i->path);
+        if (!usb_path)
+            continue;
+
+        char **tmp = realloc(result, (*count + 1) * sizeof(char *));
+        if (!tmp)
+        {
+            fprintf(stderr, "ERROR: Failed to allocate board list\n");
+            free(usb_path);
+            sdp_free_boards(result, *count);
+            result = NULL;
+            *count = 0;
+            break;
+        }
+        result = tmp;
+        result[(*count)++] = usb_path;
+    }
+
+    hid_free_enumeration(enumerator);
+
+    if (!result)
+        fprintf(stderr, "ERROR: No matching devices found\n");
+
+    if (hid_exit())
+        fprintf(stderr, "ERROR: hidapi exit failed\n");
+
+    return result;
+}
+
+void sdp_free_boards(char **usb_paths, int count)
+{
+    for (int i = 0; i < count; ++i)
+        free(usb_paths[i]);
+    free(usb_paths);
+}
+
+struct board_result
+{
+    sdp_board *board;
+    int result;
+    double duration;
+};
+
+// Run the stages on every board concurrently, one thread per USB path
+int sdp_execute_boards(sdp_stages *stages, bool initial_wait, char *const *usb_paths, int count)
+{
+    struct board_result *boards = calloc(count, sizeof(struct board_result));
+    if (!boards)
+    {
+        fprintf(stderr, "ERROR: Failed to allocate boards\n");
+        return 1;
+    }
+
+    int res = sdp_transport_init();
+    if (res)
+        goto free_boards;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < count; ++i)
+        boards[i].board = sdp_start_board(stages, initial_wait, usb_paths[i]);
+
+    int failed = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        boards[i].result = 1;
+        if (boards[i].board)
+            boards[i].result = sdp_join_board(boards[i].board, &boards[i].duration);
+        if (boards[i].result)
+            failed++;
+    }
+
+    sdp_report_printf("Summary (%.1fs):\n", elapsed(&start));
+    for (int i = 0; i < count; ++i)
+    {
+        sdp_report_printf("  %-16s %-6s %6.1fs\n", usb_paths[i],
+                          boards[i].result ? "FAILED" : "OK", boards[i].duration);
+    }
+    sdp_report_printf("%d of %d boards done\n", count - failed, count);
+    res = failed ? 1 : 0;
+
+    sdp_transport_exit();
+
+free_boards:
+    free(boards);
+    return res;
+}
@@ -0,0 +1,18 @@
+#ifndef BOARDS_H_
+#define BOARDS_H_
+
+#include "stages.h"
+#include <stdbool.h>
+
+struct sdp_board_;
+typedef struct sdp_board_ sdp_board;
+
+sdp_board *sdp_start_board(sdp_stages *stages, bool initial_wait, const char *usb_path);
+const char *sdp_board_usb_path(const sdp_board *board);
+bool sdp_board_done(sdp_board *board);
+int sdp_join_board(sdp_board *board, double *duration);
+char **sdp_find_boards(sdp_stages *stages, int *count);
+void sdp_free_boards(char **usb_paths, int count);
+int sdp_execute_boards(sdp_stages *stages, bool initial_wait, char *const *usb_paths, int count);
+
+#endif
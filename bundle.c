@@ -0,0 +1,620 @@
+#include "bundle.h"
+#include "crc32.h"
+#include "image.h"
+#include "report.h"
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Layout (all integers little-endian):
+ *
+ *   header
+ *   stage records, each followed in the step table by its step_count steps
+ *   step records
+ *   payload records
+ *   payload names (NUL-terminated, referenced by offset)
+ *   payloads, each starting at a page boundary
+ *
+ * The index (everything between the header and the payloads) is covered by
+ * index_crc, each payload by its own CRC.
+ */
+
+#define BUNDLE_MAGIC "IMXSDPBN"
+#define BUNDLE_VERSION 3
+#define BUNDLE_ALIGN 4096
+#define NO_PAYLOAD UINT32_MAX
+
+#define STEP_DCD (1 << 0)
+#define STEP_TRIM (1 << 1)
+#define STEP_WIDTH_SHIFT 8 // register width in bytes, bits 8-15
+
+struct bundle_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t stage_count;
+    uint32_t step_count;
+    uint32_t payload_count;
+    uint32_t strings_size;
+    uint32_t index_crc;
+    uint64_t size; // of the whole bundle
+} __attribute__((packed));
+
+struct bundle_stage
+{
+    uint16_t vid;
+    uint16_t pid;
+    int32_t timeout; // -1 if unset
+    uint32_t step_count;
+    uint32_t reserved;
+} __attribute__((packed));
+
+struct bundle_step
+{
+    uint32_t op;
+    uint32_t flags;
+    uint32_t address;
+    uint32_t dcd_address;
+    uint32_t payload; // index, NO_PAYLOAD unless write_file
+    uint32_t segment_size;
+    uint32_t value; // write_register
+    uint32_t count; // read_register
+    uint32_t offset; // range of the payload written, length 0: to its end
+    uint32_t length;
+} __attribute__((packed));
+
+struct bundle_payload
+{
+    uint64_t offset;
+    uint64_t size;
+    uint32_t crc;
+    uint32_t name; // offset into the names
+} __attribute__((packed));
+
+struct sdp_bundle_
+{
+    void *map;
+    size_t size;
+};
+
+static uint64_t align_up(uint64_t value)
+{
+    return (value + BUNDLE_ALIGN - 1) & ~(uint64_t)(BUNDLE_ALIGN - 1);
+}
+
+// Everything needed to write a bundle, collected from the plan
+struct bundle_builder
+{
+    struct bundle_header header;
+    struct bundle_stage *stages;
+    struct bundle_step *steps;
+    struct bundle_payload *payloads;
+    const sdp_image **images; // one per payload
+    char *strings;
+};
+
+static void free_builder(struct bundle_builder *b)
+{
+    free(b->stages);
+    free(b->steps);
+    free(b->payloads);
+    free(b->images);
+    free(b->strings);
+}
+
+// Images used by several steps are only stored once
+static uint32_t add_payload(struct bundle_builder *b, const struct sdp_step_info *info,
+                            const sdp_image *image)
+{
+    for (uint32_t i = 0; i < b->header.payload_count; ++i)
+    {
+        if (!strcmp(b->strings + b->payloads[i].name, info->file_path))
+            return i;
+    }
+
+    size_t name_length = strlen(info->file_path) + 1;
+    char *strings = realloc(b->strings, b->header.strings_size + name_length);
+    if (!strings)
+    {
+        fprintf(stderr, "ERROR: Failed to allocate bundle index\n");
+        return NO_PAYLOAD;
+    }
+    b->strings = strings;
+    memcpy(b->strings + b->header.strings_size, info->file_path, name_length);
+
+    uint32_t index = b->header.payload_count++;
+    struct bundle_payload *payload = &b->payloads[index];
+    payload->size = sdp_image_size(image);
+    payload->crc = sdp_crc32(0, sdp_image_data(image), sdp_image_size(image));
+    payload->name = b->header.strings_size;
+    b->images[index] = image;
+    b->header.strings_size += name_length;
+    return index;
+}
+
+static int build_index(struct bundle_builder *b, const sdp_stages *stages)
+{
+    int stage_count = sdp_stage_count(stages);
+    size_t step_count = 0;
+    if (stage_count <= 0)
+    {
+        fprintf(stderr, "ERROR: No stages to bundle\n");
+        return -1;
+    }
+    for (int i = 0; i < stage_count; ++i)
+    {
+        struct sdp_stage_info info;
+        step_count += sdp_step_count(sdp_get_stage_info(stages, i, &info));
+    }
+
+    b->stages = calloc(stage_count, sizeof(*b->stages));
+    b->steps = calloc(step_count, sizeof(*b->steps));
+    b->payloads = calloc(step_count, sizeof(*b->payloads));
+    b->images = calloc(step_count, sizeof(*b->images));
+    if (!b->stages || (step_count && (!b->steps || !b->payloads || !b->images)))
+    {
+        fprintf(stderr, "ERROR: Failed to allocate bundle index\n");
+        return -1;
+    }
+
+    struct bundle_step *step = b->steps;
+    for (int i = 0; i < stage_count; ++i)
+    {
+        struct sdp_stage_info stage_info;
+        const sdp_steps *steps = sdp_get_stage_info(stages, i, &stage_info);
+        b->stages[i].vid = stage_info.usb_vid;
+        b->stages[i].pid = stage_info.usb_pid;
+        b->stages[i].timeout = stage_info.timeout;
+        b->stages[i].step_count = sdp_step_count(steps);
+
+        for (int j = 0; j < sdp_step_count(steps); ++j, ++step)
+        {
+            struct sdp_step_info info;
+            const sdp_image *image;
+            sdp_get_step_info(steps, j, &info, &image);
+            step->op = info.op;
+            step->flags = (info.dcd ? STEP_DCD : 0) | (info.trim ? STEP_TRIM : 0) |
+                          (uint32_t)info.width << STEP_WIDTH_SHIFT;
+            step->address = info.address;
+            step->dcd_address = info.dcd_address;
+            step->segment_size = info.segment_size;
+            step->value = info.value;
+            step->count = info.count;
+            step->offset = info.offset;
+            step->length = info.length;
+            step->payload = NO_PAYLOAD;
+            if (info.op != SDP_WRITE_FILE)
+                continue;
+            if (!image)
+            {
+                fprintf(stderr, "ERROR: Image \"%s\" not loaded\n", info.file_path);
+                return -1;
+            }
+            step->payload = add_payload(b, &info, image);
+            if (step->payload == NO_PAYLOAD)
+                return -1;
+        }
+    }
+
+    b->header.stage_count = stage_count;
+    b->header.step_count = step_count;
+    return 0;
+}
+
+// Convert the index to little-endian, lay out the payloads, and fill in the header
+static void finish_index(struct bundle_builder *b)
+{
+    struct bundle_header *h = &b->header;
+    uint64_t offset = sizeof(*h) + h->stage_count * sizeof(struct bundle_stage) +
+                      h->step_count * sizeof(struct bundle_step) +
+                      h->payload_count * sizeof(struct bundle_payload) + h->strings_size;
+    for (uint32_t i = 0; i < h->payload_count; ++i)
+    {
+        struct bundle_payload *p = &b->payloads[i];
+        offset = align_up(offset);
+        p->offset = offset;
+        offset += p->size;
+
+        p->offset = htole64(p->offset);
+        p->size = htole64(p->size);
+        p->crc = htole32(p->crc);
+        p->name = htole32(p->name);
+    }
+
+    for (uint32_t i = 0; i < h->stage_count; ++i)
+    {
+        struct bundle_stage *s = &b->stages[i];
+        s->vid = htole16(s->vid);
+        s->pid = htole16(s->pid);
+        s->timeout = (int32_t)htole32((uint32_t)s->timeout);
+        s->step_count = htole32(s->step_count);
+    }
+    for (uint32_t i = 0; i < h->step_count; ++i)
+    {
+        struct bundle_step *s = &b->steps[i];
+        s->op = htole32(s->op);
+        s->flags = htole32(s->flags);
+        s->address = htole32(s->address);
+        s->dcd_address = htole32(s->dcd_address);
+        s->segment_size = htole32(s->segment_size);
+        s->payload = htole32(s->payload);
+        s->value = htole32(s->value);
+        s->count = htole32(s->count);
+        s->offset = htole32(s->offset);
+        s->length = htole32(s->length);
+    }
+
+    uint32_t crc = sdp_crc32(0, b->stages, h->stage_count * sizeof(struct bundle_stage));
+    crc = sdp_crc32(crc, b->steps, h->step_count * sizeof(struct bundle_step));
+    crc = sdp_crc32(crc, b->payloads, h->payload_count * sizeof(struct bundle_payload));
+    crc = sdp_crc32(crc, b->strings, h->strings_size);
+
+    memcpy(h->magic, BUNDLE_MAGIC, sizeof(h->magic));
+    h->version = htole32(BUNDLE_VERSION);
+    h->index_crc = htole32(crc);
+    h->size = htole64(offset);
+    h->stage_count = htole32(h->stage_count);
+    h->step_count = htole32(h->step_count);
+    h->payload_count = htole32(h->payload_count);
+    h->strings_size = htole32(h->strings_size);
+}
+
+static int write_all(int fd, const void *data, size_t length)
+{
+    const unsigned char *p = data;
+    while (length)
+    {
+        ssize_t n = write(fd, p, length);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        p += n;
+        length -= n;
+    }
+    return 0;
+}
+
+static int write_padding(int fd, uint64_t *offset)
+{
+    static const unsigned char zeros[BUNDLE_ALIGN];
+    size_t length = align_up(*offset) - *offset;
+    *offset += length;
+    return write_all(fd, zeros, length);
+}
+
+static int write_builder(int fd, const struct bundle_builder *b, uint32_t payload_count)
+{
+    const struct bundle_header *h = &b->header;
+    if (write_all(fd, h, sizeof(*h)) ||
+        write_all(fd, b->stages, le32toh(h->stage_count) * sizeof(struct bundle_stage)) ||
+        write_all(fd, b->steps, le32toh(h->step_count) * sizeof(struct bundle_step)) ||
+        write_all(fd, b->payloads, payload_count * sizeof(struct bundle_payload)) ||
+        write_all(fd, b->strings, le32toh(h->strings_size)))
+        return -1;
+
+    uint64_t offset = sizeof(*h) + le32toh(h->stage_count) * sizeof(struct bundle_stage) +
+                      le32toh(h->step_count) * sizeof(struct bundle_step) +
+                      payload_count * sizeof(struct bundle_payload) + le32toh(h->strings_size);
+    for (uint32_t i = 0; i < payload_count; ++i)
+    {
+        if (write_padding(fd, &offset) ||
+            write_all(fd, sdp_image_data(b->images[i]), sdp_image_size(b->images[i])))
+            return -1;
+        offset += sdp_image_size(b->images[i]);
+    }
+    return 0;
+}
+
+// Write the prepared plan and its images to path. The bundle is written to a
+// temporary file first and renamed, so it is replaced atomically.
+int sdp_write_bundle(const char *path, const sdp_stages *stages)
+{
+    int res = -1;
+    struct bundle_builder b = {0};
+    if (build_index(&b, stages))
+        goto free_builder;
+    uint32_t payload_count = b.header.payload_count;
+    finish_index(&b);
+
+    char *tmp_path = malloc(strlen(path) + sizeof(".XXXXXX"));
+    if (!tmp_path)
+    {
+        fprintf(stderr, "ERROR: Failed to allocate file path\n");
+        goto free_builder;
+    }
+    strcpy(tmp_path, path);
+    strcat(tmp_path, ".XXXXXX");
+    int fd = mkstemp(tmp_path);
+    if (fd < 0)
+    {
+        fprintf(stderr, "ERROR: Failed to create \"%s\": %s\n", tmp_path, strerror(errno));
+        goto free_path;
+    }
+
+    if (write_builder(fd, &b, payload_count) || fchmod(fd, 0644) || fsync(fd))
+    {
+        fprintf(stderr, "ERROR: Failed to write \"%s\": %s\n", tmp_path, strerror(errno));
+        goto close_fd;
+    }
+    if (close(fd))
+    {
+        fd = -1;
+        fprintf(stderr, "ERROR: Failed to write \"%s\": %s\n", tmp_path, strerror(errno));
+        goto unlink_tmp;
+    }
+    fd = -1;
+    if (rename(tmp_path, path))
+    {
+        fprintf(stderr, "ERROR: Failed to rename \"%s\": %s\n", tmp_path, strerror(errno));
+        goto unlink_tmp;
+    }
+
+    sdp_report_printf("Bundle \"%s\": %" PRIu32 " stage(s), %" PRIu32 " image(s), %" PRIu64 " bytes\n",
+                      path, le32toh(b.header.stage_count), payload_count, le64toh(b.header.size));
+    res = 0;
+    goto free_path;
+
+close_fd:
+    close(fd);
+unlink_tmp:
+    unlink(tmp_path);
+free_path:
+    free(tmp_path);
+free_builder:
+    free_builder(&b);
+    return res;
+}
+
+// Check the index of a mapped bundle and wrap its payloads into images
+static sdp_image **open_payloads(const unsigned char *map, size_t size,
+                                 const struct bundle_header *h, const struct bundle_payload *payloads,
+                                 const char *strings)
+{
+    uint32_t count = le32toh(h->payload_count);
+    uint32_t strings_size = le32toh(h->strings_size);
+    if (strings_size && strings[strings_size - 1])
+    {
+        fprintf(stderr, "ERROR: Invalid bundle payload names\n");
+        return NULL;
+    }
+
+    sdp_image **images = calloc(count ? count : 1, sizeof(sdp_image *));
+    if (!images)
+    {
+        fprintf(stderr, "ERROR: Failed to allocate bundle images\n");
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        uint64_t offset = le64toh(payloads[i].offset);
+        uint64_t length = le64toh(payloads[i].size);
+        uint32_t name = le32toh(payloads[i].name);
+        if (name >= strings_size || offset > size || length > size - offset)
+        {
+            fprintf(stderr, "ERROR: Invalid bundle payload %" PRIu32 "\n", i);
+            goto put_images;
+        }
+        if (sdp_crc32(0, map + offset, length) != le32toh(payloads[i].crc))
+        {
+            fprintf(stderr, "ERROR: Checksum mismatch of bundle payload \"%s\"\n", strings + name);
+            goto put_images;
+        }
+        images[i] = sdp_image_wrap(strings + name, map + offset, length);
+        if (!images[i])
+            goto put_images;
+    }
+    return images;
+
+put_images:
+    for (uint32_t i = 0; i < count; ++i)
+        sdp_image_put(images[i]);
+    free(images);
+    return NULL;
+}
+
+static sdp_stages *build_stages(const struct bundle_header *h, const struct bundle_stage *records,
+                                const struct bundle_step *step_records, sdp_image **images)
+{
+    sdp_stages *stages = sdp_new_stages();
+    if (!stages)
+        return NULL;
+
+    uint32_t stage_count = le32toh(h->stage_count);
+    uint32_t step_count = le32toh(h->step_count);
+    uint32_t payload_count = le32toh(h->payload_count);
+    uint32_t next_step = 0;
+    for (uint32_t i = 0; i < stage_count; ++i)
+    {
+        uint32_t count = le32toh(records[i].step_count);
+        if (count > step_count - next_step)
+        {
+            fprintf(stderr, "ERROR: Invalid bundle stage %" PRIu32 "\n", i + 1);
+            goto free_stages;
+        }
+
+        sdp_steps *steps = sdp_new_steps();
+        if (!steps)
+            goto free_stages;
+        for (uint32_t j = 0; j < count; ++j, ++next_step)
+        {
+            const struct bundle_step *record = &step_records[next_step];
+            uint32_t flags = le32toh(record->flags);
+            uint32_t payload = le32toh(record->payload);
+            struct sdp_step_info info = {
+                .op = le32toh(record->op),
+                .address = le32toh(record->address),
+                .dcd = flags & STEP_DCD,
+                .dcd_address = le32toh(record->dcd_address),
+                .trim = flags & STEP_TRIM,
+                .segment_size = le32toh(record->segment_size),
+                .value = le32toh(record->value),
+                .width = (flags >> STEP_WIDTH_SHIFT) & 0xff,
+                .count = le32toh(record->count),
+                .offset = le32toh(record->offset),
+                .length = le32toh(record->length),
+            };
+            sdp_image *image = NULL;
+            if (info.op == SDP_WRITE_FILE)
+            {
+                if (payload >= payload_count)
+                {
+                    fprintf(stderr, "ERROR: Invalid bundle step %" PRIu32 "\n", next_step + 1);
+                    sdp_free_steps(steps);
+                    goto free_stages;
+                }
+                image = images[payload];
+                info.file_path = sdp_image_path(image);
+            }
+            if (sdp_add_step_info(steps, &info, image))
+            {
+                sdp_free_steps(steps);
+                goto free_stages;
+            }
+        }
+
+        struct sdp_stage_info info = {
+            .usb_vid = le16toh(records[i].vid),
+            .usb_pid = le16toh(records[i].pid),
+            .timeout = (int32_t)le32toh((uint32_t)records[i].timeout),
+        };
+        if (info.timeout < -1)
+            info.timeout = -1;
+        if (sdp_add_stage_info(stages, &info, steps))
+        {
+            sdp_free_steps(steps);
+            goto free_stages;
+        }
+    }
+
+    if (!stage_count || next_step != step_count)
+    {
+        fprintf(stderr, "ERROR: Invalid bundle stages\n");
+        goto free_stages;
+    }
+    return stages;
+
+free_stages:
+    sdp_free_stages(stages);
+    return NULL;
+}
+
+// Map the bundle at path and return its plan in stages. The bundle must be closed
+// only after the stages are freed.
+sdp_bundle *sdp_open_bundle(const char *path, sdp_stages **stages)
+{
+    sdp_bundle *bundle = calloc(1, sizeof(sdp_bundle));
+    if (!bundle)
+    {
+        fprintf(stderr, "ERROR: Failed to allocate bundle\n");
+        goto out;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "ERROR: Failed to open bundle \"%s\": %s\n", path, strerror(errno));
+        goto free_bundle;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st))
+    {
+        fprintf(stderr, "ERROR: Failed to stat bundle \"%s\": %s\n", path, strerror(errno));
+        goto close_fd;
+    }
+    if ((uint64_t)st.st_size < sizeof(struct bundle_header))
+    {
+        fprintf(stderr, "ERROR: \"%s\" is not a bundle\n", path);
+        goto close_fd;
+    }
+    bundle->size = st.st_size;
+
+    bundle->map = mmap(NULL, bundle->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (bundle->map == MAP_FAILED)
+    {
+        fprintf(stderr, "ERROR: Failed to map bundle \"%s\": %s\n", path, strerror(errno));
+        goto close_fd;
+    }
+
+    const unsigned char *map = bundle->map;
+    const struct bundle_header *h = bundle->map;
+    if (memcmp(h->magic, BUNDLE_MAGIC, sizeof(h->magic)))
+    {
+        fprintf(stderr, "ERROR: \"%s\" is not a bundle\n", path);
+        goto unmap;
+    }
+    if (le32toh(h->version) != BUNDLE_VERSION)
+    {
+        fprintf(stderr, "ERROR: Unsupported bundle version %" PRIu32 "\n", le32toh(h->version));
+        goto unmap;
+    }
+    if (le64toh(h->size) != bundle->size)
+    {
+        fprintf(stderr, "ERROR: Bundle \"%s\" is truncated\n", path);
+        goto unmap;
+    }
+
+    uint64_t stages_size = (uint64_t)le32toh(h->stage_count) * sizeof(struct bundle_stage);
+    uint64_t steps_size = (uint64_t)le32toh(h->step_count) * sizeof(struct bundle_step);
+    uint64_t payloads_size = (uint64_t)le32toh(h->payload_count) * sizeof(struct bundle_payload);
+    uint64_t index_size = stages_size + steps_size + payloads_size + le32toh(h->strings_size);
+    if (index_size > bundle->size - sizeof(*h))
+    {
+        fprintf(stderr, "ERROR: Invalid bundle index\n");
+        goto unmap;
+    }
+    const unsigned char *index = map + sizeof(*h);
+    if (sdp_crc32(0, index, index_size) != le32toh(h->index_crc))
+    {
+        fprintf(stderr, "ERROR: Checksum mismatch of bundle index\n");
+        goto unmap;
+    }
+
+    const struct bundle_stage *stage_records = (const void *)index;
+    const struct bundle_step *step_records = (const void *)(index + stages_size);
+    const struct bundle_payload *payloads = (const void *)(index + stages_size + steps_size);
+    const char *strings = (const char *)index + stages_size + steps_size + payloads_size;
+
+    sdp_image **images = open_payloads(map, bundle->size, h, payloads, strings);
+    if (!images)
+        goto unmap;
+    *stages = build_stages(h, stage_records, step_records, images);
+
+    // The steps hold their own references
+    for (uint32_t i = 0; i < le32toh(h->payload_count); ++i)
+        sdp_image_put(images[i]);
+    free(images);
+    if (!*stages)
+        goto unmap;
+
+    close(fd);
+    return bundle;
+
+unmap:
+    munmap(bundle->map, bundle->size);
+close_fd:
+    close(fd);
+free_bundle:
+    free(bundle);
+    bundle = NULL;
+out:
+    return bundle;
+}
+
+void sdp_close_bundle(sdp_bundle *bundle)
+{
+    munmap(bundle->map, bundle->size);
+    free(bundle);
+}
@@ -0,0 +1,19 @@
+#ifndef BUNDLE_H_
+#define BUNDLE_H_
+
+#include "stages.h"
+
+/*
+ * A bundle holds a prepared plan (stages and steps) together with all images it
+ * writes in a single file. Running from a bundle maps the file and writes the
+ * images straight from the mapping, after checking each image's CRC-32.
+ */
+
+struct sdp_bundle_;
+typedef struct sdp_bundle_ sdp_bundle;
+
+int sdp_write_bundle(const char *path, const sdp_stages *stages);
+sdp_bundle *sdp_open_bundle(const char *path, sdp_stages **stages);
+void sdp_close_bundle(sdp_bundle *bundle);
+
+#endif
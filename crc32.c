@@ -0,0 +1,27 @@
+#include "crc32.h"
+#include <pthread.h>
+
+static uint32_t table[256];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static void init_table(void)
+{
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k)
+            c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        table[i] = c;
+    }
+}
+
+uint32_t sdp_crc32(uint32_t crc, const void *data, size_t length)
+{
+    pthread_once(&table_once, init_table);
+
+    const unsigned char *p = data;
+    crc = ~crc;
+    while (length--)
+        crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
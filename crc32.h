@@ -0,0 +1,10 @@
+#ifndef CRC32_H_
+#define CRC32_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32 as used by zlib/gzip; start with crc = 0 and feed the data in pieces
+uint32_t sdp_crc32(uint32_t crc, const void *data, size_t length);
+
+#endif
@@ -0,0 +1,169 @@
+#include "daemon.h"
+#include "boards.h"
+#include "config.h"
+#include "report.h"
+#include "trace.h"
+#include "transport.h"
+#include <errno.h>
+#include <hidapi/hidapi.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WITH_UDEV
+#include "hotplug.h"
+#include "sysfs.h"
+#include "udev.h"
+
+static volatile sig_atomic_t stop;
+
+static void handle_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+struct daemon
+{
+    sdp_stages *stages;
+    sdp_board **boards;
+    int count;
+    unsigned int succeeded;
+    unsigned int failed;
+};
+
+static bool board_active(struct daemon *d, const char *usb_path)
+{
+    for (int i = 0; i < d->count; ++i)
+    {
+        if (!strcmp(sdp_board_usb_path(d->boards[i]), usb_path))
+            return true;
+    }
+    return false;
+}
+
+static void start_board(struct daemon *d, const char *usb_path)
+{
+    if (board_active(d, usb_path))
+        return;
+
+    sdp_board **tmp = realloc(d->boards, (d->count + 1) * sizeof(sdp_board *));
+    if (!tmp)
+    {
+        fprintf(stderr, "ERROR: Failed to allocate board list\n");
+        return;
+    }
+    d->boards = tmp;
+
+    sdp_report_printf("[%s] Device found, booting\n", usb_path);
+    sdp_board *board = sdp_start_board(d->stages, true, usb_path);
+    if (board)
+        d->boards[d->count++] = board;
+    else
+        d->failed++;
+}
+
+static void reap_boards(struct daemon *d, bool wait)
+{
+    for (int i = 0; i < d->count;)
+    {
+        sdp_board *board = d->boards[i];
+        if (!wait && !sdp_board_done(board))
+        {
+            ++i;
+            continue;
+        }
+
+        double duration;
+        const char *usb_path = sdp_board_usb_path(board);
+        if (sdp_join_board(board, &duration))
+        {
+            d->failed++;
+            sdp_report_printf("[%s] Boot FAILED after %.1fs\n", usb_path, duration);
+        }
+        else
+        {
+            d->succeeded++;
+            sdp_report_printf("[%s] Boot OK in %.1fs\n", usb_path, duration);
+        }
+        d->boards[i] = d->boards[--d->count];
+    }
+}
+
+// Pick up devices that were already attached when the daemon started
+static void start_present_boards(struct daemon *d)
+{
+    struct hid_device_info *const enumerator = hid_enumerate(sdp_stage_vid(d->stages), sdp_stage_pid(d->stages));
+    for (struct hid_device_info *i = enumerator; i; i = i->next)
+    {
+        char *usb_path = sdp_sysfs_usb_path(i->path);
+        if (usb_path)
+            start_board(d, usb_path);
+        free(usb_path);
+    }
+    hid_free_enumeration(enumerator);
+}
+
+// Boot every device matching the first stage as it appears, until SIGINT or
+// SIGTERM is received. The daemon's udev monitor is the only one: devices added
+// at the USB path of a running board are handed to it.
+int sdp_run_daemon(sdp_stages *stages)
+{
+    struct daemon d = {.stages = stages};
+    sdp_trace_track("daemon");
+    int res = sdp_transport_init();
+    if (res)
+        return 1;
+
+    sdp_udev *udev = sdp_udev_init();
+    if (!udev)
+    {
+        fprintf(stderr, "ERROR: Failed to initialize udev\n");
+        res = 1;
+        goto out;
+    }
+    sdp_hotplug_enable_dispatch();
+
+    struct sigaction sa = {.sa_handler = handle_signal};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    sdp_report_printf("Waiting for devices (VID=0x%04x PID=0x%04x)...\n",
+                      sdp_stage_vid(stages), sdp_stage_pid(stages));
+
+    start_present_boards(&d);
+
+    while (!stop)
+    {
+        char *usb_path;
+        uint16_t vid, pid;
+        char *devnode = sdp_udev_wait_any(udev, 1000, &usb_path, &vid, &pid);
+        reap_boards(&d, false);
+        if (!devnode)
+            continue;
+        if (!sdp_hotplug_dispatch(usb_path, vid, pid, devnode) &&
+            vid == sdp_stage_vid(stages) && pid == sdp_stage_pid(stages))
+            start_board(&d, usb_path);
+        free(usb_path);
+        free(devnode);
+    }
+
+    sdp_report_printf("Stopping, waiting for %d board(s) to finish\n", d.count);
+    reap_boards(&d, true);
+    free(d.boards);
+    sdp_report_printf("%u boards done, %u failed\n", d.succeeded, d.failed);
+
+    sdp_udev_free(udev);
+out:
+    sdp_transport_exit();
+    return res;
+}
+#else
+int sdp_run_daemon(sdp_stages *stages)
+{
+    fprintf(stderr, "ERROR: Daemon mode is only supported with udev support\n");
+    return 1;
+}
+#endif
@@ -0,0 +1,8 @@
+#ifndef DAEMON_H_
+#define DAEMON_H_
+
+#include "stages.h"
+
+int sdp_run_daemon(sdp_stages *stages);
+
+#endif
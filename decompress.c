@@ -0,0 +1,346 @@
+#include "decompress.h"
+#include "config.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef WITH_LZMA
+#include <lzma.h>
+#endif
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#define INPUT_SIZE (64 * 1024)
+
+enum format
+{
+    FORMAT_GZIP,
+    FORMAT_XZ,
+    FORMAT_ZSTD,
+};
+
+static const struct
+{
+    const char *name;
+    const char *magic;
+    size_t length;
+    bool supported;
+} formats[] = {
+    [FORMAT_GZIP] = {"gzip", "\x1f\x8b\x08", 3,
+#ifdef WITH_ZLIB
+                     true
+#endif
+    },
+    [FORMAT_XZ] = {"xz", "\xfd" "7zXZ\0", 6,
+#ifdef WITH_LZMA
+                   true
+#endif
+    },
+    [FORMAT_ZSTD] = {"zstd", "\x28\xb5\x2f\xfd", 4,
+#ifdef WITH_ZSTD
+                     true
+#endif
+    },
+};
+
+struct sdp_decoder_
+{
+    enum format format;
+    int fd;
+    char *path;
+
+    unsigned char *input;
+    size_t input_pos;
+    size_t input_length;
+    bool input_eof;
+    bool done; // end of the last compressed stream
+
+#ifdef WITH_ZLIB
+    z_stream z;
+    bool member_done; // a gzip member ended, another one may follow
+#endif
+#ifdef WITH_LZMA
+    lzma_stream xz;
+#endif
+#ifdef WITH_ZSTD
+    ZSTD_DStream *zstd;
+    size_t zstd_hint; // 0 at the end of a frame
+#endif
+};
+
+static int init_backend(sdp_decoder *d)
+{
+    switch (d->format)
+    {
+#ifdef WITH_ZLIB
+    case FORMAT_GZIP:
+        memset(&d->z, 0, sizeof(d->z));
+        d->member_done = false;
+        if (inflateInit2(&d->z, 16 + MAX_WBITS) != Z_OK)
+            return -1;
+        return 0;
+#endif
+#ifdef WITH_LZMA
+    case FORMAT_XZ:
+        d->xz = (lzma_stream)LZMA_STREAM_INIT;
+        if (lzma_stream_decoder(&d->xz, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK)
+            return -1;
+        return 0;
+#endif
+#ifdef WITH_ZSTD
+    case FORMAT_ZSTD:
+        d->zstd = ZSTD_createDStream();
+        if (!d->zstd || ZSTD_isError(ZSTD_initDStream(d->zstd)))
+            return -1;
+        d->zstd_hint = 0;
+        return 0;
+#endif
+    default:
+        return -1;
+    }
+}
+
+static void end_backend(sdp_decoder *d)
+{
+    switch (d->format)
+    {
+#ifdef WITH_ZLIB
+    case FORMAT_GZIP:
+        inflateEnd(&d->z);
+        break;
+#endif
+#ifdef WITH_LZMA
+    case FORMAT_XZ:
+        lzma_end(&d->xz);
+        break;
+#endif
+#ifdef WITH_ZSTD
+    case FORMAT_ZSTD:
+        ZSTD_freeDStream(d->zstd);
+        d->zstd = NULL;
+        break;
+#endif
+    default:
+        break;
+    }
+}
+
+// Decode from the input buffer into out. Sets d->done at the end of the data,
+// returns -1 with the reason in *error otherwise.
+static int step_backend(sdp_decoder *d, unsigned char *out, size_t length, size_t *produced,
+                        const char **error)
+{
+    // Unused if no decoder is built in
+    __attribute__((unused)) const unsigned char *in = d->input + d->input_pos;
+    __attribute__((unused)) size_t available = d->input_length - d->input_pos;
+    *produced = 0;
+
+    switch (d->format)
+    {
+#ifdef WITH_ZLIB
+    case FORMAT_GZIP:
+        if (!available)
+        {
+            // Only at the end of the file, which must be the end of a member
+            d->done = d->member_done;
+            *error = "unexpected end of file";
+            return d->done ? 0 : -1;
+        }
+        if (d->member_done)
+        {
+            // Concatenated members are decoded as one stream, like gunzip does
+            inflateReset(&d->z);
+            d->member_done = false;
+        }
+        d->z.next_in = (unsigned char *)in;
+        d->z.avail_in = available;
+        d->z.next_out = out;
+        d->z.avail_out = length;
+        int zres = inflate(&d->z, Z_NO_FLUSH);
+        d->input_pos += available - d->z.avail_in;
+        *produced = length - d->z.avail_out;
+        if (zres == Z_STREAM_END)
+            d->member_done = true;
+        else if (zres != Z_OK)
+        {
+            *error = d->z.msg ? d->z.msg : "invalid data";
+            return -1;
+        }
+        return 0;
+#endif
+#ifdef WITH_LZMA
+    case FORMAT_XZ:
+        d->xz.next_in = in;
+        d->xz.avail_in = available;
+        d->xz.next_out = out;
+        d->xz.avail_out = length;
+        lzma_ret xres = lzma_code(&d->xz, d->input_eof ? LZMA_FINISH : LZMA_RUN);
+        d->input_pos += available - d->xz.avail_in;
+        *produced = length - d->xz.avail_out;
+        if (xres == LZMA_STREAM_END)
+            d->done = true;
+        else if (xres == LZMA_BUF_ERROR)
+        {
+            *error = "unexpected end of file";
+            return -1;
+        }
+        else if (xres != LZMA_OK)
+        {
+            *error = xres == LZMA_MEM_ERROR ? "out of memory" : "invalid data";
+            return -1;
+        }
+        return 0;
+#endif
+#ifdef WITH_ZSTD
+    case FORMAT_ZSTD:
+        if (!available)
+        {
+            // Only at the end of the file, which must be the end of a frame
+            d->done = !d->zstd_hint;
+            *error = "unexpected end of file";
+            return d->done ? 0 : -1;
+        }
+        ZSTD_inBuffer zin = {in, available, 0};
+        ZSTD_outBuffer zout = {out, length, 0};
+        size_t hint = ZSTD_decompressStream(d->zstd, &zout, &zin);
+        d->input_pos += zin.pos;
+        *produced = zout.pos;
+        if (ZSTD_isError(hint))
+        {
+            *error = ZSTD_getErrorName(hint);
+            return -1;
+        }
+        d->zstd_hint = hint;
+        return 0;
+#endif
+    default:
+        *error = "unsupported format";
+        return -1;
+    }
+}
+
+// Returns 0 and sets *decoder to NULL if the file isn't compressed
+int sdp_decoder_open(int fd, const char *path, sdp_decoder **decoder)
+{
+    *decoder = NULL;
+
+    unsigned char magic[8];
+    ssize_t n = pread(fd, magic, sizeof(magic), 0);
+    if (n < 0)
+    {
+        fprintf(stderr, "ERROR: Failed to read file \"%s\": %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    size_t format;
+    for (format = 0; format < sizeof(formats) / sizeof(formats[0]); ++format)
+    {
+        if ((size_t)n >= formats[format].length &&
+            !memcmp(magic, formats[format].magic, formats[format].length))
+            break;
+    }
+    if (format == sizeof(formats) / sizeof(formats[0]))
+        return 0;
+    if (!formats[format].supported)
+    {
+        fprintf(stderr, "ERROR: \"%s\" is %s compressed, which this build doesn't support\n", path,
+                formats[format].name);
+        return -1;
+    }
+
+    sdp_decoder *d = calloc(1, sizeof(sdp_decoder));
+    if (!d)
+    {
+        fprintf(stderr, "ERROR: Failed to allocate decoder\n");
+        goto out;
+    }
+    d->format = format;
+    d->fd = fd;
+
+    d->path = strdup(path);
+    d->input = malloc(INPUT_SIZE);
+    if (!d->path || !d->input)
+    {
+        fprintf(stderr, "ERROR: Failed to allocate decoder\n");
+        goto free_decoder;
+    }
+
+    if (init_backend(d))
+    {
+        fprintf(stderr, "ERROR: Failed to initialize %s decoder\n", formats[format].name);
+        end_backend(d);
+        goto free_decoder;
+    }
+
+    *decoder = d;
+    return 0;
+
+free_decoder:
+    free(d->input);
+    free(d->path);
+    free(d);
+out:
+    return -1;
+}
+
+const char *sdp_decoder_format(const sdp_decoder *decoder)
+{
+    return formats[decoder->format].name;
+}
+
+// Decode up to length bytes into buf. Returns the number of bytes decoded, 0 at
+// the end of the data or -1 on error.
+ssize_t sdp_decoder_read(sdp_decoder *d, void *buf, size_t length)
+{
+    size_t total = 0;
+    while (total < length && !d->done)
+    {
+        if (d->input_pos == d->input_length && !d->input_eof)
+        {
+            ssize_t n = read(d->fd, d->input, INPUT_SIZE);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+            {
+                fprintf(stderr, "ERROR: Failed to read file \"%s\": %s\n", d->path, strerror(errno));
+                return -1;
+            }
+            d->input_pos = 0;
+            d->input_length = n;
+            d->input_eof = !n;
+        }
+
+        size_t consumed = d->input_pos;
+        size_t produced;
+        const char *error;
+        if (step_backend(d, (unsigned char *)buf + total, length - total, &produced, &error))
+        {
+            fprintf(stderr, "ERROR: Failed to decompress \"%s\": %s\n", d->path, error);
+            return -1;
+        }
+        total += produced;
+
+        // Without new input, the decoder must either produce data or be done
+        if (!produced && consumed == d->input_pos && d->input_eof && !d->done)
+        {
+            fprintf(stderr, "ERROR: Failed to decompress \"%s\": unexpected end of file\n", d->path);
+            return -1;
+        }
+    }
+    return total;
+}
+
+// Doesn't close the file
+void sdp_decoder_free(sdp_decoder *d)
+{
+    end_backend(d);
+    free(d->input);
+    free(d->path);
+    free(d);
+}
@@ -0,0 +1,20 @@
+#ifndef DECOMPRESS_H_
+#define DECOMPRESS_H_
+
+#include <sys/types.h>
+
+/*
+ * Streaming decoders for compressed images (gzip, xz, zstd), which are detected
+ * by their magic bytes. Each format is only available if its library was found
+ * at build time.
+ */
+
+struct sdp_decoder_;
+typedef struct sdp_decoder_ sdp_decoder;
+
+int sdp_decoder_open(int fd, const char *path, sdp_decoder **decoder);
+const char *sdp_decoder_format(const sdp_decoder *decoder);
+ssize_t sdp_decoder_read(sdp_decoder *decoder, void *buf, size_t length);
+void sdp_decoder_free(sdp_decoder *decoder);
+
+#endif
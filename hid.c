@@ -0,0 +1,102 @@
+#include "transport.h"
+#include <errno.h>
+#include <hidapi/hidapi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// hidapi-hidraw transport: one synchronous write() per report
+
+struct hid_sdp_device
+{
+    sdp_device base;
+    hid_device *handle;
+    char *devnode;
+    char error[256];
+};
+
+// hidapi doesn't tell a failed call on a device that went away from other
+// failures: it went away if its node is removed, which follows the unplug
+// within a few milliseconds
+static bool device_gone(struct hid_sdp_device *dev)
+{
+    for (int i = 0; i < 10; ++i)
+    {
+        if (access(dev->devnode, F_OK) && errno == ENOENT)
+            return true;
+        usleep(5000);
+    }
+    return false;
+}
+
+static sdp_device *hid_transport_open(const char *devnode)
+{
+    struct hid_sdp_device *dev = calloc(1, sizeof(struct hid_sdp_device));
+    if (!dev)
+    {
+        fprintf(stderr, "ERROR: Failed to allocate device\n");
+        return NULL;
+    }
+    dev->base.transport = &sdp_hid_transport;
+
+    dev->devnode = strdup(devnode);
+    if (!dev->devnode)
+    {
+        fprintf(stderr, "ERROR: Failed to allocate device\n");
+        free(dev);
+        return NULL;
+    }
+    dev->handle = hid_open_path(devnode);
+    if (!dev->handle)
+    {
+        fprintf(stderr, "ERROR: Failed to open device: %ls\n", hid_error(NULL));
+        free(dev->devnode);
+        free(dev);
+        return NULL;
+    }
+    return &dev->base;
+}
+
+static void hid_transport_close(sdp_device *base)
+{
+    struct hid_sdp_device *dev = (struct hid_sdp_device *)base;
+    hid_close(dev->handle);
+    free(dev->devnode);
+    free(dev);
+}
+
+static int hid_transport_write(sdp_device *base, const unsigned char *buf, size_t length)
+{
+    struct hid_sdp_device *dev = (struct hid_sdp_device *)base;
+    int res = hid_write(dev->handle, buf, length);
+    if (res < 0)
+        dev->base.disconnected = device_gone(dev);
+    return res;
+}
+
+static int hid_transport_read(sdp_device *base, unsigned char *buf, size_t length, int timeout)
+{
+    struct hid_sdp_device *dev = (struct hid_sdp_device *)base;
+    int res = hid_read_timeout(dev->handle, buf, length, timeout);
+    if (res < 0)
+        dev->base.disconnected = device_gone(dev);
+    return res;
+}
+
+static const char *hid_transport_error(sdp_device *base)
+{
+    struct hid_sdp_device *dev = (struct hid_sdp_device *)base;
+    const wchar_t *error = hid_error(dev->handle);
+    snprintf(dev->error, sizeof(dev->error), "%ls", error ? error : L"unknown error");
+    return dev->error;
+}
+
+const struct sdp_transport sdp_hid_transport = {
+    .name = "hidapi",
+    .open = hid_transport_open,
+    .close = hid_transport_close,
+    .write = hid_transport_write,
+    .read = hid_transport_read,
+    .error = hid_transport_error,
+};
@@ -0,0 +1,375 @@
+#include "hotplug.h"
+#include "config.h"
+#include "sysfs.h"
+#include "trace.h"
+#include <hidapi/hidapi.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef WITH_UDEV
+#include "udev.h"
+#else
+#include <limits.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Once sdp_hotplug_dispatch() is enabled, hotplugs with a USB path don't watch
+ * for devices themselves: whoever owns the single watch (the daemon) hands each
+ * added device to the hotplug of its USB path, which queues it for
+ * sdp_hotplug_wait().
+ */
+
+struct event
+{
+    struct event *next;
+    uint16_t vid;
+    uint16_t pid;
+    char *devnode;
+};
+
+struct sdp_hotplug_
+{
+    sdp_hotplug *next; // in the dispatch list
+    char *usb_path;
+    bool dispatched;
+    pthread_cond_t cond;
+    struct event *events; // oldest first, guarded by dispatch.lock
+#ifdef WITH_UDEV
+    sdp_udev *udev;
+#else
+    int inotify_fd;
+#endif
+};
+
+static struct
+{
+    bool enabled;
+    pthread_mutex_t lock;
+    sdp_hotplug *hotplugs;
+} dispatch = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+void sdp_hotplug_enable_dispatch(void)
+{
+    dispatch.enabled = true;
+}
+
+// Register a hotplug to be handed the devices added at its USB path
+static int add_dispatched(sdp_hotplug *hotplug)
+{
+    pthread_condattr_t attr;
+    if (pthread_condattr_init(&attr))
+        return -1;
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    int err = pthread_cond_init(&hotplug->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (err)
+        return -1;
+
+    hotplug->dispatched = true;
+    pthread_mutex_lock(&dispatch.lock);
+    hotplug->next = dispatch.hotplugs;
+    dispatch.hotplugs = hotplug;
+    pthread_mutex_unlock(&dispatch.lock);
+    return 0;
+}
+
+static void remove_dispatched(sdp_hotplug *hotplug)
+{
+    pthread_mutex_lock(&dispatch.lock);
+    for (sdp_hotplug **i = &dispatch.hotplugs; *i; i = &(*i)->next)
+    {
+        if (*i == hotplug)
+        {
+            *i = hotplug->next;
+            break;
+        }
+    }
+    while (hotplug->events)
+    {
+        struct event *event = hotplug->events;
+        hotplug->events = event->next;
+        free(event->devnode);
+        free(event);
+    }
+    pthread_mutex_unlock(&dispatch.lock);
+    pthread_cond_destroy(&hotplug->cond);
+}
+
+// Hand a device that was added at usb_path to the hotplug watching that path.
+// Returns true if there is one.
+bool sdp_hotplug_dispatch(const char *usb_path, uint16_t vid, uint16_t pid, const char *devnode)
+{
+    bool found = false;
+    pthread_mutex_lock(&dispatch.lock);
+    for (sdp_hotplug *hotplug = dispatch.hotplugs; hotplug; hotplug = hotplug->next)
+    {
+        if (strcmp(hotplug->usb_path, usb_path))
+            continue;
+        found = true;
+
+        struct event *event = calloc(1, sizeof(struct event));
+        if (!event || !(event->devnode = strdup(devnode)))
+        {
+            fprintf(stderr, "ERROR: Allocation failed\n");
+            free(event);
+            break;
+        }
+        event->vid = vid;
+        event->pid = pid;
+        struct event **tail = &hotplug->events;
+        while (*tail)
+            tail = &(*tail)->next;
+        *tail = event;
+        pthread_cond_signal(&hotplug->cond);
+        break;
+    }
+    pthread_mutex_unlock(&dispatch.lock);
+    return found;
+}
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+// Wait up to timeout ms for a matching device to be dispatched, dropping the
+// other ones, like a watch of its own would
+static char *wait_dispatched(sdp_hotplug *hotplug, uint16_t vid, uint16_t pid, int timeout)
+{
+    uint64_t deadline = now_ms() + timeout;
+    struct timespec ts = {.tv_sec = deadline / 1000, .tv_nsec = deadline % 1000 * 1000000};
+    char *result = NULL;
+
+    pthread_mutex_lock(&dispatch.lock);
+    for (;;)
+    {
+        while (!result && hotplug->events)
+        {
+            struct event *event = hotplug->events;
+            hotplug->events = event->next;
+            if (event->vid == vid && event->pid == pid)
+                result = event->devnode;
+            else
+                free(event->devnode);
+            free(event);
+        }
+        if (result || !timeout)
+            break;
+        if (timeout < 0)
+            pthread_cond_wait(&hotplug->cond, &dispatch.lock);
+        else if (pthread_cond_timedwait(&hotplug->cond, &dispatch.lock, &ts) == ETIMEDOUT)
+            timeout = 0; // one last look
+    }
+    pthread_mutex_unlock(&dispatch.lock);
+    return result;
+}
+
+sdp_hotplug *sdp_hotplug_new(const char *usb_path)
+{
+    sdp_hotplug *hotplug = calloc(1, sizeof(sdp_hotplug));
+    if (!hotplug)
+    {
+        fprintf(stderr, "ERROR: Allocation failed\n");
+        return NULL;
+    }
+
+    if (usb_path)
+    {
+        hotplug->usb_path = strdup(usb_path);
+        if (!hotplug->usb_path)
+        {
+            fprintf(stderr, "ERROR: Allocation failed\n");
+            goto free_hotplug;
+        }
+    }
+
+    if (dispatch.enabled && usb_path)
+    {
+        if (add_dispatched(hotplug))
+        {
+            fprintf(stderr, "ERROR: Failed to initialize hotplug\n");
+            goto free_path;
+        }
+        return hotplug;
+    }
+
+#ifdef WITH_UDEV
+    hotplug->udev = sdp_udev_init();
+    if (!hotplug->udev)
+    {
+        fprintf(stderr, "ERROR: Failed to initialize udev\n");
+        goto free_path;
+    }
+#else
+    hotplug->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (hotplug->inotify_fd < 0)
+    {
+        fprintf(stderr, "ERROR: Failed to initialize inotify: %s\n", strerror(errno));
+        goto free_path;
+    }
+    // The node may be created before its permissions are set up
+    if (inotify_add_watch(hotplug->inotify_fd, "/dev", IN_CREATE | IN_ATTRIB) < 0)
+    {
+        fprintf(stderr, "ERROR: Failed to watch /dev: %s\n", strerror(errno));
+        close(hotplug->inotify_fd);
+        goto free_path;
+    }
+#endif
+
+    return hotplug;
+
+free_path:
+    free(hotplug->usb_path);
+free_hotplug:
+    free(hotplug);
+    return NULL;
+}
+
+void sdp_hotplug_free(sdp_hotplug *hotplug)
+{
+    if (hotplug->dispatched)
+        remove_dispatched(hotplug);
+#ifdef WITH_UDEV
+    else
+        sdp_udev_free(hotplug->udev);
+#else
+    else
+        close(hotplug->inotify_fd);
+#endif
+    free(hotplug->usb_path);
+    free(hotplug);
+}
+
+// Find a matching device among the present ones: with a USB path it is looked
+// up in sysfs directly, otherwise all HID devices are enumerated. If devnode is
+// given, only that node is considered.
+static char *find_device(sdp_hotplug *hotplug, uint16_t vid, uint16_t pid, const char *devnode)
+{
+    char *result = NULL;
+
+    if (hotplug->usb_path)
+    {
+        result = sdp_sysfs_hidraw(hotplug->usb_path, vid, pid);
+        if (result && devnode && strcmp(result, devnode))
+        {
+            free(result);
+            result = NULL;
+        }
+        return result;
+    }
+
+    struct hid_device_info * const enumerator = hid_enumerate(vid, pid);
+    for (struct hid_device_info *i = enumerator; !result && i; i = i->next)
+    {
+        if (!devnode || !strcmp(i->path, devnode))
+            result = strdup(i->path);
+    }
+    hid_free_enumeration(enumerator);
+
+    return result;
+}
+
+char *sdp_hotplug_find(sdp_hotplug *hotplug, uint16_t vid, uint16_t pid)
+{
+    return find_device(hotplug, vid, pid, NULL);
+}
+
+#ifdef WITH_UDEV
+static char *wait_watch(sdp_hotplug *hotplug, uint16_t vid, uint16_t pid, int timeout)
+{
+    return sdp_udev_wait(hotplug->udev, vid, pid, hotplug->usb_path, timeout);
+}
+#else
+// Check the hidraw nodes created since the last call
+static char *read_events(sdp_hotplug *hotplug, uint16_t vid, uint16_t pid)
+{
+    char *result = NULL;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+
+    while (!result && (n = read(hotplug->inotify_fd, buf, sizeof(buf))) > 0)
+    {
+        for (char *p = buf; !result && p < buf + n;)
+        {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            p += sizeof(*event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW)
+                result = find_device(hotplug, vid, pid, NULL);
+            else if (event->len && !strncmp(event->name, "hidraw", 6))
+            {
+                char devnode[sizeof("/dev/") + NAME_MAX];
+                snprintf(devnode, sizeof(devnode), "/dev/%s", event->name);
+                result = find_device(hotplug, vid, pid, devnode);
+            }
+        }
+    }
+
+    return result;
+}
+
+// Wait up to timeout ms for a matching device to be added, a negative timeout
+// waits forever. Returns its device node.
+static char *wait_events(sdp_hotplug *hotplug, uint16_t vid, uint16_t pid, int timeout)
+{
+    struct pollfd pollfd = {
+        .fd = hotplug->inotify_fd,
+        .events = POLLIN,
+    };
+    uint64_t deadline = now_ms() + timeout;
+
+    for (;;)
+    {
+        char *result = read_events(hotplug, vid, pid);
+        if (result)
+            return result;
+
+        int remaining = -1;
+        if (timeout >= 0)
+        {
+            uint64_t now = now_ms();
+            if (now >= deadline)
+                return NULL;
+            remaining = deadline - now;
+        }
+        if (poll(&pollfd, 1, remaining) < 0 && errno != EINTR)
+        {
+            fprintf(stderr, "ERROR: poll failed: %s\n", strerror(errno));
+            return NULL;
+        }
+    }
+}
+
+static char *wait_watch(sdp_hotplug *hotplug, uint16_t vid, uint16_t pid, int timeout)
+{
+    uint64_t span = sdp_trace_begin();
+    char *result = wait_events(hotplug, vid, pid, timeout);
+    sdp_trace_end(span, "inotify wait", "found", result != NULL);
+    return result;
+}
+#endif
+
+// Wait up to timeout ms for a matching device to be added, a negative timeout
+// waits forever. Returns its device node.
+char *sdp_hotplug_wait(sdp_hotplug *hotplug, uint16_t vid, uint16_t pid, int timeout)
+{
+    if (!hotplug->dispatched)
+        return wait_watch(hotplug, vid, pid, timeout);
+
+    uint64_t span = sdp_trace_begin();
+    char *result = wait_dispatched(hotplug, vid, pid, timeout);
+    sdp_trace_end(span, "dispatch wait", "found", result != NULL);
+    return result;
+}
@@ -0,0 +1,24 @@
+#ifndef HOTPLUG_H_
+#define HOTPLUG_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Watches for hidraw devices showing up, backed by a udev monitor or, without
+ * udev, an inotify watch on /dev. It is armed on creation, so a device that
+ * re-enumerates after a jump is not missed even if it appears before
+ * sdp_hotplug_wait() is called.
+ */
+
+struct sdp_hotplug_;
+typedef struct sdp_hotplug_ sdp_hotplug;
+
+sdp_hotplug *sdp_hotplug_new(const char *usb_path);
+void sdp_hotplug_free(sdp_hotplug *hotplug);
+char *sdp_hotplug_find(sdp_hotplug *hotplug, uint16_t vid, uint16_t pid);
+char *sdp_hotplug_wait(sdp_hotplug *hotplug, uint16_t vid, uint16_t pid, int timeout);
+void sdp_hotplug_enable_dispatch(void);
+bool sdp_hotplug_dispatch(const char *usb_path, uint16_t vid, uint16_t pid, const char *devnode);
+
+#endif
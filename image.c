@@ -0,0 +1,393 @@
+#include "image.h"
+#include "decompress.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Smallest buffer a compressed image is decoded into, before it grows
+#define DECODE_MIN_SIZE (1024 * 1024)
+
+/*
+ * Images are loaded into memory once and shared by every later write_file step
+ * (and board) that refers to the same path. A rebuilt image is picked up via
+ * inotify watches on the images' directories; without inotify, the cached
+ * (inode, mtime, size) is compared against stat() instead.
+ */
+
+struct sdp_image_
+{
+    char *path;
+    const char *name; // last path component, for matching inotify events
+    unsigned char *data;
+    size_t size;
+    bool locked;
+    bool borrowed; // data is owned by someone else, see sdp_image_wrap()
+    atomic_int refs;
+
+    // Only used while the image is in the cache, protected by cache.lock
+    struct stat stat;
+    int wd;
+    sdp_image *next;
+};
+
+static struct
+{
+    bool enabled;
+    bool lock;
+    int inotify_fd;
+    pthread_mutex_t lock_mutex;
+    sdp_image *images;
+} cache = {
+    .inotify_fd = -1,
+    .lock_mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+int sdp_image_cache_init(bool lock)
+{
+    cache.enabled = true;
+    cache.lock = lock;
+    cache.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (cache.inotify_fd < 0)
+        fprintf(stderr, "WARN: inotify unavailable, falling back to stat(): %s\n", strerror(errno));
+    return 0;
+}
+
+void sdp_image_cache_free(void)
+{
+    pthread_mutex_lock(&cache.lock_mutex);
+    while (cache.images)
+    {
+        sdp_image *image = cache.images;
+        cache.images = image->next;
+        sdp_image_put(image);
+    }
+    if (cache.inotify_fd >= 0)
+        close(cache.inotify_fd);
+    cache.inotify_fd = -1;
+    cache.enabled = false;
+    pthread_mutex_unlock(&cache.lock_mutex);
+}
+
+bool sdp_image_cache_enabled(void)
+{
+    return cache.enabled;
+}
+
+static int read_image(sdp_image *image, int fd)
+{
+    if ((uint64_t)image->stat.st_size > SIZE_MAX)
+    {
+        fprintf(stderr, "ERROR: \"%s\" is too large\n", image->path);
+        return -1;
+    }
+    image->size = image->stat.st_size;
+    image->data = malloc(image->size ? image->size : 1);
+    if (!image->data)
+    {
+        fprintf(stderr, "ERROR: Failed to allocate %zu bytes for \"%s\"\n", image->size, image->path);
+        return -1;
+    }
+
+    size_t length = 0;
+    while (length < image->size)
+    {
+        ssize_t n = read(fd, image->data + length, image->size - length);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            fprintf(stderr, "ERROR: Failed to read file \"%s\": %s\n", image->path,
+                    n < 0 ? strerror(errno) : "unexpected end of file");
+            free(image->data);
+            return -1;
+        }
+        length += n;
+    }
+    return 0;
+}
+
+// Decode the whole file into a buffer that grows as needed. The size sent with
+// WRITE_FILE is the decoded length, so no header has to declare it.
+static int decode_image(sdp_image *image, sdp_decoder *decoder)
+{
+    // Start from a guess at the compression ratio
+    size_t capacity = DECODE_MIN_SIZE;
+    if ((uint64_t)image->stat.st_size < SIZE_MAX / 4 && (size_t)image->stat.st_size * 4 > capacity)
+        capacity = image->stat.st_size * 4;
+    unsigned char *data = malloc(capacity);
+    if (!data)
+        goto alloc_failed;
+
+    size_t length = 0;
+    ssize_t n;
+    while ((n = sdp_decoder_read(decoder, data + length, capacity - length)) > 0)
+    {
+        length += n;
+        if (length < capacity)
+            continue;
+        if (capacity > SIZE_MAX / 2)
+        {
+            fprintf(stderr, "ERROR: \"%s\" is too large\n", image->path);
+            goto free_data;
+        }
+        capacity *= 2;
+        unsigned char *grown = realloc(data, capacity);
+        if (!grown)
+            goto alloc_failed;
+        data = grown;
+    }
+    if (n < 0)
+        goto free_data;
+
+    // Give back what the guess overshot
+    unsigned char *fitted = realloc(data, length ? length : 1);
+    image->data = fitted ? fitted : data;
+    image->size = length;
+    return 0;
+
+alloc_failed:
+    fprintf(stderr, "ERROR: Failed to allocate %zu bytes for \"%s\"\n", capacity, image->path);
+free_data:
+    free(data);
+    return -1;
+}
+
+static sdp_image *load_image(const char *path)
+{
+    sdp_image *image = calloc(1, sizeof(sdp_image));
+    if (!image)
+    {
+        fprintf(stderr, "ERROR: Failed to allocate image\n");
+        goto out;
+    }
+    atomic_init(&image->refs, 1);
+    image->wd = -1;
+
+    image->path = strdup(path);
+    if (!image->path)
+    {
+        fprintf(stderr, "ERROR: Failed to allocate file path\n");
+        goto free_image;
+    }
+    const char *slash = strrchr(image->path, '/');
+    image->name = slash ? slash + 1 : image->path;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "ERROR: Failed to open file \"%s\": %s\n", path, strerror(errno));
+        goto free_path;
+    }
+
+    if (fstat(fd, &image->stat))
+    {
+        fprintf(stderr, "ERROR: Failed to stat file \"%s\": %s\n", path, strerror(errno));
+        goto close_fd;
+    }
+
+    // Compressed images are decoded while they are read, and kept decoded
+    sdp_decoder *decoder;
+    if (sdp_decoder_open(fd, path, &decoder))
+        goto close_fd;
+    if (decoder)
+    {
+        int res = decode_image(image, decoder);
+        sdp_decoder_free(decoder);
+        if (res)
+            goto close_fd;
+    }
+    else if (read_image(image, fd))
+        goto close_fd;
+    close(fd);
+
+    if (cache.lock && image->size)
+    {
+        if (mlock(image->data, image->size))
+            fprintf(stderr, "WARN: Failed to lock \"%s\" in memory: %s\n", path, strerror(errno));
+        else
+            image->locked = true;
+    }
+
+    return image;
+
+close_fd:
+    close(fd);
+free_path:
+    free(image->path);
+free_image:
+    free(image);
+out:
+    return NULL;
+}
+
+static void drop_image(sdp_image **link)
+{
+    sdp_image *image = *link;
+    *link = image->next;
+    sdp_image_put(image);
+}
+
+// Process pending inotify events, dropping every image that was changed
+static void invalidate_changed(void)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while ((n = read(cache.inotify_fd, buf, sizeof(buf))) > 0)
+    {
+        for (char *p = buf; p < buf + n;)
+        {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + event->len;
+
+            for (sdp_image **link = &cache.images; *link;)
+            {
+                sdp_image *image = *link;
+                bool changed = (event->mask & IN_Q_OVERFLOW) ||
+                               (event->wd == image->wd && event->len &&
+                                !strcmp(event->name, image->name));
+                if (changed)
+                    drop_image(link);
+                else
+                    link = &image->next;
+            }
+        }
+    }
+}
+
+static bool unchanged(const sdp_image *image)
+{
+    struct stat st;
+    return !stat(image->path, &st) && st.st_dev == image->stat.st_dev &&
+           st.st_ino == image->stat.st_ino && st.st_size == image->stat.st_size &&
+           st.st_mtim.tv_sec == image->stat.st_mtim.tv_sec &&
+           st.st_mtim.tv_nsec == image->stat.st_mtim.tv_nsec;
+}
+
+static int watch_directory(const char *path)
+{
+    char dir[PATH_MAX];
+    if (snprintf(dir, sizeof(dir), "%s", path) >= (int)sizeof(dir))
+        return -1;
+
+    int wd = inotify_add_watch(cache.inotify_fd, dirname(dir),
+                               IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_ATTRIB);
+    if (wd < 0)
+        fprintf(stderr, "WARN: Failed to watch \"%s\": %s\n", dir, strerror(errno));
+    return wd;
+}
+
+// Returns a reference to the contents of the file at path, which must be
+// released with sdp_image_put()
+sdp_image *sdp_image_get(const char *path)
+{
+    if (!cache.enabled)
+        return load_image(path);
+
+    pthread_mutex_lock(&cache.lock_mutex);
+
+    if (cache.inotify_fd >= 0)
+        invalidate_changed();
+
+    sdp_image *image = NULL;
+    for (sdp_image **link = &cache.images; *link; link = &(*link)->next)
+    {
+        if (strcmp((*link)->path, path))
+            continue;
+        if (cache.inotify_fd < 0 && !unchanged(*link))
+        {
+            drop_image(link);
+            break;
+        }
+        image = sdp_image_ref(*link);
+        goto unlock;
+    }
+
+    // Watch before reading, so that changes during the load aren't missed
+    int wd = cache.inotify_fd >= 0 ? watch_directory(path) : -1;
+    image = load_image(path);
+    if (!image)
+        goto unlock;
+    image->wd = wd;
+    if (cache.inotify_fd < 0 || wd >= 0)
+    {
+        image->next = cache.images;
+        cache.images = sdp_image_ref(image);
+    }
+
+unlock:
+    pthread_mutex_unlock(&cache.lock_mutex);
+    return image;
+}
+
+// An image of memory that isn't owned by the image, e.g. mapped from a bundle,
+// which must stay valid until the last reference is put. It is never cached.
+sdp_image *sdp_image_wrap(const char *path, const unsigned char *data, size_t size)
+{
+    sdp_image *image = calloc(1, sizeof(sdp_image));
+    if (!image)
+    {
+        fprintf(stderr, "ERROR: Failed to allocate image\n");
+        return NULL;
+    }
+    atomic_init(&image->refs, 1);
+    image->wd = -1;
+    image->borrowed = true;
+    image->data = (unsigned char *)data;
+    image->size = size;
+
+    image->path = strdup(path);
+    if (!image->path)
+    {
+        fprintf(stderr, "ERROR: Failed to allocate file path\n");
+        free(image);
+        return NULL;
+    }
+    const char *slash = strrchr(image->path, '/');
+    image->name = slash ? slash + 1 : image->path;
+    return image;
+}
+
+sdp_image *sdp_image_ref(sdp_image *image)
+{
+    atomic_fetch_add(&image->refs, 1);
+    return image;
+}
+
+void sdp_image_put(sdp_image *image)
+{
+    if (!image || atomic_fetch_sub(&image->refs, 1) > 1)
+        return;
+
+    if (image->locked)
+        munlock(image->data, image->size);
+    if (!image->borrowed)
+        free(image->data);
+    free(image->path);
+    free(image);
+}
+
+const char *sdp_image_path(const sdp_image *image)
+{
+    return image->path;
+}
+
+const unsigned char *sdp_image_data(const sdp_image *image)
+{
+    return image->data;
+}
+
+size_t sdp_image_size(const sdp_image *image)
+{
+    return image->size;
+}
@@ -0,0 +1,21 @@
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct sdp_image_;
+typedef struct sdp_image_ sdp_image;
+
+int sdp_image_cache_init(bool lock);
+void sdp_image_cache_free(void);
+bool sdp_image_cache_enabled(void);
+sdp_image *sdp_image_get(const char *path);
+sdp_image *sdp_image_wrap(const char *path, const unsigned char *data, size_t size);
+sdp_image *sdp_image_ref(sdp_image *image);
+void sdp_image_put(sdp_image *image);
+const char *sdp_image_path(const sdp_image *image);
+const unsigned char *sdp_image_data(const sdp_image *image);
+size_t sdp_image_size(const sdp_image *image);
+
+#endif
@@ -0,0 +1,248 @@
+#include "imx.h"
+#include <endian.h>
+#include <stdio.h>
+#include <string.h>
+
+#define IVT_TAG 0xd1
+#define DCD_TAG 0xd2
+#define DCD_VERSION 0x41
+#define DCD_WRITE_DATA_TAG 0xcc
+
+#define IVT_SEARCH_STEP 0x400
+#define IVT_SEARCH_LIMIT 0x8000
+
+// Find the IVT at the start of the image or at one of the usual 1 KiB aligned
+// offsets (e.g. 0x400 for images that contain the boot device header)
+int imx_find_ivt(const unsigned char *buf, size_t length, size_t *offset, struct imx_ivt *ivt)
+{
+    for (size_t i = 0; i < IVT_SEARCH_LIMIT && i + sizeof(*ivt) <= length; i += IVT_SEARCH_STEP)
+    {
+        memcpy(ivt, buf + i, sizeof(*ivt));
+        if (ivt->tag != IVT_TAG || be16toh(ivt->length) != sizeof(*ivt) ||
+            (ivt->version & 0xf0) != 0x40)
+            continue;
+
+        ivt->entry = le32toh(ivt->entry);
+        ivt->dcd = le32toh(ivt->dcd);
+        ivt->boot_data = le32toh(ivt->boot_data);
+        ivt->self = le32toh(ivt->self);
+        ivt->csf = le32toh(ivt->csf);
+        *offset = i;
+        return 0;
+    }
+
+    return -1;
+}
+
+// Locate the DCD table the IVT points to within the image
+int imx_find_dcd(const unsigned char *buf, size_t length, size_t ivt_offset, const struct imx_ivt *ivt,
+                 size_t *dcd_offset, size_t *dcd_length)
+{
+    if (!ivt->dcd)
+    {
+        fprintf(stderr, "ERROR: Image has no DCD\n");
+        return -1;
+    }
+    if (ivt->dcd < ivt->self || ivt->dcd - ivt->self > length - ivt_offset - 4)
+    {
+        fprintf(stderr, "ERROR: DCD pointer 0x%08x outside of the image\n", ivt->dcd);
+        return -1;
+    }
+
+    size_t offset = ivt_offset + (ivt->dcd - ivt->self);
+    const unsigned char *dcd = buf + offset;
+    size_t dcd_len = (dcd[1] << 8) | dcd[2];
+    if (dcd[0] != DCD_TAG || (dcd[3] & 0xf0) != 0x40 || dcd_len < 4)
+    {
+        fprintf(stderr, "ERROR: Invalid DCD header at offset 0x%zx\n", offset);
+        return -1;
+    }
+    if (dcd_len > IMX_DCD_MAX_LENGTH || dcd_len > length - offset)
+    {
+        fprintf(stderr, "ERROR: DCD too large (%zu bytes)\n", dcd_len);
+        return -1;
+    }
+
+    *dcd_offset = offset;
+    *dcd_length = dcd_len;
+    return 0;
+}
+
+static void put_be16(unsigned char *buf, uint16_t value)
+{
+    buf[0] = value >> 8;
+    buf[1] = value;
+}
+
+static void put_be32(unsigned char *buf, uint32_t value)
+{
+    put_be16(buf, value >> 16);
+    put_be16(buf + 2, value);
+}
+
+// Length of the DCD imx_build_dcd() creates for the writes
+size_t imx_dcd_length(const struct imx_register_write *writes, int count)
+{
+    size_t length = 4;
+    for (int i = 0; i < count; ++i)
+    {
+        // Consecutive writes of the same width share a write data command
+        if (!i || writes[i].width != writes[i - 1].width)
+            length += 4;
+        length += 8;
+    }
+    return length;
+}
+
+// Build a DCD that performs the writes in order, returns its length or 0 if it
+// doesn't fit into buf
+size_t imx_build_dcd(unsigned char *buf, size_t size, const struct imx_register_write *writes, int count)
+{
+    size_t length = imx_dcd_length(writes, count);
+    if (length > size || length > IMX_DCD_MAX_LENGTH)
+        return 0;
+
+    buf[0] = DCD_TAG;
+    put_be16(buf + 1, length);
+    buf[3] = DCD_VERSION;
+
+    unsigned char *command = NULL;
+    size_t offset = 4;
+    for (int i = 0; i < count; ++i)
+    {
+        if (!i || writes[i].width != writes[i - 1].width)
+        {
+            command = buf + offset;
+            command[0] = DCD_WRITE_DATA_TAG;
+            put_be16(command + 1, 4);
+            command[3] = writes[i].width; // no flags: plain write
+            offset += 4;
+        }
+        put_be32(buf + offset, writes[i].address);
+        put_be32(buf + offset + 4, writes[i].value);
+        put_be16(command + 1, buf + offset + 8 - command);
+        offset += 8;
+    }
+    return length;
+}
+
+#define CONTAINER_TAG 0x87
+#define CONTAINER_SEARCH_STEP 0x400
+#define MAX_CONTAINERS 4 // e.g. the SECO and the boot image container of flash.bin
+
+struct container_header
+{
+    uint8_t version;
+    uint16_t length;
+    uint8_t tag;
+    uint32_t flags;
+    uint16_t sw_version;
+    uint8_t fuse_version;
+    uint8_t num_images;
+    uint16_t sig_blk_offset;
+    uint16_t reserved;
+} __attribute__((packed));
+
+struct container_image
+{
+    uint32_t offset;
+    uint32_t size;
+    uint64_t dst;
+    uint64_t entry;
+    uint32_t flags;
+    uint32_t meta;
+    uint8_t hash[64];
+    uint8_t iv[32];
+} __attribute__((packed));
+
+// Length of the image described by the i.MX8/9 container headers at the start
+// of buf, up to the end of the last image or signature block
+static int container_length(const unsigned char *buf, size_t length, uint64_t *image_length)
+{
+    uint64_t end = 0;
+    size_t offset = 0;
+    int count = 0;
+
+    while (count < MAX_CONTAINERS && offset + sizeof(struct container_header) <= length)
+    {
+        struct container_header hdr;
+        memcpy(&hdr, buf + offset, sizeof(hdr));
+        if (hdr.tag != CONTAINER_TAG)
+            break;
+
+        size_t images_end = sizeof(hdr) + hdr.num_images * sizeof(struct container_image);
+        if (offset + images_end > length)
+        {
+            fprintf(stderr, "ERROR: Truncated container header at offset 0x%zx\n", offset);
+            return -1;
+        }
+
+        for (int i = 0; i < hdr.num_images; ++i)
+        {
+            struct container_image img;
+            memcpy(&img, buf + offset + sizeof(hdr) + i * sizeof(img), sizeof(img));
+            uint64_t img_end = offset + (uint64_t)le32toh(img.offset) + le32toh(img.size);
+            if (img_end > end)
+                end = img_end;
+        }
+
+        uint16_t sig_blk_offset = le16toh(hdr.sig_blk_offset);
+        if (sig_blk_offset && offset + sig_blk_offset + 4 <= length)
+        {
+            // The signature block header has the same layout as the container's
+            uint16_t sig_blk_length;
+            memcpy(&sig_blk_length, buf + offset + sig_blk_offset + 1, sizeof(sig_blk_length));
+            uint64_t sig_end = offset + sig_blk_offset + le16toh(sig_blk_length);
+            if (sig_end > end)
+                end = sig_end;
+        }
+
+        count++;
+        offset += CONTAINER_SEARCH_STEP;
+    }
+
+    if (!count)
+        return -1;
+    *image_length = end;
+    return 0;
+}
+
+// Length of the image as declared by its headers: the container headers on
+// i.MX8/9, or the IVT's boot data (which covers the image from its start
+// address, including any CSF)
+int imx_image_length(const unsigned char *buf, size_t length, uint64_t *image_length)
+{
+    if (!container_length(buf, length, image_length))
+        return 0;
+
+    size_t ivt_offset;
+    struct imx_ivt ivt;
+    if (imx_find_ivt(buf, length, &ivt_offset, &ivt))
+    {
+        fprintf(stderr, "ERROR: Neither an IVT nor a container header found\n");
+        return -1;
+    }
+
+    if (ivt.boot_data < ivt.self || ivt.boot_data - ivt.self > length - ivt_offset - sizeof(struct imx_boot_data))
+    {
+        fprintf(stderr, "ERROR: Boot data pointer 0x%08x outside of the image\n", ivt.boot_data);
+        return -1;
+    }
+    struct imx_boot_data boot_data;
+    memcpy(&boot_data, buf + ivt_offset + (ivt.boot_data - ivt.self), sizeof(boot_data));
+    boot_data.start = le32toh(boot_data.start);
+    boot_data.length = le32toh(boot_data.length);
+
+    // The file starts ivt_offset bytes before the IVT; boot_data.start usually
+    // is lower than that, as it includes the boot device header the ROM skips
+    uint64_t image_start = (uint64_t)ivt.self - ivt_offset;
+    uint64_t end = (uint64_t)boot_data.start + boot_data.length;
+    if (ivt.self < ivt_offset || end <= (uint64_t)ivt.self + sizeof(ivt))
+    {
+        fprintf(stderr, "ERROR: Invalid boot data (start: 0x%08x, length: %u)\n",
+                boot_data.start, boot_data.length);
+        return -1;
+    }
+    *image_length = end - image_start;
+    return 0;
+}
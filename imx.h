@@ -0,0 +1,46 @@
+#ifndef IMX_H_
+#define IMX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Image Vector Table, as found in i.MX boot images
+struct imx_ivt
+{
+    uint8_t tag;
+    uint16_t length;
+    uint8_t version;
+    uint32_t entry;
+    uint32_t reserved1;
+    uint32_t dcd;
+    uint32_t boot_data;
+    uint32_t self;
+    uint32_t csf;
+    uint32_t reserved2;
+} __attribute__((packed));
+
+struct imx_boot_data
+{
+    uint32_t start;
+    uint32_t length;
+    uint32_t plugin;
+} __attribute__((packed));
+
+#define IMX_IVT_DCD_OFFSET 12 // offset of the DCD pointer within the IVT
+#define IMX_DCD_MAX_LENGTH 1768 // limit of the ROM's DCD buffer
+
+struct imx_register_write
+{
+    uint32_t address;
+    uint32_t value;
+    uint8_t width; // bytes
+};
+
+int imx_find_ivt(const unsigned char *buf, size_t length, size_t *offset, struct imx_ivt *ivt);
+int imx_find_dcd(const unsigned char *buf, size_t length, size_t ivt_offset, const struct imx_ivt *ivt,
+                 size_t *dcd_offset, size_t *dcd_length);
+size_t imx_dcd_length(const struct imx_register_write *writes, int count);
+size_t imx_build_dcd(unsigned char *buf, size_t size, const struct imx_register_write *writes, int count);
+int imx_image_length(const unsigned char *buf, size_t length, uint64_t *image_length);
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef IMXSDP_H_
+#define IMXSDP_H_
+
+/*
+ * libimxsdp: boots boards from plans built in memory (see stages.h and steps.h;
+ * sdp_image_wrap() takes images from buffers). A session runs the stages on one
+ * board in a thread of its own and queues their events. Its fd becomes
+ * readable whenever there are events to process, so a single event loop can
+ * drive many boards.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "image.h"
+#include "report.h"
+#include "stages.h"
+#include <stdbool.h>
+
+struct sdp_session_;
+typedef struct sdp_session_ sdp_session;
+
+enum sdp_session_state
+{
+    SDP_SESSION_RUNNING,
+    SDP_SESSION_DONE,
+    SDP_SESSION_FAILED,
+};
+
+// Called from sdp_session_process(), for each event in order
+typedef void (*sdp_session_callback)(sdp_session *session, const struct sdp_report_event *event,
+                                     void *ctx);
+
+// Selects the transport as "NAME[:OPTIONS]" (NULL: hidapi), and silences the
+// progress text
+int sdp_library_init(const char *transport);
+void sdp_library_exit(void);
+
+// The stages must be prepared (sdp_prepare_stages()), and outlive the session
+sdp_session *sdp_session_start(const sdp_stages *stages, const char *usb_path, bool initial_wait,
+                               sdp_session_callback callback, void *ctx);
+int sdp_session_fd(const sdp_session *session);
+enum sdp_session_state sdp_session_process(sdp_session *session);
+const char *sdp_session_usb_path(const sdp_session *session);
+// Waits for the session to finish if it is still running
+void sdp_session_free(sdp_session *session);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,8 +1,18 @@
 #include "config.h"
+#include "boards.h"
+#include "bundle.h"
+#include "daemon.h"
+#include "image.h"
+#include "record.h"
+#include "report.h"
 #include "stages.h"
 #include "spec.h"
+#include "trace.h"
+#include "transport.h"
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,10 +23,21 @@
 static void usage(const char *progname);
 
 static const struct option longopts[] = {
+	{"all", no_argument, NULL, 'a'},
+	{"bundle", required_argument, NULL, 'b'},
+	{"build-bundle", required_argument, NULL, 'B'},
+	{"cache", optional_argument, NULL, 'c'},
+	{"daemon", no_argument, NULL, 'd'},
 	{"directory", no_argument, NULL, 'C'},
+	{"events", required_argument, NULL, 'e'},
 	{"help", no_argument, NULL, 'h'},
 	{"path", required_argument, NULL, 'p'},
+	{"record", required_argument, NULL, 'o'},
+	{"report", required_argument, NULL, 'r'},
 	{"spec", required_argument, NULL, 's'},
+	{"timeout", required_argument, NULL, 't'},
+	{"trace", required_argument, NULL, 'R'},
+	{"transport", required_argument, NULL, 'T'},
 	{"version", no_argument, NULL, 'V'},
 	{"wait", no_argument, NULL, 'w'},
 	{0},
@@ -31,25 +52,107 @@ int main(int argc, char *argv[])
 	int opt;
 	const char *dir = NULL;
 	const char *usb_path = NULL;
+	char **usb_paths = NULL;
+	int usb_path_count = 0;
+	bool all_boards = false;
+	bool daemon = false;
+	bool cache = false;
+	bool lock_cache = false;
 	const char *spec = NULL;
+	const char *bundle_path = NULL;
+	const char *build_bundle = NULL;
 	bool initial_wait = false;
+	int timeout = -1;
+	const char *report_path = NULL;
+	const char *trace_path = NULL;
+	const char *record_path = NULL;
+	int event_fd = -1;
 
-	while ((opt = getopt_long(argc, argv, "hC:p:s:wV", longopts, NULL)) != -1)
+	while ((opt = getopt_long(argc, argv, "ab:B:c::de:hC:o:p:r:R:s:t:T:wV", longopts, NULL)) != -1)
 	{
 		switch (opt)
 		{
+		case 'a':
+			all_boards = true;
+			break;
+		case 'b':
+			bundle_path = optarg;
+			break;
+		case 'B':
+			build_bundle = optarg;
+			break;
+		case 'c':
+			cache = true;
+			if (optarg && !strcmp(optarg, "lock"))
+				lock_cache = true;
+			else if (optarg)
+			{
+				fprintf(stderr, "ERROR: Unknown cache option \"%s\"\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'd':
+			daemon = true;
+			break;
 		case 'C':
 			dir = optarg;
 			break;
+		case 'e':
+			{
+				char *end;
+				long l = strtol(optarg, &end, 10);
+				if (optarg == end || *end || l < 0 || l > INT_MAX || fcntl(l, F_GETFD) < 0)
+				{
+					fprintf(stderr, "ERROR: Invalid event file descriptor \"%s\"\n", optarg);
+					return EXIT_FAILURE;
+				}
+				event_fd = l;
+			}
+			break;
 		case 'h':
 			usage(argv[0]);
 			return EXIT_SUCCESS;
+		case 'o':
+			record_path = optarg;
+			break;
 		case 'p':
-			usb_path = optarg;
+			{
+				char **tmp = realloc(usb_paths, (usb_path_count + 1) * sizeof(char *));
+				if (!tmp)
+				{
+					fprintf(stderr, "ERROR: Failed to allocate USB path list\n");
+					return EXIT_FAILURE;
+				}
+				usb_paths = tmp;
+				usb_paths[usb_path_count++] = optarg;
+				usb_path = usb_paths[0];
+			}
+			break;
+		case 'r':
+			report_path = optarg;
+			break;
+		case 'R':
+			trace_path = optarg;
 			break;
 		case 's':
 			spec = optarg;
 			break;
+		case 't':
+			{
+				char *end;
+				long l = strtol(optarg, &end, 10);
+				if (optarg == end || *end || l < 0 || l > INT_MAX)
+				{
+					fprintf(stderr, "ERROR: Invalid timeout \"%s\"\n", optarg);
+					return EXIT_FAILURE;
+				}
+				timeout = l;
+			}
+			break;
+		case 'T':
+			if (sdp_transport_select(optarg))
+				return EXIT_FAILURE;
+			break;
 		case 'w':
 			initial_wait = true;
 			break;
@@ -61,8 +164,24 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	sdp_stages *stages;
-	if (spec)
+	sdp_stages *stages = NULL;
+	sdp_bundle *bundle = NULL;
+	if (bundle_path)
+	{
+		if (spec || optind < argc)
+		{
+			fprintf(stderr, "ERROR: Neither arguments nor --spec allowed when --bundle is used\n");
+			return EXIT_FAILURE;
+		}
+
+		bundle = sdp_open_bundle(bundle_path, &stages);
+		if (!bundle)
+		{
+			fprintf(stderr, "ERROR: Failed to open bundle\n");
+			return EXIT_FAILURE;
+		}
+	}
+	else if (spec)
 	{
 		if (optind < argc)
 		{
@@ -94,15 +213,97 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	int result = EXIT_FAILURE;
+	if (timeout >= 0)
+		sdp_set_default_timeout(stages, timeout);
+
+	// The bundle is written relative to where we were started, not to --directory
+	char *build_bundle_path = NULL;
+	if (build_bundle && build_bundle[0] != '/')
+	{
+		char *cwd = getcwd(NULL, 0);
+		if (cwd)
+			build_bundle_path = malloc(strlen(cwd) + strlen(build_bundle) + 2);
+		if (!build_bundle_path)
+		{
+			fprintf(stderr, "ERROR: Failed to resolve bundle path\n");
+			free(cwd);
+			goto free_stages;
+		}
+		sprintf(build_bundle_path, "%s/%s", cwd, build_bundle);
+		free(cwd);
+		build_bundle = build_bundle_path;
+	}
+
 	if (dir && chdir(dir))
 	{
 		fprintf(stderr, "ERROR: Failed to change directory: %s\n", strerror(errno));
-		return EXIT_FAILURE;
+		goto free_stages;
+	}
+
+	if ((all_boards || daemon) && usb_path_count)
+	{
+		fprintf(stderr, "ERROR: --path cannot be combined with --all or --daemon\n");
+		goto free_stages;
+	}
+
+	// Images are reused across boards, so keep them in memory
+	if ((cache || daemon || all_boards || usb_path_count > 1) && sdp_image_cache_init(lock_cache))
+		goto free_stages;
+
+	// Every image is loaded and checked before the first device is touched
+	if (sdp_prepare_stages(stages))
+		goto free_cache;
+
+	if (sdp_report_init(report_path, event_fd))
+		goto free_cache;
+	if (trace_path && sdp_trace_init(trace_path))
+	{
+		sdp_report_finish();
+		goto free_cache;
+	}
+	if (record_path && sdp_record_init(record_path))
+	{
+		sdp_report_finish();
+		sdp_trace_finish();
+		goto free_cache;
 	}
 
-	int result = sdp_execute_stages(stages, initial_wait, usb_path);
+	if (build_bundle)
+	{
+		if (!sdp_write_bundle(build_bundle, stages))
+			result = EXIT_SUCCESS;
+	}
+	else if (daemon)
+		result = sdp_run_daemon(stages);
+	else if (all_boards)
+	{
+		char **found = sdp_find_boards(stages, &usb_path_count);
+		if (found)
+			result = sdp_execute_boards(stages, initial_wait, found, usb_path_count);
+		sdp_free_boards(found, usb_path_count);
+	}
+	else if (usb_path_count > 1)
+		result = sdp_execute_boards(stages, initial_wait, usb_paths, usb_path_count);
+	else
+		result = sdp_execute_stages(stages, initial_wait, usb_path);
+
+	if (sdp_report_finish())
+		result = EXIT_FAILURE;
+	if (sdp_trace_finish())
+		result = EXIT_FAILURE;
+	if (sdp_record_finish())
+		result = EXIT_FAILURE;
 
+free_cache:
+	sdp_image_cache_free();
+free_stages:
 	sdp_free_stages(stages);
+	// The stages' images are backed by the bundle
+	if (bundle)
+		sdp_close_bundle(bundle);
+	free(build_bundle_path);
+	free(usb_paths);
 
 	return result;
 }
@@ -114,28 +315,85 @@ static void usage(const char *progname)
 		"\n"
 		"The following OPTIONs are available:\n"
 		"\n"
+		"  -a, --all  boot all devices matching the first stage in parallel\n"
+		"  -b, --bundle  run the stages and images stored in a bundle file\n"
+		"  -B, --build-bundle  write the stages and their images to a bundle file,\n"
+		"                      instead of running them\n"
+		"  -c, --cache[=lock]  keep images in memory and reuse them until they\n"
+		"                      change on disk (optionally locked into RAM)\n"
 		"  -C, --directory  change working directory, after spec is read\n"
+		"  -d, --daemon  keep running and boot every device matching the first\n"
+		"                stage as it appears\n"
+		"  -e, --events  write a JSON line per stage/step event to the given file\n"
+		"                descriptor while booting\n"
 		"  -h, --help  print this usage message\n"
-		"  -p, --path  specify the USB device path, e.g. 3-1.1\n"
+		"  -o, --record  record every report sent and received, with its timing, to\n"
+		"                a file for the replay transport\n"
+		"  -p, --path  specify the USB device path, e.g. 3-1.1 (repeat to boot\n"
+		"              several boards in parallel)\n"
+		"  -r, --report  write a JSON summary with the timing of every stage and\n"
+		"                step to a file\n"
+		"  -R, --trace  record every report, wait and step as a span, written to a\n"
+		"               file in Chrome trace format (for Perfetto) at exit\n"
 		"  -s, --spec  stage/step spec file\n"
+		"  -t, --timeout  time in ms to wait for each stage's device, unless the\n"
+		"                 stage has its own (default: 5000, 0: forever)\n"
+		"  -T, --transport  USB transport as TRANSPORT[:OPTIONS]\n"
 		"  -V, --version  print version\n"
 		"  -w, --wait  wait for the first stage\n"
 		"\n"
 		"The STAGEs have the following format:\n"
 		"\n"
-		"  <VID>:<PID>[,<STEP>...]\n"
+		"  <VID>:<PID>[:<TIMEOUT>][,<STEP>...]\n"
 		"    VID  USB Vendor ID as 4-digit hex number\n"
 		"    PID  USB Product ID as 4-digit hex number\n"
+		"    TIMEOUT  time in ms to wait for the device (0: forever)\n"
 		"\n"
 		"The STEPs can be one of the following operations:\n"
 		"\n"
-		"  write_file:<FILE>:<ADDRESS>\n"
-		"    Write the contents of FILE to ADDRESS\n"
+		"  write_file:<FILE>:<ADDRESS>[:<OPTION>...]\n"
+		"    Write the contents of FILE to ADDRESS, with the OPTIONs:\n"
+		"      dcd=<SCRATCH>  execute the image's DCD first (loaded to SCRATCH)\n"
+		"                     and clear the DCD pointer in the written IVT\n"
+		"      trim           only write the length declared by the IVT's boot data\n"
+		"                     or the container headers, without padding\n"
+		"      segment=<SIZE> send the file as WRITE_FILE commands of SIZE bytes (K\n"
+		"                     and M suffixes allowed) and resend a failed one\n"
+		"      offset=<SIZE>  write only the part of FILE starting at byte SIZE\n"
+		"      length=<SIZE>  write only SIZE bytes of FILE (default: up to its end)\n"
 		"  jump_address:<ADDRESS>\n"
 		"    Jump to the IMX image located at ADDRESS\n"
+		"  write_register:<ADDRESS>:<VALUE>[:<OPTION>...]\n"
+		"    Write VALUE to the register at ADDRESS, with the OPTIONs:\n"
+		"      width=<BITS>   register width: 8, 16 or 32 (default)\n"
+		"      dcd=<SCRATCH>  write it with a DCD (loaded to SCRATCH), batched with\n"
+		"                     the following write_register steps of the same SCRATCH\n"
+		"  read_register:<ADDRESS>[:<OPTION>...]\n"
+		"    Read and print the register at ADDRESS, with the OPTIONs:\n"
+		"      width=<BITS>   register width: 8, 16 or 32 (default)\n"
+		"      count=<N>      read N consecutive registers with one command\n"
+		"\n"
+		"The following TRANSPORTs are available:\n"
+		"\n"
+		"  hidapi\n"
+		"    One synchronous hidraw write per report (default)\n"
+		"  libusb[:depth=<N>]\n"
+		"    Asynchronous control transfers, keeping up to N reports in flight\n"
+		"    (default: 8); only if built with libusb support\n"
+		"  mock[:latency=<US>,fault=<P>,seed=<N>]\n"
+		"    In-process model of the i.MX ROM, for benchmarking and testing without\n"
+		"    hardware; adds US microseconds per report and fails reports with\n"
+		"    probability P\n"
+		"  replay:file=<FILE>[,scale=<F>]\n"
+		"    Play back a session recorded with --record, failing where the reports\n"
+		"    sent differ; the recorded timing is multiplied by F (default: 1, 0: no\n"
+		"    delays)\n"
 		"\n"
 		"Instead of specifying the stages and steps on the command line, they can be\n"
 		"specified in a YAML file instead (--spec option). Note, that providing the spec\n"
-		"on the command line and in a file are mutually exclusive.\n",
+		"on the command line and in a file are mutually exclusive.\n"
+		"\n"
+		"A bundle built from either of them with --build-bundle holds the stages and\n"
+		"all images in a single file, which is mapped and run with --bundle.\n",
 		progname);
 }
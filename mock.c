@@ -0,0 +1,180 @@
+#include "transport.h"
+#include "rom.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * In-process transport backed by the software ROM model, for measuring and
+ * testing the protocol without hardware. Every device that is looked for is
+ * found immediately, with a fresh ROM behind it.
+ */
+
+struct mock_sdp_device
+{
+    sdp_device base;
+    sdp_rom *rom;
+    unsigned int seed;
+    const char *error;
+};
+
+static struct
+{
+    unsigned int latency; // us per report
+    double fault_rate;    // probability of a report write failing
+    unsigned int seed;
+} options;
+
+static sdp_rom_callback close_callback;
+static void *close_ctx;
+
+void sdp_mock_on_close(sdp_rom_callback callback, void *ctx)
+{
+    close_callback = callback;
+    close_ctx = ctx;
+}
+
+static int parse_option(const char *key, const char *value)
+{
+    char *end;
+    if (!strcmp(key, "latency"))
+        options.latency = strtoul(value, &end, 10);
+    else if (!strcmp(key, "fault"))
+        options.fault_rate = strtod(value, &end);
+    else if (!strcmp(key, "seed"))
+        options.seed = strtoul(value, &end, 10);
+    else
+        return -1;
+    return end == value || *end ? -1 : 0;
+}
+
+// Options: comma separated latency=<us>, fault=<probability>, seed=<n>
+static int mock_transport_init(const char *opts)
+{
+    memset(&options, 0, sizeof(options));
+    options.seed = time(NULL);
+    if (!opts)
+        return 0;
+
+    char *copy = strdup(opts);
+    if (!copy)
+        return 1;
+
+    int res = 0;
+    char *saveptr = NULL;
+    for (char *tok = strtok_r(copy, ",", &saveptr); !res && tok; tok = strtok_r(NULL, ",", &saveptr))
+    {
+        char *eq = strchr(tok, '=');
+        if (eq)
+            *eq = '\0';
+        if (!eq || parse_option(tok, eq + 1))
+        {
+            fprintf(stderr, "ERROR: Invalid mock transport option \"%s\"\n", tok);
+            res = 1;
+        }
+    }
+
+    free(copy);
+    return res;
+}
+
+static sdp_device *mock_transport_find(uint16_t vid, uint16_t pid, const char *usb_path)
+{
+    static unsigned int instance;
+
+    struct mock_sdp_device *dev = calloc(1, sizeof(struct mock_sdp_device));
+    if (!dev)
+    {
+        fprintf(stderr, "ERROR: Failed to allocate device\n");
+        return NULL;
+    }
+    dev->base.transport = &sdp_mock_transport;
+    dev->seed = options.seed + __atomic_fetch_add(&instance, 1, __ATOMIC_RELAXED);
+
+    dev->rom = sdp_rom_new();
+    if (!dev->rom)
+    {
+        fprintf(stderr, "ERROR: Failed to allocate ROM model\n");
+        free(dev);
+        return NULL;
+    }
+    return &dev->base;
+}
+
+static sdp_device *mock_transport_open(const char *devnode)
+{
+    return mock_transport_find(0, 0, NULL);
+}
+
+static void mock_transport_close(sdp_device *base)
+{
+    struct mock_sdp_device *dev = (struct mock_sdp_device *)base;
+    if (close_callback)
+        close_callback(dev->rom, close_ctx);
+    sdp_rom_free(dev->rom);
+    free(dev);
+}
+
+static int mock_transport_write(sdp_device *base, const unsigned char *buf, size_t length)
+{
+    struct mock_sdp_device *dev = (struct mock_sdp_device *)base;
+
+    if (options.latency)
+        usleep(options.latency);
+
+    if (sdp_rom_jumped(dev->rom, NULL))
+    {
+        dev->error = "device disconnected";
+        dev->base.disconnected = true;
+        return -1;
+    }
+    if (options.fault_rate > 0 && rand_r(&dev->seed) < options.fault_rate * RAND_MAX)
+    {
+        dev->error = "injected fault";
+        return -1;
+    }
+    if (sdp_rom_output(dev->rom, buf, length))
+    {
+        dev->error = "protocol error";
+        return -1;
+    }
+    return length;
+}
+
+static int mock_transport_read(sdp_device *base, unsigned char *buf, size_t length, int timeout)
+{
+    struct mock_sdp_device *dev = (struct mock_sdp_device *)base;
+
+    size_t n = sdp_rom_input(dev->rom, buf, length);
+    if (n)
+        return n;
+
+    // Nothing will ever arrive: either the ROM jumped away, or it is idle
+    if (sdp_rom_jumped(dev->rom, NULL) || timeout < 0)
+    {
+        dev->base.disconnected = sdp_rom_jumped(dev->rom, NULL);
+        dev->error = dev->base.disconnected ? "device disconnected" : "no report pending";
+        return -1;
+    }
+    usleep(timeout * 1000);
+    return 0;
+}
+
+static const char *mock_transport_error(sdp_device *base)
+{
+    struct mock_sdp_device *dev = (struct mock_sdp_device *)base;
+    return dev->error ? dev->error : "unknown error";
+}
+
+const struct sdp_transport sdp_mock_transport = {
+    .name = "mock",
+    .init = mock_transport_init,
+    .find = mock_transport_find,
+    .open = mock_transport_open,
+    .close = mock_transport_close,
+    .write = mock_transport_write,
+    .read = mock_transport_read,
+    .error = mock_transport_error,
+};
@@ -0,0 +1,121 @@
+#include "record.h"
+#include <endian.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Events are written as the calls return, through stdio's buffer
+
+static struct
+{
+    FILE *file;
+    uint64_t start_ns;
+    uint32_t session_count;
+    bool failed;
+    pthread_mutex_t lock;
+} record = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// The file is created right away, so that a bad path fails before any device
+// is touched
+int sdp_record_init(const char *path)
+{
+    record.file = fopen(path, "w");
+    if (!record.file)
+    {
+        fprintf(stderr, "ERROR: Failed to create recording \"%s\": %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    struct sdp_record_header header = {
+        .magic = SDP_RECORD_MAGIC,
+        .version = htole32(SDP_RECORD_VERSION),
+    };
+    record.failed = fwrite(&header, sizeof(header), 1, record.file) != 1;
+    record.start_ns = now_ns();
+    return 0;
+}
+
+int sdp_record_finish(void)
+{
+    if (!record.file)
+        return 0;
+
+    pthread_mutex_lock(&record.lock);
+    if (fclose(record.file))
+        record.failed = true;
+    record.file = NULL;
+    pthread_mutex_unlock(&record.lock);
+
+    if (record.failed)
+    {
+        fprintf(stderr, "ERROR: Failed to write recording\n");
+        return -1;
+    }
+    return 0;
+}
+
+uint64_t sdp_record_begin(void)
+{
+    return record.file ? now_ns() : 0;
+}
+
+static void write_event(uint64_t start, uint32_t session, enum sdp_record_type type, int result,
+                        uint8_t flags, const void *prefix, size_t prefix_length, const void *data,
+                        size_t length)
+{
+    if (prefix_length + length > UINT16_MAX)
+        length = UINT16_MAX - prefix_length;
+
+    struct sdp_record_event event = {
+        .start_ns = htole64(start - record.start_ns),
+        .duration_ns = htole64(now_ns() - start),
+        .session = htole32(session),
+        .type = type,
+        .flags = flags,
+        .length = htole16(prefix_length + length),
+        .result = (int32_t)htole32((uint32_t)result),
+    };
+
+    // Called concurrently by the boards, and possibly after sdp_record_finish()
+    // by a board that is still running
+    pthread_mutex_lock(&record.lock);
+    if (record.file && !record.failed &&
+        (fwrite(&event, sizeof(event), 1, record.file) != 1 ||
+         (prefix_length && fwrite(prefix, prefix_length, 1, record.file) != 1) ||
+         (length && fwrite(data, length, 1, record.file) != 1)))
+        record.failed = true;
+    pthread_mutex_unlock(&record.lock);
+}
+
+// A failed open gets a session as well, so the replay fails the same way
+uint32_t sdp_record_open(uint64_t start, uint16_t vid, uint16_t pid, const char *usb_path, int result)
+{
+    if (!start)
+        return 0;
+
+    uint32_t session = __atomic_add_fetch(&record.session_count, 1, __ATOMIC_RELAXED);
+    uint16_t ids[2] = {htole16(vid), htole16(pid)};
+    write_event(start, session, SDP_RECORD_OPEN, result, 0, ids, sizeof(ids), usb_path,
+                usb_path ? strlen(usb_path) : 0);
+    return session;
+}
+
+void sdp_record_event(uint64_t start, uint32_t session, enum sdp_record_type type, int result,
+                      uint8_t flags, const void *data, size_t length)
+{
+    if (!start || !session)
+        return;
+    write_event(start, session, type, result, flags, NULL, 0, data, length);
+}
@@ -0,0 +1,60 @@
+#ifndef RECORD_H_
+#define RECORD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Recording of every report sent to and received from the devices, with the
+ * time each call took, as written by --record and read back by the replay
+ * transport. The transport wrappers record the calls of all devices into one
+ * file.
+ *
+ * Layout (all integers little-endian): the header, then one event after the
+ * other, each followed by its data.
+ */
+
+#define SDP_RECORD_MAGIC "IMXSDPRC"
+#define SDP_RECORD_VERSION 2
+
+enum sdp_record_type
+{
+    SDP_RECORD_OPEN = 1, // data: VID, PID (16 bit each), then the USB path
+    SDP_RECORD_CLOSE,
+    SDP_RECORD_WRITE, // data: the report, or the error if result < 0
+    SDP_RECORD_FLUSH, // data: the error if result < 0
+    SDP_RECORD_READ,  // data: the report, or the error if result < 0
+};
+
+struct sdp_record_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+} __attribute__((packed));
+
+// Event flags
+#define SDP_RECORD_DISCONNECTED 0x01 // the call failed because the device was gone
+
+struct sdp_record_event
+{
+    uint64_t start_ns; // since the recording started
+    uint64_t duration_ns;
+    uint32_t session; // device, numbered from 1 in the order they were opened
+    uint8_t type;
+    uint8_t flags;
+    uint16_t length; // of the data following the event
+    int32_t result;
+} __attribute__((packed));
+
+int sdp_record_init(const char *path);
+int sdp_record_finish(void);
+
+// Returns the start of a call, 0 if not recording
+uint64_t sdp_record_begin(void);
+// Returns the session of a newly opened device
+uint32_t sdp_record_open(uint64_t start, uint16_t vid, uint16_t pid, const char *usb_path, int result);
+void sdp_record_event(uint64_t start, uint32_t session, enum sdp_record_type type, int result,
+                      uint8_t flags, const void *data, size_t length);
+
+#endif
@@ -0,0 +1,441 @@
+#include "transport.h"
+#include "record.h"
+#include <endian.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/*
+ * Transport playing back a recording made with --record. Every device that is
+ * looked for gets the next recorded session with the same VID/PID (and USB
+ * path, if both have one), which then answers with the recorded reports. The
+ * reports sent must match the recorded ones, so a replay fails where the
+ * protocol diverges from the recording.
+ *
+ * Each call takes as long as it did when recorded, and each session is opened
+ * when it was, relative to the start; both multiplied by the scale.
+ */
+
+struct session
+{
+    uint32_t id;
+    uint16_t vid;
+    uint16_t pid;
+    char *usb_path; // NULL if recorded without one
+    const struct sdp_record_event *open;
+    const struct sdp_record_event **events;
+    size_t count;
+    size_t capacity;
+    bool claimed;
+};
+
+struct replay_sdp_device
+{
+    sdp_device base;
+    struct session *session;
+    size_t next; // event
+    char error[256];
+};
+
+static struct
+{
+    char *path;
+    double scale;
+    unsigned char *data; // the whole recording, events in host byte order
+    struct session *sessions;
+    size_t session_count;
+    uint64_t start_ns;
+    pthread_mutex_t lock;
+} replay = {
+    .scale = 1.0,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadline)
+{
+    struct timespec ts = {
+        .tv_sec = deadline / 1000000000ull,
+        .tv_nsec = deadline % 1000000000ull,
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static uint64_t scaled(uint64_t ns)
+{
+    return ns * replay.scale;
+}
+
+static int parse_option(const char *key, const char *value)
+{
+    char *end = NULL;
+    if (!strcmp(key, "file"))
+    {
+        free(replay.path);
+        replay.path = strdup(value);
+        return replay.path ? 0 : -1;
+    }
+    else if (!strcmp(key, "scale"))
+        replay.scale = strtod(value, &end);
+    else
+        return -1;
+    return end == value || *end || replay.scale < 0 ? -1 : 0;
+}
+
+static struct session *get_session(uint32_t id)
+{
+    for (size_t i = 0; i < replay.session_count; ++i)
+    {
+        if (replay.sessions[i].id == id)
+            return &replay.sessions[i];
+    }
+    return NULL;
+}
+
+static int add_open(struct sdp_record_event *event, const unsigned char *data)
+{
+    if (event->length < 4 || get_session(event->session))
+        return -1;
+
+    struct session *tmp = realloc(replay.sessions, (replay.session_count + 1) * sizeof(struct session));
+    if (!tmp)
+        return -1;
+    replay.sessions = tmp;
+
+    struct session *session = &replay.sessions[replay.session_count++];
+    memset(session, 0, sizeof(*session));
+    session->id = event->session;
+    uint16_t ids[2];
+    memcpy(ids, data, sizeof(ids));
+    session->vid = le16toh(ids[0]);
+    session->pid = le16toh(ids[1]);
+    session->open = event;
+    if (event->length > 4)
+    {
+        session->usb_path = strndup((const char *)data + 4, event->length - 4);
+        if (!session->usb_path)
+            return -1;
+    }
+    return 0;
+}
+
+static int add_event(const struct sdp_record_event *event)
+{
+    struct session *session = get_session(event->session);
+    if (!session)
+        return -1;
+
+    if (session->count == session->capacity)
+    {
+        size_t capacity = session->capacity ? session->capacity * 2 : 256;
+        const struct sdp_record_event **tmp = realloc(session->events, capacity * sizeof(*tmp));
+        if (!tmp)
+            return -1;
+        session->events = tmp;
+        session->capacity = capacity;
+    }
+    session->events[session->count++] = event;
+    return 0;
+}
+
+static int load_recording(void)
+{
+    FILE *file = fopen(replay.path, "r");
+    if (!file)
+    {
+        fprintf(stderr, "ERROR: Failed to open recording \"%s\": %s\n", replay.path, strerror(errno));
+        return -1;
+    }
+
+    int res = -1;
+    struct stat st;
+    if (fstat(fileno(file), &st))
+    {
+        fprintf(stderr, "ERROR: Failed to read recording: %s\n", strerror(errno));
+        goto close_file;
+    }
+    size_t size = st.st_size;
+    replay.data = malloc(size ? size : 1);
+    if (!replay.data)
+    {
+        fprintf(stderr, "ERROR: Failed to allocate recording\n");
+        goto close_file;
+    }
+    if (fread(replay.data, 1, size, file) != size)
+    {
+        fprintf(stderr, "ERROR: Failed to read recording\n");
+        goto close_file;
+    }
+
+    const struct sdp_record_header *header = (const struct sdp_record_header *)replay.data;
+    if (size < sizeof(*header) || memcmp(header->magic, SDP_RECORD_MAGIC, sizeof(header->magic)))
+    {
+        fprintf(stderr, "ERROR: \"%s\" is not a recording\n", replay.path);
+        goto close_file;
+    }
+    if (le32toh(header->version) != SDP_RECORD_VERSION)
+    {
+        fprintf(stderr, "ERROR: Unsupported recording version %u\n", le32toh(header->version));
+        goto close_file;
+    }
+
+    // The events are converted in place, their data follows them
+    size_t offset = sizeof(*header);
+    while (offset < size)
+    {
+        struct sdp_record_event *event = (struct sdp_record_event *)(replay.data + offset);
+        if (size - offset < sizeof(*event) || size - offset - sizeof(*event) < le16toh(event->length))
+        {
+            fprintf(stderr, "ERROR: Recording is truncated\n");
+            goto close_file;
+        }
+        event->start_ns = le64toh(event->start_ns);
+        event->duration_ns = le64toh(event->duration_ns);
+        event->session = le32toh(event->session);
+        event->length = le16toh(event->length);
+        event->result = (int32_t)le32toh((uint32_t)event->result);
+
+        int err = event->type == SDP_RECORD_OPEN ? add_open(event, (const unsigned char *)(event + 1))
+                                                 : add_event(event);
+        if (err)
+        {
+            fprintf(stderr, "ERROR: Invalid event at offset %zu of the recording\n", offset);
+            goto close_file;
+        }
+        offset += sizeof(*event) + event->length;
+    }
+    res = 0;
+
+close_file:
+    fclose(file);
+    return res;
+}
+
+static void replay_transport_exit(void);
+
+// Options: comma separated file=<recording>, scale=<factor>
+static int replay_transport_init(const char *opts)
+{
+    char *copy = opts ? strdup(opts) : NULL;
+    if (opts && !copy)
+        return 1;
+
+    int res = 0;
+    char *saveptr = NULL;
+    for (char *tok = copy ? strtok_r(copy, ",", &saveptr) : NULL; !res && tok;
+         tok = strtok_r(NULL, ",", &saveptr))
+    {
+        char *eq = strchr(tok, '=');
+        if (eq)
+            *eq = '\0';
+        if (!eq || parse_option(tok, eq + 1))
+        {
+            fprintf(stderr, "ERROR: Invalid replay transport option \"%s\"\n", tok);
+            res = 1;
+        }
+    }
+    free(copy);
+
+    if (!res && !replay.path)
+    {
+        fprintf(stderr, "ERROR: The replay transport needs a recording (file=<FILE>)\n");
+        res = 1;
+    }
+    if (!res && load_recording())
+        res = 1;
+    if (res)
+    {
+        replay_transport_exit();
+        return res;
+    }
+
+    replay.start_ns = now_ns();
+    return 0;
+}
+
+static void replay_transport_exit(void)
+{
+    for (size_t i = 0; i < replay.session_count; ++i)
+    {
+        free(replay.sessions[i].usb_path);
+        free(replay.sessions[i].events);
+    }
+    free(replay.sessions);
+    replay.sessions = NULL;
+    replay.session_count = 0;
+    free(replay.data);
+    replay.data = NULL;
+    free(replay.path);
+    replay.path = NULL;
+}
+
+static struct session *claim_session(uint16_t vid, uint16_t pid, const char *usb_path)
+{
+    struct session *result = NULL;
+    pthread_mutex_lock(&replay.lock);
+    for (size_t i = 0; !result && i < replay.session_count; ++i)
+    {
+        struct session *session = &replay.sessions[i];
+        if (session->claimed || session->vid != vid || session->pid != pid ||
+            (usb_path && session->usb_path && strcmp(usb_path, session->usb_path)))
+            continue;
+        session->claimed = true;
+        result = session;
+    }
+    pthread_mutex_unlock(&replay.lock);
+    return result;
+}
+
+static sdp_device *replay_transport_find(uint16_t vid, uint16_t pid, const char *usb_path)
+{
+    struct session *session = claim_session(vid, pid, usb_path);
+    if (!session)
+    {
+        fprintf(stderr, "ERROR: No recorded device 0x%04x:0x%04x left to replay\n", vid, pid);
+        return NULL;
+    }
+
+    sleep_until(replay.start_ns + scaled(session->open->start_ns + session->open->duration_ns));
+    if (session->open->result < 0)
+    {
+        fprintf(stderr, "ERROR: Failed to open device (recorded)\n");
+        return NULL;
+    }
+
+    struct replay_sdp_device *dev = calloc(1, sizeof(struct replay_sdp_device));
+    if (!dev)
+    {
+        fprintf(stderr, "ERROR: Failed to allocate device\n");
+        return NULL;
+    }
+    dev->base.transport = &sdp_replay_transport;
+    dev->session = session;
+    return &dev->base;
+}
+
+static const char *type_name(enum sdp_record_type type)
+{
+    switch (type)
+    {
+    case SDP_RECORD_OPEN:
+        return "open";
+    case SDP_RECORD_CLOSE:
+        return "close";
+    case SDP_RECORD_WRITE:
+        return "write";
+    case SDP_RECORD_FLUSH:
+        return "flush";
+    case SDP_RECORD_READ:
+        return "read";
+    }
+    return "unknown";
+}
+
+// The next event, if it is of the given type. It takes as long as it did when
+// recorded, and its error becomes the device's error.
+static const struct sdp_record_event *next_event(struct replay_sdp_device *dev, enum sdp_record_type type)
+{
+    struct session *session = dev->session;
+    if (dev->next >= session->count)
+    {
+        snprintf(dev->error, sizeof(dev->error), "%s after the end of the recorded session",
+                 type_name(type));
+        return NULL;
+    }
+
+    const struct sdp_record_event *event = session->events[dev->next];
+    if (event->type != type)
+    {
+        snprintf(dev->error, sizeof(dev->error), "%s where the recording has a %s (event %zu)",
+                 type_name(type), type_name(event->type), dev->next + 1);
+        return NULL;
+    }
+    dev->next++;
+
+    if (replay.scale > 0)
+        sleep_until(now_ns() + scaled(event->duration_ns));
+    if (event->result < 0)
+    {
+        snprintf(dev->error, sizeof(dev->error), "%.*s", (int)event->length, (const char *)(event + 1));
+        dev->base.disconnected = event->flags & SDP_RECORD_DISCONNECTED;
+    }
+    return event;
+}
+
+static void replay_transport_close(sdp_device *base)
+{
+    struct replay_sdp_device *dev = (struct replay_sdp_device *)base;
+    const struct session *session = dev->session;
+    if (dev->next < session->count && session->events[dev->next]->type != SDP_RECORD_CLOSE)
+    {
+        fprintf(stderr, "WARN: Replayed device closed %zu event(s) before the recording\n",
+                session->count - dev->next);
+    }
+    free(dev);
+}
+
+static int replay_transport_write(sdp_device *base, const unsigned char *buf, size_t length)
+{
+    struct replay_sdp_device *dev = (struct replay_sdp_device *)base;
+    const struct sdp_record_event *event = next_event(dev, SDP_RECORD_WRITE);
+    if (!event)
+        return -1;
+    if (event->result >= 0 && (event->length != length || memcmp(event + 1, buf, length)))
+    {
+        snprintf(dev->error, sizeof(dev->error), "report differs from the recording (event %zu)",
+                 dev->next);
+        return -1;
+    }
+    return event->result;
+}
+
+static int replay_transport_flush(sdp_device *base)
+{
+    struct replay_sdp_device *dev = (struct replay_sdp_device *)base;
+    const struct sdp_record_event *event = next_event(dev, SDP_RECORD_FLUSH);
+    return event ? event->result : -1;
+}
+
+static int replay_transport_read(sdp_device *base, unsigned char *buf, size_t length, int timeout)
+{
+    struct replay_sdp_device *dev = (struct replay_sdp_device *)base;
+    const struct sdp_record_event *event = next_event(dev, SDP_RECORD_READ);
+    if (!event)
+        return -1;
+    if (event->result <= 0)
+        return event->result;
+
+    size_t n = event->length < length ? event->length : length;
+    memcpy(buf, event + 1, n);
+    return n;
+}
+
+static const char *replay_transport_error(sdp_device *base)
+{
+    struct replay_sdp_device *dev = (struct replay_sdp_device *)base;
+    return dev->error[0] ? dev->error : "unknown error";
+}
+
+const struct sdp_transport sdp_replay_transport = {
+    .name = "replay",
+    .init = replay_transport_init,
+    .exit = replay_transport_exit,
+    .find = replay_transport_find,
+    .close = replay_transport_close,
+    .write = replay_transport_write,
+    .flush = replay_transport_flush,
+    .read = replay_transport_read,
+    .error = replay_transport_error,
+};
@@ -0,0 +1,455 @@
+#include "report.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Every run builds its JSON object as it goes; finished runs are collected for
+ * the summary. Each event is the fields of the object it adds to the run, along
+ * with the run's USB path and stage, written with a single write(). A listener
+ * gets the same events unformatted.
+ */
+
+struct json
+{
+    char *buf;
+    size_t length;
+    size_t capacity;
+    bool failed; // out of memory, the text is incomplete
+};
+
+struct sdp_run_report_
+{
+    char *usb_path;
+    int stage;      // current stage, 0 if none
+    int step_count; // of the current stage
+    struct json json;
+    sdp_report_listener listener;
+    void *listener_ctx;
+};
+
+static struct
+{
+    bool enabled;
+    FILE *summary;
+    int event_fd;
+    uint64_t start_ns;
+    pthread_mutex_t lock;
+    struct json runs; // finished runs, separated by commas
+    unsigned int run_count;
+    bool quiet;
+} report = {
+    .event_fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static _Thread_local sdp_report_listener thread_listener;
+static _Thread_local void *thread_listener_ctx;
+static _Thread_local const char *thread_prefix;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void json_append(struct json *j, const char *s, size_t length)
+{
+    if (j->failed)
+        return;
+    if (j->length + length + 1 > j->capacity)
+    {
+        size_t capacity = j->capacity ? j->capacity : 256;
+        while (j->length + length + 1 > capacity)
+            capacity *= 2;
+        char *tmp = realloc(j->buf, capacity);
+        if (!tmp)
+        {
+            j->failed = true;
+            return;
+        }
+        j->buf = tmp;
+        j->capacity = capacity;
+    }
+    memcpy(j->buf + j->length, s, length);
+    j->length += length;
+    j->buf[j->length] = '\0';
+}
+
+static void json_printf(struct json *j, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void json_printf(struct json *j, const char *fmt, ...)
+{
+    char buf[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n < 0 || (size_t)n >= sizeof(buf))
+        j->failed = true;
+    else
+        json_append(j, buf, n);
+}
+
+// A string value, or null
+static void json_string(struct json *j, const char *s)
+{
+    if (!s)
+    {
+        json_append(j, "null", 4);
+        return;
+    }
+
+    json_append(j, "\"", 1);
+    for (; *s; ++s)
+    {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+        {
+            char escaped[2] = {'\\', c};
+            json_append(j, escaped, 2);
+        }
+        else if (c < 0x20)
+            json_printf(j, "\\u%04x", c);
+        else
+            json_append(j, s, 1);
+    }
+    json_append(j, "\"", 1);
+}
+
+static void json_fields(struct json *j, const struct json *fields)
+{
+    if (fields->failed)
+        j->failed = true;
+    else if (fields->length)
+        json_append(j, fields->buf, fields->length);
+}
+
+static double ms(uint64_t ns)
+{
+    return ns / 1e6;
+}
+
+// Send one event: {"t_ms":...,"event":...,"usb_path":...,"stage":...,<fields>}
+static void emit_event(const sdp_run_report *run, const char *event, const struct json *fields)
+{
+    if (report.event_fd < 0)
+        return;
+
+    struct json line = {0};
+    json_printf(&line, "{\"t_ms\":%.3f,\"event\":\"%s\",\"usb_path\":", ms(now_ns() - report.start_ns),
+                event);
+    json_string(&line, run->usb_path);
+    if (run->stage)
+        json_printf(&line, ",\"stage\":%d", run->stage);
+    if (fields)
+    {
+        json_append(&line, ",", 1);
+        json_fields(&line, fields);
+    }
+    json_append(&line, "}\n", 2);
+    if (line.failed)
+    {
+        free(line.buf);
+        return;
+    }
+
+    pthread_mutex_lock(&report.lock);
+    for (size_t done = 0; report.event_fd >= 0 && done < line.length;)
+    {
+        ssize_t n = write(report.event_fd, line.buf + done, line.length - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            fprintf(stderr, "WARN: Failed to write event, stopping events: %s\n", strerror(errno));
+            report.event_fd = -1;
+            break;
+        }
+        done += n;
+    }
+    pthread_mutex_unlock(&report.lock);
+    free(line.buf);
+}
+
+static void notify(const sdp_run_report *run, struct sdp_report_event *event)
+{
+    if (!run->listener)
+        return;
+    event->usb_path = run->usb_path;
+    event->stage = run->stage;
+    run->listener(event, run->listener_ctx);
+}
+
+// Either may be unset. The summary file is created right away, so that a bad
+// path fails before any device is touched.
+int sdp_report_init(const char *summary_path, int event_fd)
+{
+    if (summary_path)
+    {
+        report.summary = fopen(summary_path, "w");
+        if (!report.summary)
+        {
+            fprintf(stderr, "ERROR: Failed to create report \"%s\": %s\n", summary_path,
+                    strerror(errno));
+            return -1;
+        }
+    }
+    if (event_fd >= 0)
+    {
+        // A reader that went away must not kill us
+        signal(SIGPIPE, SIG_IGN);
+        report.event_fd = event_fd;
+    }
+    report.enabled = summary_path || event_fd >= 0;
+    report.start_ns = now_ns();
+    return 0;
+}
+
+// Write the summary of all runs
+int sdp_report_finish(void)
+{
+    int res = 0;
+    if (report.summary)
+    {
+        fprintf(report.summary, "{\"duration_ms\":%.3f,\"runs\":[%s]}\n",
+                ms(now_ns() - report.start_ns), report.runs.buf ? report.runs.buf : "");
+        if (report.runs.failed)
+            fprintf(stderr, "ERROR: Report incomplete, out of memory\n");
+        if (fclose(report.summary) || report.runs.failed)
+        {
+            fprintf(stderr, "ERROR: Failed to write report\n");
+            res = -1;
+        }
+        report.summary = NULL;
+    }
+    free(report.runs.buf);
+    memset(&report.runs, 0, sizeof(report.runs));
+    report.enabled = false;
+    report.event_fd = -1;
+    return res;
+}
+
+void sdp_report_listen(sdp_report_listener listener, void *ctx)
+{
+    thread_listener = listener;
+    thread_listener_ctx = ctx;
+}
+
+void sdp_report_quiet(bool quiet)
+{
+    report.quiet = quiet;
+}
+
+// For the progress text of the calling thread: each line starts with
+// "[usb_path] ", so that boards running in parallel can be told apart. The
+// string must stay valid while the thread prints.
+void sdp_report_prefix(const char *usb_path)
+{
+    thread_prefix = usb_path;
+}
+
+// Each call is formatted first and then written with a single printf(), so that
+// lines of other threads can't end up in the middle of it
+void sdp_report_printf(const char *fmt, ...)
+{
+    if (report.quiet)
+        return;
+
+    char buf[512];
+    char *text = buf;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+    if ((size_t)n >= sizeof(buf))
+    {
+        text = malloc(n + 1);
+        if (!text)
+            return;
+        va_start(ap, fmt);
+        vsnprintf(text, n + 1, fmt, ap);
+        va_end(ap);
+    }
+
+    if (thread_prefix)
+        printf("[%s] %s", thread_prefix, text);
+    else
+        fputs(text, stdout);
+    if (text != buf)
+        free(text);
+}
+
+sdp_run_report *sdp_report_run_begin(const char *usb_path)
+{
+    if (!report.enabled && !thread_listener)
+        return NULL;
+
+    sdp_run_report *run = calloc(1, sizeof(sdp_run_report));
+    if (!run)
+    {
+        fprintf(stderr, "WARN: Failed to allocate report\n");
+        return NULL;
+    }
+    if (usb_path)
+        run->usb_path = strdup(usb_path);
+    run->listener = thread_listener;
+    run->listener_ctx = thread_listener_ctx;
+
+    json_append(&run->json, "{\"usb_path\":", 12);
+    json_string(&run->json, run->usb_path);
+    json_append(&run->json, ",\"stages\":[", 11);
+    emit_event(run, "run_begin", NULL);
+    notify(run, &(struct sdp_report_event){.type = SDP_EVENT_RUN_BEGIN});
+    return run;
+}
+
+void sdp_report_stage_begin(sdp_run_report *run, int stage, uint16_t vid, uint16_t pid)
+{
+    if (!run)
+        return;
+
+    struct json fields = {0};
+    json_printf(&fields, "\"vid\":\"0x%04x\",\"pid\":\"0x%04x\"", vid, pid);
+    json_printf(&run->json, "%s{\"stage\":%d,", run->stage ? "," : "", stage);
+    json_fields(&run->json, &fields);
+    run->stage = stage;
+    run->step_count = 0;
+    emit_event(run, "stage_begin", &fields);
+    free(fields.buf);
+    notify(run, &(struct sdp_report_event){.type = SDP_EVENT_STAGE_BEGIN, .vid = vid, .pid = pid});
+}
+
+// Time spent waiting for the device to show up, and opening it
+void sdp_report_stage_device(sdp_run_report *run, uint64_t wait_ns, uint64_t open_ns)
+{
+    if (!run)
+        return;
+
+    struct json fields = {0};
+    json_printf(&fields, "\"wait_ms\":%.3f,\"open_ms\":%.3f", ms(wait_ns), ms(open_ns));
+    json_append(&run->json, ",", 1);
+    json_fields(&run->json, &fields);
+    emit_event(run, "device", &fields);
+    free(fields.buf);
+    notify(run, &(struct sdp_report_event){
+                    .type = SDP_EVENT_DEVICE, .wait_ns = wait_ns, .open_ns = open_ns});
+}
+
+// Round trip of the ERROR_STATUS command
+void sdp_report_stage_status(sdp_run_report *run, uint64_t status_ns, uint32_t hab_status)
+{
+    if (!run)
+        return;
+
+    struct json fields = {0};
+    json_printf(&fields, "\"status_ms\":%.3f,\"hab_status\":\"0x%08" PRIx32 "\"", ms(status_ns),
+                hab_status);
+    json_append(&run->json, ",", 1);
+    json_fields(&run->json, &fields);
+    emit_event(run, "status", &fields);
+    free(fields.buf);
+    notify(run, &(struct sdp_report_event){
+                    .type = SDP_EVENT_STATUS, .status_ns = status_ns, .hab_status = hab_status});
+}
+
+void sdp_report_step(sdp_run_report *run, int step, const struct sdp_step_info *info, int result,
+                     uint64_t duration_ns, const struct sdp_device_stats *stats)
+{
+    if (!run)
+        return;
+
+    struct json fields = {0};
+    json_printf(&fields, "\"step\":%d,\"op\":\"%s\",\"address\":\"0x%08" PRIx32 "\"", step,
+                sdp_step_op_name(info->op), info->address);
+    if (info->file_path)
+    {
+        json_append(&fields, ",\"file\":", 8);
+        json_string(&fields, info->file_path);
+    }
+    json_printf(&fields, ",\"ok\":%s,\"duration_ms\":%.3f", result ? "false" : "true",
+                ms(duration_ns));
+    if (stats->bytes)
+    {
+        json_printf(&fields, ",\"bytes\":%" PRIu64 ",\"data_ms\":%.3f,\"mb_per_s\":%.3f", stats->bytes,
+                    ms(stats->data_ns), stats->data_ns ? stats->bytes * 1e3 / stats->data_ns : 0.0);
+    }
+    json_printf(&fields, ",\"hab_ms\":%.3f,\"response_ms\":%.3f", ms(stats->hab_ns),
+                ms(stats->response_ns));
+    if (stats->retries)
+        json_printf(&fields, ",\"retries\":%" PRIu32, stats->retries);
+    if (stats->round_trips_saved)
+        json_printf(&fields, ",\"round_trips_saved\":%" PRIu32, stats->round_trips_saved);
+
+    json_append(&run->json, run->step_count ? ",{" : ",\"steps\":[{", run->step_count ? 2 : 11);
+    json_fields(&run->json, &fields);
+    json_append(&run->json, "}", 1);
+    run->step_count++;
+    emit_event(run, "step", &fields);
+    free(fields.buf);
+    notify(run, &(struct sdp_report_event){.type = SDP_EVENT_STEP,
+                                           .step = step,
+                                           .info = *info,
+                                           .stats = *stats,
+                                           .result = result,
+                                           .duration_ns = duration_ns});
+}
+
+void sdp_report_stage_end(sdp_run_report *run, int result, uint64_t duration_ns)
+{
+    if (!run)
+        return;
+
+    struct json fields = {0};
+    json_printf(&fields, "\"ok\":%s,\"duration_ms\":%.3f", result ? "false" : "true", ms(duration_ns));
+    json_append(&run->json, run->step_count ? "]," : ",", run->step_count ? 2 : 1);
+    json_fields(&run->json, &fields);
+    json_append(&run->json, "}", 1);
+    emit_event(run, "stage_end", &fields);
+    free(fields.buf);
+    notify(run, &(struct sdp_report_event){
+                    .type = SDP_EVENT_STAGE_END, .result = result, .duration_ns = duration_ns});
+}
+
+// Adds the run to the summary and frees it
+void sdp_report_run_end(sdp_run_report *run, int result, uint64_t duration_ns)
+{
+    if (!run)
+        return;
+
+    struct json fields = {0};
+    json_printf(&fields, "\"ok\":%s,\"duration_ms\":%.3f", result ? "false" : "true", ms(duration_ns));
+    json_append(&run->json, "],", 2);
+    json_fields(&run->json, &fields);
+    json_append(&run->json, "}", 1);
+    run->stage = 0;
+    emit_event(run, "run_end", &fields);
+    free(fields.buf);
+    notify(run, &(struct sdp_report_event){
+                    .type = SDP_EVENT_RUN_END, .result = result, .duration_ns = duration_ns});
+
+    pthread_mutex_lock(&report.lock);
+    if (report.summary && run->json.failed)
+        report.runs.failed = true;
+    else if (report.summary)
+    {
+        if (report.run_count++)
+            json_append(&report.runs, ",", 1);
+        json_append(&report.runs, run->json.buf, run->json.length);
+    }
+    pthread_mutex_unlock(&report.lock);
+
+    free(run->json.buf);
+    free(run->usb_path);
+    free(run);
+}
@@ -0,0 +1,72 @@
+#ifndef REPORT_H_
+#define REPORT_H_
+
+#include "steps.h"
+#include "transport.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Machine-readable timing of every run of the stages (one per board): a JSON
+ * summary written at exit, optionally a live stream of JSON lines, one per
+ * event, written to a file descriptor, and the same events passed to a
+ * listener of the thread running the stages.
+ */
+
+struct sdp_run_report_;
+typedef struct sdp_run_report_ sdp_run_report;
+
+enum sdp_report_event_type
+{
+    SDP_EVENT_RUN_BEGIN,
+    SDP_EVENT_STAGE_BEGIN,
+    SDP_EVENT_DEVICE,
+    SDP_EVENT_STATUS,
+    SDP_EVENT_STEP,
+    SDP_EVENT_STAGE_END,
+    SDP_EVENT_RUN_END,
+};
+
+// Only the fields of the event's type are set
+struct sdp_report_event
+{
+    enum sdp_report_event_type type;
+    const char *usb_path; // NULL if the run has none
+    int stage;            // from 1, 0 for run events
+
+    uint16_t vid; // stage_begin
+    uint16_t pid;
+    uint64_t wait_ns; // device
+    uint64_t open_ns;
+    uint64_t status_ns; // status
+    uint32_t hab_status;
+    int step; // step, from 1
+    struct sdp_step_info info;
+    struct sdp_device_stats stats;
+    int result; // step, stage_end, run_end
+    uint64_t duration_ns;
+};
+
+typedef void (*sdp_report_listener)(const struct sdp_report_event *event, void *ctx);
+
+int sdp_report_init(const char *summary_path, int event_fd);
+int sdp_report_finish(void);
+// For the runs the calling thread begins from now on
+void sdp_report_listen(sdp_report_listener listener, void *ctx);
+// Silence the progress text
+void sdp_report_quiet(bool quiet);
+void sdp_report_prefix(const char *usb_path);
+void sdp_report_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+// All of these accept NULL, which is what sdp_report_run_begin() returns if
+// reporting isn't enabled
+sdp_run_report *sdp_report_run_begin(const char *usb_path);
+void sdp_report_stage_begin(sdp_run_report *run, int stage, uint16_t vid, uint16_t pid);
+void sdp_report_stage_device(sdp_run_report *run, uint64_t wait_ns, uint64_t open_ns);
+void sdp_report_stage_status(sdp_run_report *run, uint64_t status_ns, uint32_t hab_status);
+void sdp_report_step(sdp_run_report *run, int step, const struct sdp_step_info *info, int result,
+                     uint64_t duration_ns, const struct sdp_device_stats *stats);
+void sdp_report_stage_end(sdp_run_report *run, int result, uint64_t duration_ns);
+void sdp_report_run_end(sdp_run_report *run, int result, uint64_t duration_ns);
+
+#endif
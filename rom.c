@@ -0,0 +1,310 @@
+#include "rom.h"
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum command_type
+{
+    READ_REGISTER = 0x0101,
+    WRITE_REGISTER = 0x0202,
+    WRITE_FILE = 0x0404,
+    ERROR_STATUS = 0x0505,
+    DCD_WRITE = 0x0A0A,
+    JUMP_ADDRESS = 0x0B0B,
+    SKIP_DCD_HEADER = 0x0C0C,
+};
+
+#define HAB_OPEN 0x56787856
+#define WRITE_FILE_COMPLETE 0x88888888
+#define DCD_WRITE_COMPLETE 0x128A8A12
+#define WRITE_REGISTER_COMPLETE 0x128A8A12
+#define DCD_TAG 0xD2
+#define DCD_WRITE_DATA_TAG 0xCC
+#define STATUS_OK 0xf0f0f0f0
+#define STATUS_FAILED 0x33333333
+#define MAX_PENDING 4
+
+struct region
+{
+    uint32_t address;
+    uint32_t size;
+    struct region *next;
+    unsigned char data[];
+};
+
+struct sdp_rom_
+{
+    // Data phase of the current WRITE_FILE or DCD_WRITE command
+    struct region *receiving;
+    uint32_t received;
+    bool receiving_dcd;
+
+    struct region *memory; // newest first
+    // Data phase of the current READ_REGISTER command, sent as it is read
+    uint32_t read_address;
+    uint32_t read_remaining;
+    uint32_t status;
+    bool jumped;
+    uint32_t jump_address;
+
+    // Queued input reports
+    unsigned char pending[MAX_PENDING][65];
+    size_t pending_length[MAX_PENDING];
+    unsigned int head, tail;
+};
+
+struct __attribute__((packed)) command
+{
+    uint8_t report_id;
+    uint16_t command_type;
+    uint32_t address;
+    uint8_t format;
+    uint32_t data_count;
+    uint32_t data;
+    uint8_t reserved;
+};
+
+sdp_rom *sdp_rom_new(void)
+{
+    sdp_rom *rom = calloc(1, sizeof(sdp_rom));
+    if (rom)
+        rom->status = STATUS_OK;
+    return rom;
+}
+
+void sdp_rom_free(sdp_rom *rom)
+{
+    while (rom->memory)
+    {
+        struct region *next = rom->memory->next;
+        free(rom->memory);
+        rom->memory = next;
+    }
+    free(rom->receiving);
+    free(rom);
+}
+
+static void queue_report(sdp_rom *rom, uint8_t report_id, uint32_t value)
+{
+    if (rom->head - rom->tail == MAX_PENDING)
+        return;
+    unsigned char *report = rom->pending[rom->head % MAX_PENDING];
+    memset(report, 0, sizeof(rom->pending[0]));
+    report[0] = report_id;
+    memcpy(report + 1, &value, sizeof(value));
+    rom->pending_length[rom->head % MAX_PENDING] = report_id == 3 ? 5 : 65;
+    rom->head++;
+}
+
+static int store(sdp_rom *rom, uint32_t address, const unsigned char *data, uint32_t size)
+{
+    struct region *r = malloc(sizeof(struct region) + size);
+    if (!r)
+        return -1;
+    r->address = address;
+    r->size = size;
+    memcpy(r->data, data, size);
+    r->next = rom->memory;
+    rom->memory = r;
+    return 0;
+}
+
+// Only the DCD's write data commands without flags (plain writes) are executed,
+// other commands are skipped
+static bool execute_dcd(sdp_rom *rom, const unsigned char *dcd, uint32_t size)
+{
+    if (size < 4 || dcd[0] != DCD_TAG || (uint32_t)((dcd[1] << 8) | dcd[2]) != size)
+        return false;
+
+    for (uint32_t offset = 4; offset < size;)
+    {
+        const unsigned char *command = dcd + offset;
+        uint32_t length = size - offset < 4 ? 0 : (command[1] << 8) | command[2];
+        if (length < 4 || length > size - offset)
+            return false;
+        uint8_t width = command[3] & 0x7;
+        if (command[0] == DCD_WRITE_DATA_TAG && !(command[3] & 0xf8))
+        {
+            if ((width != 1 && width != 2 && width != 4) || (length - 4) % 8)
+                return false;
+            for (uint32_t i = 4; i < length; i += 8)
+            {
+                uint32_t address, value;
+                memcpy(&address, command + i, 4);
+                memcpy(&value, command + i + 4, 4);
+                // Little-endian in memory
+                value = ntohl(value);
+                unsigned char bytes[4] = {value, value >> 8, value >> 16, value >> 24};
+                if (store(rom, ntohl(address), bytes, width))
+                    return false;
+            }
+        }
+        offset += length;
+    }
+    return true;
+}
+
+static bool written(const sdp_rom *rom, uint32_t address)
+{
+    for (const struct region *r = rom->memory; r; r = r->next)
+    {
+        if (address >= r->address && address - r->address < r->size)
+            return true;
+    }
+    return false;
+}
+
+static int handle_command(sdp_rom *rom, const struct command *cmd)
+{
+    uint32_t address = ntohl(cmd->address);
+    uint32_t data_count = ntohl(cmd->data_count);
+
+    switch (cmd->command_type)
+    {
+    case WRITE_FILE:
+    case DCD_WRITE:
+        rom->receiving = malloc(sizeof(struct region) + data_count);
+        if (!rom->receiving)
+            return -1;
+        rom->receiving->address = address;
+        rom->receiving->size = data_count;
+        rom->received = 0;
+        rom->receiving_dcd = cmd->command_type == DCD_WRITE;
+        return 0;
+    case WRITE_REGISTER:
+    {
+        uint32_t value = ntohl(cmd->data);
+        unsigned char bytes[4] = {value, value >> 8, value >> 16, value >> 24};
+        uint32_t width = cmd->format / 8;
+        if ((width != 1 && width != 2 && width != 4) || store(rom, address, bytes, width))
+        {
+            rom->status = STATUS_FAILED;
+            queue_report(rom, 3, HAB_OPEN);
+            queue_report(rom, 4, STATUS_FAILED);
+            return 0;
+        }
+        queue_report(rom, 3, HAB_OPEN);
+        queue_report(rom, 4, WRITE_REGISTER_COMPLETE);
+        return 0;
+    }
+    case READ_REGISTER:
+        queue_report(rom, 3, HAB_OPEN);
+        rom->read_address = address;
+        rom->read_remaining = data_count;
+        return 0;
+    case ERROR_STATUS:
+        queue_report(rom, 3, HAB_OPEN);
+        queue_report(rom, 4, rom->status);
+        return 0;
+    case JUMP_ADDRESS:
+        queue_report(rom, 3, HAB_OPEN);
+        if (written(rom, address))
+        {
+            rom->jumped = true;
+            rom->jump_address = address;
+        }
+        else
+        {
+            rom->status = STATUS_FAILED;
+            queue_report(rom, 4, STATUS_FAILED);
+        }
+        return 0;
+    default:
+        fprintf(stderr, "ROM: Unsupported command 0x%04x\n", cmd->command_type);
+        rom->status = STATUS_FAILED;
+        return -1;
+    }
+}
+
+// Process one output report (including the report ID)
+int sdp_rom_output(sdp_rom *rom, const unsigned char *buf, size_t length)
+{
+    if (rom->jumped || !length)
+        return -1;
+
+    if (buf[0] == 1)
+    {
+        if (length != sizeof(struct command) || rom->receiving)
+            return -1;
+        // Unread register data is dropped
+        rom->read_remaining = 0;
+        return handle_command(rom, (const struct command *)buf);
+    }
+
+    if (buf[0] == 2 && rom->receiving)
+    {
+        struct region *r = rom->receiving;
+        size_t n = length - 1;
+        if (n > r->size - rom->received)
+            return -1;
+        memcpy(r->data + rom->received, buf + 1, n);
+        rom->received += n;
+        if (rom->received == r->size)
+        {
+            r->next = rom->memory;
+            rom->memory = r;
+            rom->receiving = NULL;
+            queue_report(rom, 3, HAB_OPEN);
+            if (!rom->receiving_dcd)
+                queue_report(rom, 4, WRITE_FILE_COMPLETE);
+            else if (execute_dcd(rom, r->data, r->size))
+                queue_report(rom, 4, DCD_WRITE_COMPLETE);
+            else
+            {
+                rom->status = STATUS_FAILED;
+                queue_report(rom, 4, STATUS_FAILED);
+            }
+        }
+        return 0;
+    }
+
+    return -1;
+}
+
+// Fetch the next queued input report, returns 0 if there is none
+size_t sdp_rom_input(sdp_rom *rom, unsigned char *buf, size_t length)
+{
+    if (rom->head == rom->tail && rom->read_remaining)
+    {
+        // Memory that was never written reads as zeros
+        unsigned char report[65] = {4};
+        uint32_t n = rom->read_remaining < 64 ? rom->read_remaining : 64;
+        for (uint32_t i = 0; i < n; ++i)
+            sdp_rom_read_memory(rom, rom->read_address + i, report + 1 + i, 1);
+        rom->read_address += n;
+        rom->read_remaining -= n;
+        n = length < sizeof(report) ? length : sizeof(report);
+        memcpy(buf, report, n);
+        return n;
+    }
+    if (rom->head == rom->tail)
+        return 0;
+    unsigned int i = rom->tail++ % MAX_PENDING;
+    size_t n = rom->pending_length[i] < length ? rom->pending_length[i] : length;
+    memcpy(buf, rom->pending[i], n);
+    return n;
+}
+
+bool sdp_rom_jumped(const sdp_rom *rom, uint32_t *address)
+{
+    if (rom->jumped && address)
+        *address = rom->jump_address;
+    return rom->jumped;
+}
+
+// Read back memory written so far, returns the number of bytes that were found
+size_t sdp_rom_read_memory(const sdp_rom *rom, uint32_t address, unsigned char *buf, size_t length)
+{
+    size_t i;
+    for (i = 0; i < length; ++i)
+    {
+        const struct region *r = rom->memory;
+        while (r && !(address + i >= r->address && address + i - r->address < r->size))
+            r = r->next;
+        if (!r)
+            break;
+        buf[i] = r->data[address + i - r->address];
+    }
+    return i;
+}
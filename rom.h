@@ -0,0 +1,29 @@
+#ifndef ROM_H_
+#define ROM_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Software model of the i.MX boot ROM's SDP implementation. Output reports
+ * (1 and 2) are fed in, and the input reports (3 and 4) it answers with are
+ * queued until they are read.
+ */
+
+struct sdp_rom_;
+typedef struct sdp_rom_ sdp_rom;
+
+sdp_rom *sdp_rom_new(void);
+void sdp_rom_free(sdp_rom *rom);
+int sdp_rom_output(sdp_rom *rom, const unsigned char *buf, size_t length);
+size_t sdp_rom_input(sdp_rom *rom, unsigned char *buf, size_t length);
+bool sdp_rom_jumped(const sdp_rom *rom, uint32_t *address);
+size_t sdp_rom_read_memory(const sdp_rom *rom, uint32_t address, unsigned char *buf, size_t length);
+
+// Called by the mock transport with each device's ROM before it is freed, so
+// that tests can check what a run left in it
+typedef void (*sdp_rom_callback)(const sdp_rom *rom, void *ctx);
+void sdp_mock_on_close(sdp_rom_callback callback, void *ctx);
+
+#endif
@@ -1,12 +1,15 @@
 #include "sdp.h"
+#include "report.h"
+#include "trace.h"
 #include <arpa/inet.h>
-#include <errno.h>
-#include <fcntl.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
-#include <unistd.h>
+#include <time.h>
+
+#define SEGMENT_RETRIES 3
 
 enum command_type
 {
@@ -33,7 +36,7 @@ enum response_code
 	SKIP_DCD_HEADER_ACK = 0x900DD009,
 };
 
-static int write_command(hid_device *handle, enum command_type cmd, uint32_t address,
+static int write_command(sdp_device *dev, enum command_type cmd, uint32_t address,
 						 uint8_t format, uint32_t data_count, uint32_t data)
 {
 	struct
@@ -55,10 +58,12 @@ static int write_command(hid_device *handle, enum command_type cmd, uint32_t add
 		.reserved = 0,
 	};
 
-	int res = hid_write(handle, (const unsigned char *)&report1, sizeof(report1));
+	uint64_t span = sdp_trace_begin();
+	int res = sdp_device_write(dev, (const unsigned char *)&report1, sizeof(report1));
+	sdp_trace_end(span, "command", "type", cmd);
 	if (res < 0)
 	{
-		fprintf(stderr, "ERROR: Failed to write command: %ls\n", hid_error(handle));
+		fprintf(stderr, "ERROR: Failed to write command: %s\n", sdp_device_error(dev));
 		return 1;
 	}
 	if (res != sizeof(report1))
@@ -69,23 +74,22 @@ static int write_command(hid_device *handle, enum command_type cmd, uint32_t add
 	return 0;
 }
 
-static int read_report(hid_device *handle, uint8_t report_id, unsigned char *buf,
-					   size_t length, bool optional)
+static int read_report(sdp_device *dev, uint8_t report_id, unsigned char *buf,
+					   size_t length)
 {
-	int res = hid_read_timeout(handle, buf, length, optional ? 500 : -1);
+	uint64_t span = sdp_trace_begin();
+	int res = sdp_device_read(dev, buf, length, -1);
+	sdp_trace_end(span, report_id == 3 ? "read HAB status" : "read response", "report", report_id);
 	if (res < 0)
 	{
-		if (!optional)
-			fprintf(stderr, "ERROR: Failed to read report %d: %ls\n",
-					report_id, hid_error(handle));
+		fprintf(stderr, "ERROR: Failed to read report %d: %s\n",
+				report_id, sdp_device_error(dev));
 		return 1;
 	}
 	if ((size_t)res != length)
 	{
-		/* This covers the timeout case (res==0) */
-		if (!optional)
-			fprintf(stderr, "ERROR: Short report %d read (got=%d, wanted=%ld)\n",
-					report_id, res, length);
+		fprintf(stderr, "ERROR: Short report %d read (got=%d, wanted=%ld)\n",
+				report_id, res, length);
 		return 1;
 	}
 	if (buf[0] != report_id)
@@ -96,10 +100,19 @@ static int read_report(hid_device *handle, uint8_t report_id, unsigned char *buf
 	return 0;
 }
 
-static int read_hab_status(hid_device *handle, uint32_t *status)
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int read_hab_status(sdp_device *dev, uint32_t *status)
 {
 	unsigned char buf[5];
-	int res = read_report(handle, 3, buf, sizeof(buf), false);
+	uint64_t start = now_ns();
+	int res = read_report(dev, 3, buf, sizeof(buf));
+	dev->stats.hab_ns += now_ns() - start;
 	if (res)
 		fprintf(stderr, "ERROR: Failed to read HAB status\n");
 	else
@@ -107,28 +120,29 @@ static int read_hab_status(hid_device *handle, uint32_t *status)
 		uint32_t tmp = *(uint32_t *)(buf + 1);
 		if (status)
 			*status = tmp;
-		printf("HAB: ");
 		switch (tmp)
 		{
 		case HAB_CLOSED:
-			printf("closed\n");
+			sdp_report_printf("HAB: closed\n");
 			break;
 		case HAB_OPEN:
-			printf("open\n");
+			sdp_report_printf("HAB: open\n");
 			break;
 		default:
-			printf("unknown (0x%08x)\n", *status);
+			sdp_report_printf("HAB: unknown (0x%08x)\n", tmp);
 			break;
 		}
 	}
 	return res;
 }
 
-static int read_response(hid_device *handle, uint32_t *status, bool optional)
+static int read_response(sdp_device *dev, uint32_t *status)
 {
 	unsigned char buf[65];
-	int res = read_report(handle, 4, buf, sizeof(buf), optional);
-	if (res && !optional)
+	uint64_t start = now_ns();
+	int res = read_report(dev, 4, buf, sizeof(buf));
+	dev->stats.response_ns += now_ns() - start;
+	if (res)
 		fprintf(stderr, "ERROR: Failed to read response\n");
 	else
 	{
@@ -139,109 +153,444 @@ static int read_response(hid_device *handle, uint32_t *status, bool optional)
 	return res;
 }
 
-int sdp_write_file(hid_device *handle, const char *file_path, uint32_t address)
+// Send length bytes as data reports, taken from data or, if that is NULL, read
+// from src. The number of bytes the transport accepted is stored in *sent if
+// it isn't NULL, and the time spent in the transport is added to device_ns.
+static int write_data(sdp_device *dev, sdp_source *src, const unsigned char *data, uint64_t length,
+					  uint64_t *sent, uint64_t *device_ns)
 {
-	int res;
-	int fd = open(file_path, O_RDONLY);
-	if (fd < 0)
+	/* We need one extra byte for the initial report ID */
+	unsigned char buf[1025];
+	buf[0] = 2;
+	for (uint64_t offset = 0; offset < length;)
 	{
-		fprintf(stderr, "ERROR: Failed to open file \"%s\": %s\n", file_path, strerror(errno));
-		res = -1;
-		goto out;
+		ssize_t n = length - offset > 1024 ? 1024 : length - offset;
+		if (data)
+			memcpy(buf + 1, data + offset, n);
+		else
+		{
+			n = sdp_source_read(src, buf + 1, n);
+			if (n <= 0)
+			{
+				fprintf(stderr, "ERROR: Unexpected end of \"%s\"\n", sdp_source_name(src));
+				return 1;
+			}
+		}
+
+		uint64_t t = now_ns();
+		uint64_t span = sdp_trace_begin();
+		int res = sdp_device_write_queued(dev, buf, n + 1);
+		sdp_trace_end(span, "data report", "bytes", n);
+		*device_ns += now_ns() - t;
+		if (res < 0)
+		{
+			fprintf(stderr, "ERROR: Failed to write data chunk: %s\n", sdp_device_error(dev));
+			return 1;
+		}
+		if (res != n + 1)
+		{
+			fprintf(stderr, "ERROR: Short data chunk write (wrote %d bytes, wanted %ld bytes)\n", res, n);
+			return 1;
+		}
+		offset += n;
+		if (sent)
+			*sent = offset;
 	}
+	return 0;
+}
+
+static int flush_data(sdp_device *dev, uint64_t *device_ns)
+{
+	uint64_t t = now_ns();
+	uint64_t span = sdp_trace_begin();
+	int res = sdp_device_flush(dev);
+	sdp_trace_end(span, "flush", NULL, 0);
+	*device_ns += now_ns() - t;
+	if (res)
+	{
+		fprintf(stderr, "ERROR: Failed to write data chunk: %s\n", sdp_device_error(dev));
+		return 1;
+	}
+	return 0;
+}
 
-	struct stat stat;
-	res = fstat(fd, &stat);
+static int read_write_file_response(sdp_device *dev)
+{
+	uint32_t hab_status, status;
+	int res = read_hab_status(dev, &hab_status);
+	if (res)
+		return res;
+	res = read_response(dev, &status);
 	if (res)
+		return res;
+	if (status != WRITE_FILE_COMPLETE)
+	{
+		fprintf(stderr, "ERROR: Failed to write file: 0x%08x\n", status);
+		return 1;
+	}
+	return 0;
+}
+
+static void account_sources(sdp_device *dev, sdp_source *const *srcs, int count, uint64_t total_ns,
+							uint64_t device_ns)
+{
+	uint64_t bytes = 0;
+	for (int i = 0; i < count; ++i)
+		bytes += sdp_source_size(srcs[i]);
+	dev->stats.bytes += bytes;
+	dev->stats.data_ns += total_ns;
+	sdp_report_printf("Sent %" PRIu64 " bytes in %.3fs (%.2f MB/s), %.3fs on device\n", bytes,
+					  total_ns / 1e9, total_ns ? bytes * 1e3 / total_ns : 0.0, device_ns / 1e9);
+}
+
+// Discard input reports left over from an interrupted command
+static void drain_reports(sdp_device *dev)
+{
+	unsigned char buf[65];
+	while (sdp_device_read(dev, buf, sizeof(buf), 0) > 0)
+		;
+}
+
+int sdp_write_source(sdp_device *dev, sdp_source *src, uint32_t address)
+{
+	return sdp_write_sources(dev, &src, 1, address);
+}
+
+// Write the sources back to back with a single WRITE_FILE command
+int sdp_write_sources(sdp_device *dev, sdp_source *const *srcs, int count, uint32_t address)
+{
+	uint64_t size = 0;
+	for (int i = 0; i < count; ++i)
+		size += sdp_source_size(srcs[i]);
+	if (size > UINT32_MAX)
 	{
-		fprintf(stderr, "ERROR: Failed to stat file \"%s\": %s\n", file_path, strerror(errno));
-		goto close_fd;
+		fprintf(stderr, "ERROR: \"%s\" is too large (size: %" PRIu64 ")\n", sdp_source_name(srcs[0]), size);
+		return 1;
 	}
-	printf("Writing file \"%s\" (size: %ld) to 0x%08x\n", file_path, stat.st_size, address);
 
-	res = write_command(handle, WRITE_FILE, address, 0, stat.st_size, 0);
+	if (count == 1)
+		sdp_report_printf("Writing file \"%s\" (size: %" PRIu64 ") to 0x%08x\n", sdp_source_name(srcs[0]), size, address);
+	else
+		sdp_report_printf("Writing %d files (size: %" PRIu64 ") to 0x%08x\n", count, size, address);
+	int res = write_command(dev, WRITE_FILE, address, 0, size, 0);
 	if (res)
-		goto close_fd;
+		return res;
 
 	/*
 	 * Optionally send ERROR_STATUS command here to see whether the device has
 	 * rejected the address.
 	 */
 
-	/* We need one extra byte for the initial report ID */
-	unsigned char buf[1025];
-	buf[0] = 2;
-	while (stat.st_size > 0)
+	uint64_t start = now_ns();
+	uint64_t device_ns = 0;
+	for (int i = 0; !res && i < count; ++i)
+		res = write_data(dev, srcs[i], NULL, sdp_source_size(srcs[i]), NULL, &device_ns);
+	if (!res)
+		res = flush_data(dev, &device_ns);
+	if (res)
+		return res;
+	account_sources(dev, srcs, count, now_ns() - start, device_ns);
+
+	return read_write_file_response(dev);
+}
+
+// Bring the ROM back to the boundary of a segment that failed. It takes no
+// command before it has received the whole data_count, so if a data report
+// failed after sent bytes, the data phase is completed with the rest of the
+// segment, and the ROM's answer is read and ignored (the segment is sent again
+// anyway). ERROR_STATUS then checks that the ROM answers commands. Every failure
+// on the way is retried and counted.
+static int recover_segment(sdp_device *dev, const unsigned char *segment, uint32_t length,
+						   bool receiving, uint64_t sent, int *failures, uint64_t *device_ns)
+{
+	while (receiving && sent < length)
+	{
+		uint64_t n = 0;
+		if (!write_data(dev, NULL, segment + sent, length - sent, &n, device_ns) &&
+			!flush_data(dev, device_ns))
+			break;
+		sent += n;
+		if (++*failures > SEGMENT_RETRIES)
+			return 1;
+	}
+
+	unsigned char buf[65];
+	if (receiving && (read_report(dev, 3, buf, 5) || read_report(dev, 4, buf, sizeof(buf))))
+		return 1;
+
+	for (;;)
+	{
+		// Left over from an answer that was only partly read
+		drain_reports(dev);
+		uint32_t hab_status, status;
+		if (!sdp_error_status(dev, &hab_status, &status))
+			return 0;
+		if (++*failures > SEGMENT_RETRIES)
+			return 1;
+	}
+}
+
+// Like sdp_write_source(), but as one WRITE_FILE command per segment_size bytes,
+// at consecutive addresses. If a segment fails, the ROM is brought back to the
+// segment boundary (see recover_segment()) and the segment is sent again from
+// its own address, up to SEGMENT_RETRIES times. Segments of an image are sent straight from it instead
+// of a copy per board.
+int sdp_write_segments(sdp_device *dev, sdp_source *src, uint32_t address, uint32_t segment_size)
+{
+	uint64_t size = sdp_source_size(src);
+	if (!size || !segment_size)
+		return sdp_write_source(dev, src, address);
+	if (size > UINT32_MAX)
+	{
+		fprintf(stderr, "ERROR: \"%s\" is too large (size: %" PRIu64 ")\n", sdp_source_name(src), size);
+		return 1;
+	}
+
+	const unsigned char *data = sdp_source_data(src);
+	unsigned char *buffer = NULL;
+	if (!data)
+	{
+		buffer = malloc(size < segment_size ? size : segment_size);
+		if (!buffer)
+		{
+			fprintf(stderr, "ERROR: Failed to allocate segment\n");
+			return 1;
+		}
+	}
+
+	sdp_report_printf("Writing file \"%s\" (size: %" PRIu64 ") to 0x%08x in segments of %" PRIu32 " bytes\n",
+					  sdp_source_name(src), size, address, segment_size);
+	uint64_t start = now_ns();
+	uint64_t device_ns = 0;
+	int res = 0;
+	for (uint64_t offset = 0; !res && offset < size; offset += segment_size)
 	{
-		ssize_t n = read(fd, buf + 1, stat.st_size > 1024 ? 1024 : stat.st_size);
-		if (n <= 0)
+		uint32_t length = size - offset < segment_size ? size - offset : segment_size;
+		uint32_t segment_address = address + offset;
+		const unsigned char *segment = data ? data + offset : buffer;
+		for (uint32_t n = 0; !data && n < length;)
 		{
+			ssize_t r = sdp_source_read(src, buffer + n, length - n);
+			if (r <= 0)
+			{
+				fprintf(stderr, "ERROR: Unexpected end of \"%s\"\n", sdp_source_name(src));
+				res = 1;
+				break;
+			}
+			n += r;
 		}
-		stat.st_size -= n;
 
-		res = hid_write(handle, buf, n + 1);
+		for (int failures = 0; !res;)
+		{
+			// Whether the ROM is still in the segment's data phase
+			bool receiving = false;
+			uint64_t sent = 0;
+			res = write_command(dev, WRITE_FILE, segment_address, 0, length, 0);
+			if (!res)
+			{
+				receiving = true;
+				res = write_data(dev, NULL, segment, length, &sent, &device_ns);
+			}
+			if (!res)
+				res = flush_data(dev, &device_ns);
+			if (!res)
+			{
+				receiving = false;
+				res = read_write_file_response(dev);
+			}
+			if (!res || failures++ == SEGMENT_RETRIES)
+				break;
+
+			fprintf(stderr, "WARN: Resending segment at 0x%08" PRIx32 " (retry %d of %d)\n",
+					segment_address, failures, SEGMENT_RETRIES);
+			dev->stats.retries++;
+			res = recover_segment(dev, segment, length, receiving, sent, &failures, &device_ns);
+		}
+		if (res)
+			fprintf(stderr, "ERROR: Failed to write segment at 0x%08" PRIx32 "\n", segment_address);
+	}
+	free(buffer);
+	if (res)
+		return res;
+
+	account_sources(dev, &src, 1, now_ns() - start, device_ns);
+	return 0;
+}
+
+int sdp_dcd_write(sdp_device *dev, const unsigned char *dcd, size_t length, uint32_t address)
+{
+	sdp_report_printf("Writing DCD (size: %zu) to 0x%08x\n", length, address);
+	int res = write_command(dev, DCD_WRITE, address, 0, length, 0);
+	if (res)
+		return res;
+
+	uint64_t start = now_ns();
+	unsigned char buf[1025];
+	buf[0] = 2;
+	for (size_t offset = 0; offset < length;)
+	{
+		size_t n = length - offset > 1024 ? 1024 : length - offset;
+		memcpy(buf + 1, dcd + offset, n);
+		uint64_t span = sdp_trace_begin();
+		res = sdp_device_write(dev, buf, n + 1);
+		sdp_trace_end(span, "data report", "bytes", n);
 		if (res < 0)
 		{
-			fprintf(stderr, "ERROR: Failed to write data chunk: %ls\n", hid_error(handle));
-			goto close_fd;
+			fprintf(stderr, "ERROR: Failed to write DCD: %s\n", sdp_device_error(dev));
+			return 1;
 		}
-		if (res != n + 1)
+		if ((size_t)res != n + 1)
 		{
-			fprintf(stderr, "ERROR: Short data chunk write (wrote %d bytes, wanted %ld bytes)\n", res, n);
-			goto close_fd;
+			fprintf(stderr, "ERROR: Short DCD write (wrote %d bytes, wanted %zu bytes)\n", res, n + 1);
+			return 1;
 		}
+		offset += n;
 	}
+	dev->stats.bytes += length;
+	dev->stats.data_ns += now_ns() - start;
 
 	uint32_t hab_status, status;
-	res = read_hab_status(handle, &hab_status);
+	res = read_hab_status(dev, &hab_status);
 	if (res)
-		goto close_fd;
-	res = read_response(handle, &status, false);
+		return res;
+	res = read_response(dev, &status);
 	if (res)
-		goto close_fd;
-	if (status != WRITE_FILE_COMPLETE)
+		return res;
+	if (status != DCD_WRITE_COMPLETE)
 	{
-		fprintf(stderr, "ERROR: Failed to write file: 0x%08x\n", status);
-		res = 1;
+		fprintf(stderr, "ERROR: Failed to write DCD: 0x%08x\n", status);
+		return 1;
 	}
+	return 0;
+}
 
-close_fd:
-	close(fd);
-out:
-	return res;
+// width is the register's in bytes (1, 2 or 4)
+int sdp_write_register(sdp_device *dev, uint32_t address, uint32_t value, unsigned int width)
+{
+	sdp_report_printf("Writing 0x%0*x to 0x%08x\n", width * 2, value, address);
+	int res = write_command(dev, WRITE_REGISTER, address, width * 8, width, value);
+	if (res)
+		return res;
+
+	uint32_t hab_status, status;
+	res = read_hab_status(dev, &hab_status);
+	if (res)
+		return res;
+	res = read_response(dev, &status);
+	if (res)
+		return res;
+	if (status != WRITE_REGISTER_COMPLETE)
+	{
+		fprintf(stderr, "ERROR: Failed to write register: 0x%08x\n", status);
+		return 1;
+	}
+	return 0;
 }
 
-int sdp_error_status(hid_device *handle, uint32_t *hab_status, uint32_t *status)
+// Read count consecutive registers of width bytes (1, 2 or 4) with a single
+// READ_REGISTER command; the ROM sends them in response reports of 64 bytes
+int sdp_read_registers(sdp_device *dev, uint32_t address, unsigned int width, uint32_t *values,
+					   uint32_t count)
 {
-	int res = write_command(handle, ERROR_STATUS, 0x00000000, 0, 0, 0);
+	uint64_t length = (uint64_t)count * width;
+	if (length > UINT32_MAX)
+	{
+		fprintf(stderr, "ERROR: Too many registers to read (%" PRIu32 ")\n", count);
+		return 1;
+	}
+
+	sdp_report_printf("Reading %" PRIu32 " register(s) at 0x%08x\n", count, address);
+	int res = write_command(dev, READ_REGISTER, address, width * 8, length, 0);
+	if (res)
+		return res;
+	uint32_t hab_status;
+	res = read_hab_status(dev, &hab_status);
+	if (res)
+		return res;
+
+	unsigned char buf[65];
+	unsigned char word[4];
+	uint64_t start = now_ns();
+	for (uint64_t offset = 0; offset < length;)
+	{
+		res = read_report(dev, 4, buf, sizeof(buf));
+		if (res)
+			break;
+		for (int i = 1; i < (int)sizeof(buf) && offset < length; ++i, ++offset)
+		{
+			// Little-endian, as in the SoC's memory
+			word[offset % width] = buf[i];
+			if (offset % width == width - 1)
+			{
+				uint32_t value = 0;
+				for (int j = width - 1; j >= 0; --j)
+					value = (value << 8) | word[j];
+				values[offset / width] = value;
+			}
+		}
+	}
+	dev->stats.response_ns += now_ns() - start;
+	if (res)
+	{
+		fprintf(stderr, "ERROR: Failed to read registers\n");
+		return res;
+	}
+
+	for (uint32_t i = 0; i < count; ++i)
+		sdp_report_printf("0x%08x: 0x%0*x\n", address + i * width, width * 2, values[i]);
+	return 0;
+}
+
+int sdp_error_status(sdp_device *dev, uint32_t *hab_status, uint32_t *status)
+{
+	int res = write_command(dev, ERROR_STATUS, 0x00000000, 0, 0, 0);
 	if (res)
 		return 1;
-	res = read_hab_status(handle, hab_status);
+	res = read_hab_status(dev, hab_status);
 	if (res)
 		return 1;
-	res = read_response(handle, status, false);
+	res = read_response(dev, status);
 	if (res)
 		return 1;
-	printf("Error status: 0x%08x\n", *status);
+	sdp_report_printf("Error status: 0x%08x\n", *status);
 	return 0;
 }
 
-int sdp_jump_address(hid_device *handle, uint32_t address)
+// Success isn't answered by the ROM, see sdp_jump_wait()
+int sdp_jump_address(sdp_device *dev, uint32_t address)
 {
-	printf("Jumping to 0x%08x\n", address);
-	int res = write_command(handle, JUMP_ADDRESS, address, 0, 0, 0);
+	sdp_report_printf("Jumping to 0x%08x\n", address);
+	int res = write_command(dev, JUMP_ADDRESS, address, 0, 0, 0);
 	if (res)
 		return 1;
-	uint32_t hab_status, status;
-	res = read_hab_status(handle, &hab_status);
-	if (res)
+	uint32_t hab_status;
+	return read_hab_status(dev, &hab_status);
+}
+
+// Wait up to timeout ms for the outcome of a jump: returns 1 if the device went
+// away (the jump succeeded), 0 if nothing happened yet and -1 if the ROM sent
+// report 4, which it only does if the jump failed, or the read failed with the
+// device still there
+int sdp_jump_wait(sdp_device *dev, int timeout)
+{
+	unsigned char buf[65];
+	uint64_t span = sdp_trace_begin();
+	int res = sdp_device_read(dev, buf, sizeof(buf), timeout);
+	sdp_trace_end(span, "jump wait", "result", res);
+	if (res < 0 && sdp_device_disconnected(dev))
 		return 1;
-	// Report 4 is only sent if the jump failed
-	res = read_response(handle, &status, true);
-	if (!res)
+	if (res < 0)
 	{
-		fprintf(stderr, "ERROR: Jumping to 0x%08x failed: 0x%08x\n", address, status);
-		return 1;
+		fprintf(stderr, "ERROR: Failed to wait for the jump: %s\n", sdp_device_error(dev));
+		return -1;
 	}
-	return 0;
+	if (res == 0)
+		return 0;
+	if ((size_t)res != sizeof(buf) || buf[0] != 4)
+	{
+		fprintf(stderr, "ERROR: Unexpected report after jump (ID=%d, length=%d)\n", buf[0], res);
+		return -1;
+	}
+	fprintf(stderr, "ERROR: Jump failed: 0x%08x\n", *(uint32_t *)(buf + 1));
+	return -1;
 }
@@ -1,11 +1,20 @@
 #ifndef SDP_H_
 #define SDP_H_
 
+#include "source.h"
+#include "transport.h"
+#include <stddef.h>
 #include <stdint.h>
-#include <hidapi/hidapi.h>
 
-int sdp_write_file(hid_device *handle, const char *file_path, uint32_t address);
-int sdp_error_status(hid_device *handle, uint32_t *hab_status, uint32_t *status);
-int sdp_jump_address(hid_device *handle, uint32_t address);
+int sdp_write_source(sdp_device *dev, sdp_source *src, uint32_t address);
+int sdp_write_sources(sdp_device *dev, sdp_source *const *srcs, int count, uint32_t address);
+int sdp_write_segments(sdp_device *dev, sdp_source *src, uint32_t address, uint32_t segment_size);
+int sdp_dcd_write(sdp_device *dev, const unsigned char *dcd, size_t length, uint32_t address);
+int sdp_write_register(sdp_device *dev, uint32_t address, uint32_t value, unsigned int width);
+int sdp_read_registers(sdp_device *dev, uint32_t address, unsigned int width, uint32_t *values,
+                       uint32_t count);
+int sdp_error_status(sdp_device *dev, uint32_t *hab_status, uint32_t *status);
+int sdp_jump_address(sdp_device *dev, uint32_t address);
+int sdp_jump_wait(sdp_device *dev, int timeout);
 
 #endif
@@ -0,0 +1,201 @@
+#include "imxsdp.h"
+#include "transport.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/*
+ * The worker thread runs the stages with a report listener that queues every
+ * event and signals the eventfd. sdp_session_process() drains the queue from
+ * the caller's thread, which is where the callback runs.
+ */
+
+struct sdp_session_
+{
+    const sdp_stages *stages;
+    bool initial_wait;
+    char *usb_path;
+    sdp_session_callback callback;
+    void *ctx;
+    int fd;
+    pthread_t thread;
+    enum sdp_session_state state;
+    bool joined;
+
+    // Shared with the worker
+    pthread_mutex_t lock;
+    struct sdp_report_event *events;
+    size_t event_count;
+    size_t event_capacity;
+    bool done;
+    int result;
+};
+
+static void wake(sdp_session *session)
+{
+    uint64_t one = 1;
+    while (write(session->fd, &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+}
+
+// The run's USB path is gone by the time the event is processed
+static void queue_event(const struct sdp_report_event *event, void *ctx)
+{
+    sdp_session *session = ctx;
+
+    pthread_mutex_lock(&session->lock);
+    if (session->event_count == session->event_capacity)
+    {
+        size_t capacity = session->event_capacity ? session->event_capacity * 2 : 16;
+        struct sdp_report_event *tmp = realloc(session->events, capacity * sizeof(*tmp));
+        if (!tmp)
+        {
+            pthread_mutex_unlock(&session->lock);
+            fprintf(stderr, "WARN: Failed to queue session event\n");
+            return;
+        }
+        session->events = tmp;
+        session->event_capacity = capacity;
+    }
+    struct sdp_report_event *queued = &session->events[session->event_count++];
+    *queued = *event;
+    queued->usb_path = session->usb_path;
+    pthread_mutex_unlock(&session->lock);
+
+    wake(session);
+}
+
+static void *session_worker(void *arg)
+{
+    sdp_session *session = arg;
+    sdp_report_listen(queue_event, session);
+    int result = sdp_run_stages(session->stages, session->initial_wait, session->usb_path);
+
+    pthread_mutex_lock(&session->lock);
+    session->done = true;
+    session->result = result;
+    pthread_mutex_unlock(&session->lock);
+    wake(session);
+    return NULL;
+}
+
+int sdp_library_init(const char *transport)
+{
+    if (transport && sdp_transport_select(transport))
+        return -1;
+    sdp_report_quiet(true);
+    return sdp_transport_init() ? -1 : 0;
+}
+
+void sdp_library_exit(void)
+{
+    sdp_transport_exit();
+}
+
+sdp_session *sdp_session_start(const sdp_stages *stages, const char *usb_path, bool initial_wait,
+                               sdp_session_callback callback, void *ctx)
+{
+    sdp_session *session = calloc(1, sizeof(sdp_session));
+    if (!session)
+    {
+        fprintf(stderr, "ERROR: Failed to allocate session\n");
+        return NULL;
+    }
+
+    session->stages = stages;
+    session->initial_wait = initial_wait;
+    session->callback = callback;
+    session->ctx = ctx;
+    session->state = SDP_SESSION_RUNNING;
+    pthread_mutex_init(&session->lock, NULL);
+    if (usb_path)
+    {
+        session->usb_path = strdup(usb_path);
+        if (!session->usb_path)
+        {
+            fprintf(stderr, "ERROR: Failed to allocate USB path\n");
+            goto free_session;
+        }
+    }
+
+    session->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (session->fd < 0)
+    {
+        fprintf(stderr, "ERROR: Failed to create session fd: %s\n", strerror(errno));
+        goto free_path;
+    }
+
+    int err = pthread_create(&session->thread, NULL, session_worker, session);
+    if (err)
+    {
+        fprintf(stderr, "ERROR: Failed to start session: %s\n", strerror(err));
+        goto close_fd;
+    }
+    return session;
+
+close_fd:
+    close(session->fd);
+free_path:
+    free(session->usb_path);
+free_session:
+    pthread_mutex_destroy(&session->lock);
+    free(session);
+    return NULL;
+}
+
+// Readable when sdp_session_process() has something to do
+int sdp_session_fd(const sdp_session *session)
+{
+    return session->fd;
+}
+
+// Passes the queued events to the callback, without blocking. Once the run is
+// over, the session is DONE or FAILED.
+enum sdp_session_state sdp_session_process(sdp_session *session)
+{
+    uint64_t count;
+    while (read(session->fd, &count, sizeof(count)) < 0 && errno == EINTR)
+        ;
+
+    pthread_mutex_lock(&session->lock);
+    struct sdp_report_event *events = session->events;
+    size_t event_count = session->event_count;
+    session->events = NULL;
+    session->event_count = session->event_capacity = 0;
+    bool done = session->done;
+    int result = session->result;
+    pthread_mutex_unlock(&session->lock);
+
+    for (size_t i = 0; session->callback && i < event_count; ++i)
+        session->callback(session, &events[i], session->ctx);
+    free(events);
+
+    if (done && !session->joined)
+    {
+        pthread_join(session->thread, NULL);
+        session->joined = true;
+        session->state = result ? SDP_SESSION_FAILED : SDP_SESSION_DONE;
+    }
+    return session->state;
+}
+
+const char *sdp_session_usb_path(const sdp_session *session)
+{
+    return session->usb_path;
+}
+
+void sdp_session_free(sdp_session *session)
+{
+    if (!session->joined)
+        pthread_join(session->thread, NULL);
+    close(session->fd);
+    pthread_mutex_destroy(&session->lock);
+    free(session->events);
+    free(session->usb_path);
+    free(session);
+}
@@ -0,0 +1,153 @@
+#include "source.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A source hands out the data of an image that was loaded (and decoded) when
+ * the steps were prepared, with a position of its own, so any number of boards
+ * can read the same image at once. Header fields can be patched on the way out.
+ */
+#define MAX_PATCHES 4
+#define MAX_PATCH_SIZE 16
+
+struct sdp_source_
+{
+    char *path;
+    sdp_image *image;
+    uint64_t base;     // offset of the source's range within the image
+    uint64_t size;
+    uint64_t position; // bytes handed out by sdp_source_read()
+
+    // Bytes replaced while reading, e.g. header fields
+    struct
+    {
+        uint64_t offset;
+        size_t length;
+        unsigned char data[MAX_PATCH_SIZE];
+    } patches[MAX_PATCHES];
+    int patch_count;
+};
+
+sdp_source *sdp_source_open_image(sdp_image *image)
+{
+    sdp_source *src = calloc(1, sizeof(sdp_source));
+    if (!src)
+    {
+        fprintf(stderr, "ERROR: Failed to allocate source\n");
+        return NULL;
+    }
+
+    src->path = strdup(sdp_image_path(image));
+    if (!src->path)
+    {
+        fprintf(stderr, "ERROR: Failed to allocate file path\n");
+        free(src);
+        return NULL;
+    }
+    src->image = sdp_image_ref(image);
+    src->size = sdp_image_size(image);
+    return src;
+}
+
+const char *sdp_source_name(const sdp_source *src)
+{
+    return src->path;
+}
+
+uint64_t sdp_source_size(const sdp_source *src)
+{
+    return src->size;
+}
+
+// Overlay the patches onto data that was just read from position
+static void apply_patches(const sdp_source *src, unsigned char *buf, uint64_t position, size_t length)
+{
+    for (int i = 0; i < src->patch_count; ++i)
+    {
+        uint64_t start = src->patches[i].offset;
+        uint64_t end = start + src->patches[i].length;
+        if (end <= position || start >= position + length)
+            continue;
+        uint64_t from = start > position ? start : position;
+        uint64_t to = end < position + length ? end : position + length;
+        memcpy(buf + (from - position), src->patches[i].data + (from - start), to - from);
+    }
+}
+
+// Copy up to length bytes into buf. Returns the number of bytes copied, 0 at
+// the end of the source.
+ssize_t sdp_source_read(sdp_source *src, void *buf, size_t length)
+{
+    if (length > src->size - src->position)
+        length = src->size - src->position;
+    if (!length)
+        return 0;
+
+    memcpy(buf, sdp_image_data(src->image) + src->base + src->position, length);
+    apply_patches(src, buf, src->position, length);
+    src->position += length;
+    return length;
+}
+
+// Replace length bytes at offset with data when they are read. Must be called
+// before the first sdp_source_read().
+int sdp_source_patch(sdp_source *src, uint64_t offset, const void *data, size_t length)
+{
+    if (src->patch_count == MAX_PATCHES || length > MAX_PATCH_SIZE)
+    {
+        fprintf(stderr, "ERROR: Too many patches for \"%s\"\n", src->path);
+        return -1;
+    }
+    src->patches[src->patch_count].offset = offset;
+    src->patches[src->patch_count].length = length;
+    memcpy(src->patches[src->patch_count].data, data, length);
+    src->patch_count++;
+    return 0;
+}
+
+// Limit the source to its first size bytes. Must be called before the first
+// sdp_source_read().
+int sdp_source_truncate(sdp_source *src, uint64_t size)
+{
+    if (size > src->size)
+    {
+        fprintf(stderr, "ERROR: \"%s\" is shorter than %" PRIu64 " bytes\n", src->path, size);
+        return -1;
+    }
+    src->size = size;
+    return 0;
+}
+
+// Limit the source to length bytes from offset, which are read straight from the
+// image. Must be called before the first sdp_source_read().
+int sdp_source_range(sdp_source *src, uint64_t offset, uint64_t length)
+{
+    if (offset > src->size || length > src->size - offset)
+    {
+        fprintf(stderr, "ERROR: Range 0x%" PRIx64 "+0x%" PRIx64 " beyond the end of \"%s\"\n", offset,
+                length, src->path);
+        return -1;
+    }
+    src->base += offset;
+    src->size = length;
+    return 0;
+}
+
+// The source's data if it is read unchanged, so that it can be sent straight
+// from the image shared by all boards; NULL otherwise. Must be called before the
+// first sdp_source_read().
+const unsigned char *sdp_source_data(const sdp_source *src)
+{
+    if (src->patch_count || src->position)
+        return NULL;
+    return sdp_image_data(src->image) + src->base;
+}
+
+void sdp_source_close(sdp_source *src)
+{
+    sdp_image_put(src->image);
+    free(src->path);
+    free(src);
+}
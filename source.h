@@ -0,0 +1,21 @@
+#ifndef SOURCE_H_
+#define SOURCE_H_
+
+#include "image.h"
+#include <stdint.h>
+#include <sys/types.h>
+
+struct sdp_source_;
+typedef struct sdp_source_ sdp_source;
+
+sdp_source *sdp_source_open_image(sdp_image *image);
+const char *sdp_source_name(const sdp_source *src);
+uint64_t sdp_source_size(const sdp_source *src);
+ssize_t sdp_source_read(sdp_source *src, void *buf, size_t length);
+int sdp_source_truncate(sdp_source *src, uint64_t size);
+int sdp_source_range(sdp_source *src, uint64_t offset, uint64_t length);
+int sdp_source_patch(sdp_source *src, uint64_t offset, const void *data, size_t length);
+const unsigned char *sdp_source_data(const sdp_source *src);
+void sdp_source_close(sdp_source *src);
+
+#endif
@@ -87,15 +87,28 @@ static bool consume_scalar(yaml_parser_t *parser, yaml_event_t *event, const cha
     return false;
 }
 
+static void free_options(struct sdp_step_option *options, int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        free((void *)options[i].key);
+        free((void *)options[i].value);
+    }
+}
+
 sdp_stages *sdp_parse_spec(const char *spec_path, const char **usb_path)
 {
-    sdp_stages *stages = NULL;
+    sdp_stages *result = NULL;
+
+    sdp_stages *stages = sdp_new_stages();
+    if (!stages)
+        goto out;
 
     FILE *spec = fopen(spec_path, "r");
     if (!spec)
     {
         fprintf(stderr, "ERROR: Failed to open %s: %s\n", spec_path, strerror(errno));
-        goto out;
+        goto free_stages;
     }
 
     yaml_parser_t parser;
@@ -110,10 +123,13 @@ sdp_stages *sdp_parse_spec(const char *spec_path, const char **usb_path)
 
     const char *vid = NULL;
     const char *pid = NULL;
-    sdp_step *steps = NULL;
+    const char *timeout = NULL;
+    sdp_steps *steps = NULL;
     const char *op = NULL;
     const char *file = NULL;
     const char *address = NULL;
+    struct sdp_step_option options[MAX_STEP_OPTIONS];
+    int option_count = 0;
 
     yaml_event_t event;
     bool done;
@@ -222,6 +238,14 @@ sdp_stages *sdp_parse_spec(const char *spec_path, const char **usb_path)
                         goto delete_event;
                     }
                 }
+                else if (!strcmp("timeout", (const char *) event.data.scalar.value))
+                {
+                    if (!consume_scalar(&parser, &event, &timeout))
+                    {
+                        fprintf(stderr, "ERROR: Failed to read timeout\n");
+                        goto delete_event;
+                    }
+                }
                 else if (!strcmp("steps", (const char *) event.data.scalar.value))
                     fsm = STATE_STEPS_KEY;
                 else
@@ -232,18 +256,16 @@ sdp_stages *sdp_parse_spec(const char *spec_path, const char **usb_path)
                 break;
             case YAML_MAPPING_END_EVENT:
                 {
-                    sdp_stages *stage = sdp_new_stage(vid, pid, steps);
+                    int res = sdp_add_stage(stages, vid, pid, timeout, steps);
                     free((void*)vid);
                     vid = NULL;
                     free((void*)pid);
                     pid = NULL;
-                    if (!stage)
-                    {
-                        sdp_free_steps(steps);
+                    free((void*)timeout);
+                    timeout = NULL;
+                    if (res)
                         goto delete_event;
-                    }
                     steps = NULL;
-                    stages = sdp_append_stage(stages, stage);
                     fsm = STATE_STAGES_SEQ;
                 }
                 break;
@@ -256,6 +278,8 @@ sdp_stages *sdp_parse_spec(const char *spec_path, const char **usb_path)
             switch (event.type)
             {
             case YAML_SEQUENCE_START_EVENT:
+                if (!steps && !(steps = sdp_new_steps()))
+                    goto delete_event;
                 fsm = STATE_STEPS_SEQ;
                 break;
             default:
@@ -307,22 +331,41 @@ sdp_stages *sdp_parse_spec(const char *spec_path, const char **usb_path)
                 }
                 else
                 {
-                    fprintf(stderr, "ERROR: Unexpected key: %s\n", event.data.scalar.value);
-                    goto delete_event;
+                    // Any other key is an option of the step
+                    if (option_count == MAX_STEP_OPTIONS)
+                    {
+                        fprintf(stderr, "ERROR: Too many step options\n");
+                        goto delete_event;
+                    }
+                    struct sdp_step_option *option = &options[option_count];
+                    option->key = strdup((const char *) event.data.scalar.value);
+                    if (!option->key)
+                    {
+                        fprintf(stderr, "ERROR: Failed to allocate option key\n");
+                        goto delete_event;
+                    }
+                    if (!consume_scalar(&parser, &event, &option->value))
+                    {
+                        fprintf(stderr, "ERROR: Failed to read option %s\n", option->key);
+                        free((void *)option->key);
+                        goto delete_event;
+                    }
+                    option_count++;
                 }
                 break;
             case YAML_MAPPING_END_EVENT:
                 {
-                    sdp_step *step = sdp_new_step(op, file, address);
+                    int res = sdp_add_step(steps, op, file, address, options, option_count);
                     free((void *)op);
                     op = NULL;
                     free((void *)file);
                     file = NULL;
                     free((void *)address);
                     address = NULL;
-                    if (!step)
+                    free_options(options, option_count);
+                    option_count = 0;
+                    if (res)
                         goto delete_event;
-                    steps = sdp_append_step(steps, step);
                     fsm = STATE_STEPS_SEQ;
                 }
                 break;
@@ -350,15 +393,32 @@ sdp_stages *sdp_parse_spec(const char *spec_path, const char **usb_path)
     }
     while (!done);
 
-    if (!stages)
+    if (!sdp_stage_count(stages))
         fprintf(stderr, "ERROR: No stages defined\n");
+    else
+    {
+        result = stages;
+        stages = NULL;
+    }
 
 delete_event:
+    free((void *)vid);
+    free((void *)pid);
+    free((void *)timeout);
+    free((void *)op);
+    free((void *)file);
+    free((void *)address);
+    free_options(options, option_count);
+    if (steps)
+        sdp_free_steps(steps);
     yaml_event_delete(&event);
 delete_parser:
     yaml_parser_delete(&parser);
 close_file:
     fclose(spec);
+free_stages:
+    if (stages)
+        sdp_free_stages(stages);
 out:
-    return stages;
+    return result;
 }
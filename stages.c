@@ -1,27 +1,65 @@
 #include "stages.h"
-#include "config.h"
+#include "hotplug.h"
+#include "image.h"
+#include "report.h"
 #include "sdp.h"
+#include "trace.h"
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-#ifdef WITH_UDEV
-#include "udev.h"
-#else
-#include <unistd.h>
-#endif
-
-struct sdp_stage_
+struct stage
 {
     uint16_t usb_vid;
     uint16_t usb_pid;
-    sdp_step *steps;
-    struct sdp_stage_ *next;
+    int timeout; // ms to wait for the device, -1 if unset
+    sdp_steps *steps;
+};
+
+struct sdp_stages_
+{
+    struct stage *stages;
+    int count;
+    int capacity;
 };
 
-static int parse_stage(char *const s, struct sdp_stage_ *stage)
+sdp_stages *sdp_new_stages(void)
+{
+    sdp_stages *stages = calloc(1, sizeof(sdp_stages));
+    if (!stages)
+        fprintf(stderr, "ERROR: Failed to allocate stages\n");
+    return stages;
+}
+
+// Reserve the next stage, which is only counted once it is complete
+static struct stage *next_stage(sdp_stages *stages)
+{
+    if (stages->count == stages->capacity)
+    {
+        int capacity = stages->capacity ? 2 * stages->capacity : 4;
+        struct stage *tmp = realloc(stages->stages, capacity * sizeof(struct stage));
+        if (!tmp)
+        {
+            fprintf(stderr, "ERROR: Failed to allocate stage\n");
+            return NULL;
+        }
+        stages->stages = tmp;
+        stages->capacity = capacity;
+    }
+
+    struct stage *stage = &stages->stages[stages->count];
+    memset(stage, 0, sizeof(*stage));
+    stage->timeout = -1;
+    return stage;
+}
+
+static int parse_stage(char *const s, struct stage *stage)
 {
     char *saveptr = NULL;
     char *tok = strtok_r(s, ",", &saveptr);
@@ -32,8 +70,9 @@ static int parse_stage(char *const s, struct sdp_stage_ *stage)
     }
 
     unsigned int vid, pid;
-    int conversions = sscanf(tok, "%04x:%04x", &vid, &pid);
-    if (conversions != 2)
+    int timeout = -1;
+    int conversions = sscanf(tok, "%04x:%04x:%d", &vid, &pid, &timeout);
+    if (conversions < 2)
     {
         fprintf(stderr, "ERROR: Stage didn't contain USB VID/PID");
         if (errno != 0)
@@ -43,24 +82,27 @@ static int parse_stage(char *const s, struct sdp_stage_ *stage)
         return 1;
     }
 
+    if (conversions == 3 && timeout < 0)
+    {
+        fprintf(stderr, "ERROR: Invalid stage timeout\n");
+        return 1;
+    }
+
     stage->usb_vid = vid;
     stage->usb_pid = pid;
+    stage->timeout = timeout;
+
+    stage->steps = sdp_new_steps();
+    if (!stage->steps)
+        return 1;
 
-    sdp_step *last_step;
     while ((tok = strtok_r(NULL, ",", &saveptr)))
     {
-        sdp_step *step = sdp_parse_step(tok);
-        if (!step)
+        if (sdp_parse_step(stage->steps, tok))
         {
             fprintf(stderr, "ERROR: Failed to parse step\n");
             return 1;
         }
-
-        if (!stage->steps)
-            stage->steps = step;
-        else
-            sdp_set_next_step(last_step, step);
-        last_step = step;
     }
 
     return 0;
@@ -69,34 +111,25 @@ static int parse_stage(char *const s, struct sdp_stage_ *stage)
 // Parse stages from command line arguments
 sdp_stages *sdp_parse_stages(int count, char *s[])
 {
-    sdp_stages *stages = NULL;
-    sdp_stages *last = NULL;
+    sdp_stages *stages = sdp_new_stages();
+    if (!stages)
+        return NULL;
 
     for (int i = 0; i < count; ++i)
     {
-        sdp_stages *stage = malloc(sizeof(struct sdp_stage_));
+        struct stage *stage = next_stage(stages);
         if (!stage)
-        {
-            fprintf(stderr, "ERROR: Failed to allocate stage %d\n", i + 1);
             goto free_stages;
-        }
-
-        stage->steps = NULL;
-        stage->next = NULL;
 
-        if (last)
-        {
-            last->next = stage;
-            last = stage;
-        }
-        else
-            stages = last = stage;
-
-        if (parse_stage(s[i], stage))
+        int res = parse_stage(s[i], stage);
+        if (res && stage->steps)
+            sdp_free_steps(stage->steps);
+        if (res)
         {
             fprintf(stderr, "ERROR: Failed to parse stage %d\n", i + 1);
             goto free_stages;
         }
+        stages->count++;
     }
 
     return stages;
@@ -116,208 +149,351 @@ static int parse_uint16(const char *s, uint16_t *value)
 	return 0;
 }
 
-// Upon success, takes ownership of steps
-sdp_stages *sdp_new_stage(const char *vid, const char *pid, sdp_step *steps)
+static int parse_timeout(const char *s, int *value)
 {
-	if (!vid || !pid)
-	{
-		fprintf(stderr, "ERROR: Stage VIP/PID unset\n");
-		return NULL;
-	}
-	if (!steps)
-	{
-		fprintf(stderr, "ERROR: Steps unset\n");
-		return NULL;
-	}
-
-    sdp_stages *stage = malloc(sizeof(struct sdp_stage_));
-    if (!stage)
+	char *end;
+	long l = strtol(s, &end, 10);
+	if (s == end || *end || l < 0 || l > INT_MAX)
+		return -1;
+	*value = (int)l;
+	return 0;
+}
+
+// Upon success, takes ownership of steps. The timeout is optional.
+int sdp_add_stage(sdp_stages *stages, const char *vid, const char *pid, const char *timeout,
+                  sdp_steps *steps)
+{
+    if (!vid || !pid)
     {
-        fprintf(stderr, "ERROR: Failed to allocate stage\n");
-        return NULL;
+        fprintf(stderr, "ERROR: Stage VIP/PID unset\n");
+        return -1;
     }
-    stage->steps = steps;
-    stage->next = NULL;
 
-    if (parse_uint16(vid, &stage->usb_vid))
+    struct sdp_stage_info info = {.timeout = -1};
+    if (parse_uint16(vid, &info.usb_vid))
     {
         fprintf(stderr, "ERROR: Invalid VID value\n");
-        goto free_stage;
+        return -1;
     }
-    if (parse_uint16(pid, &stage->usb_pid))
+    if (parse_uint16(pid, &info.usb_pid))
     {
         fprintf(stderr, "ERROR: Invalid PID value\n");
-        goto free_stage;
+        return -1;
+    }
+    if (timeout && parse_timeout(timeout, &info.timeout))
+    {
+        fprintf(stderr, "ERROR: Invalid timeout value\n");
+        return -1;
     }
 
-    return stage;
+    return sdp_add_stage_info(stages, &info, steps);
+}
 
-free_stage:
-    free(stage);
-    return NULL;
+// Add an already parsed stage; upon success, takes ownership of steps
+int sdp_add_stage_info(sdp_stages *stages, const struct sdp_stage_info *info, sdp_steps *steps)
+{
+    if (!steps || !sdp_step_count(steps))
+    {
+        fprintf(stderr, "ERROR: Steps unset\n");
+        return -1;
+    }
+
+    struct stage *stage = next_stage(stages);
+    if (!stage)
+        return -1;
+
+    stage->usb_vid = info->usb_vid;
+    stage->usb_pid = info->usb_pid;
+    stage->timeout = info->timeout;
+    stage->steps = steps;
+    stages->count++;
+    return 0;
 }
 
-sdp_stages *sdp_append_stage(sdp_stages *list, sdp_stages *stage)
+// Describe the stage at index and return its steps
+const sdp_steps *sdp_get_stage_info(const sdp_stages *stages, int index,
+                                    struct sdp_stage_info *info)
 {
-    if (!list)
-		return stage;
-
-	sdp_stages *it = list;
-	while (it->next)
-		it = it->next;
-	it->next = stage;
-	return list;
+    const struct stage *stage = &stages->stages[index];
+    info->usb_vid = stage->usb_vid;
+    info->usb_pid = stage->usb_pid;
+    info->timeout = stage->timeout;
+    return stage->steps;
 }
 
-#ifdef WITH_UDEV
-static hid_device *_open_device(sdp_udev *udev, uint16_t vid, uint16_t pid, const char *usb_path, bool quiet)
+int sdp_stage_count(const sdp_stages *stages)
 {
-    hid_device *result = NULL;
+    return stages->count;
+}
 
-    struct hid_device_info * const enumerator = hid_enumerate(vid, pid);
-    if (!enumerator)
+// Open and check every stage's images, before any device is touched
+int sdp_prepare_stages(sdp_stages *stages)
+{
+    for (int i = 0; i < stages->count; ++i)
     {
-        if (!quiet)
-            fprintf(stderr, "ERROR: Failed to enumerate HID devices: %ls\n", hid_error(NULL));
-        return NULL;
+        if (sdp_prepare_steps(stages->stages[i].steps))
+        {
+            fprintf(stderr, "ERROR: Failed to prepare stage %d\n", i + 1);
+            return -1;
+        }
     }
+    return 0;
+}
+
+#define DEFAULT_TIMEOUT 5000  // ms
+#define JUMP_POLL_INTERVAL 20 // ms
+#define JUMP_TIMEOUT 500      // ms
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
 
-    const char *device_path = NULL;
-    for (struct hid_device_info *i = enumerator; !device_path && i; i = i->next)
+// Time to wait for the stage's device in ms, 0 in the spec means forever
+static int stage_timeout(const struct stage *stage)
+{
+    if (stage->timeout < 0)
+        return DEFAULT_TIMEOUT;
+    return stage->timeout ? stage->timeout : -1;
+}
+
+// Open the stage's device, or devnode if it was already caught while confirming
+// the previous jump (takes ownership). Devices that are present already are only
+// considered if enumerate is set: after a jump, the monitor catches the device.
+// The time spent finding and opening the device is returned in wait_ns/open_ns.
+static sdp_device *open_device(sdp_hotplug *hotplug, const struct stage *stage, const char *usb_path,
+                               bool wait, bool enumerate, char *devnode, uint64_t *wait_ns,
+                               uint64_t *open_ns)
+{
+    uint64_t start = now_ns();
+    *wait_ns = *open_ns = 0;
+
+    const struct sdp_transport *transport = sdp_transport_get();
+    if (transport->find)
     {
-        if (!usb_path || sdp_udev_matching_usb_path(udev, i->path, usb_path))
-            device_path = i->path;
+        sdp_device *dev = sdp_device_open(NULL, stage->usb_vid, stage->usb_pid, usb_path);
+        *open_ns = now_ns() - start;
+        return dev;
     }
 
-    if (device_path)
+    if (!devnode && enumerate)
+        devnode = sdp_hotplug_find(hotplug, stage->usb_vid, stage->usb_pid);
+    if (!devnode && wait)
     {
-        result = hid_open_path(device_path);
-        if (!result && !quiet)
-            fprintf(stderr, "ERROR: Failed to open device: %ls\n", hid_error(result));
+        sdp_report_printf("Waiting for device...\n");
+        devnode = sdp_hotplug_wait(hotplug, stage->usb_vid, stage->usb_pid, stage_timeout(stage));
+        // In case the event was lost, e.g. the monitor's buffer overflowed
+        if (!devnode)
+            devnode = sdp_hotplug_find(hotplug, stage->usb_vid, stage->usb_pid);
+    }
+    *wait_ns = now_ns() - start;
+    if (!devnode)
+    {
+        fprintf(stderr, wait ? "ERROR: Timeout!\n" : "ERROR: No matching device found\n");
+        return NULL;
     }
-    else if (!quiet)
-        fprintf(stderr, "ERROR: No matching device found\n");
-
-    hid_free_enumeration(enumerator);
 
+    start = now_ns();
+    uint64_t span = sdp_trace_begin();
+    sdp_device *result = sdp_device_open(devnode, stage->usb_vid, stage->usb_pid, usb_path);
+    sdp_trace_end(span, "open device", NULL, 0);
+    *open_ns = now_ns() - start;
+    free(devnode);
     return result;
 }
-#else
-static hid_device *_open_device(sdp_udev *udev, uint16_t vid, uint16_t pid, const char *path, bool quiet)
-{
-    struct hid_device *result = hid_open(vid, pid, NULL);
-    if (!result && !quiet)
-        fprintf(stderr, "ERROR: Failed to open device: %ls\n", hid_error(result));
-    return result;
-}
-#endif
 
-static hid_device *open_device(uint16_t vid, uint16_t pid, const char *usb_path, bool wait)
+// The ROM only answers a failed jump (with report 4). Success is taken from the
+// device going away, or the next stage's device showing up, which is returned in
+// devnode. If neither happens, the new code may just not have touched USB yet,
+// which counts as success after JUMP_TIMEOUT as well.
+static int confirm_jump(sdp_device *dev, const struct stage *stage, const struct stage *next,
+                        sdp_hotplug *hotplug, char **devnode)
 {
-    hid_device *result = NULL;
+    // A device of the same VID/PID could be the current one
+    if (next && next->usb_vid == stage->usb_vid && next->usb_pid == stage->usb_pid)
+        next = NULL;
 
-#ifdef WITH_UDEV
-    sdp_udev *udev = sdp_udev_init();
-    if (!udev)
+    for (int waited = 0; waited < JUMP_TIMEOUT; waited += JUMP_POLL_INTERVAL)
     {
-        fprintf(stderr, "ERROR: Failed to initialize udev\n");
-        goto out;
+        int res = sdp_jump_wait(dev, JUMP_POLL_INTERVAL);
+        if (res)
+            return res < 0;
+        if (next && hotplug &&
+            (*devnode = sdp_hotplug_wait(hotplug, next->usb_vid, next->usb_pid, 0)))
+            return 0;
     }
+    return 0;
+}
 
-#else
-    if (usb_path)
+// Set the timeout of the stages that didn't get one from the spec
+void sdp_set_default_timeout(sdp_stages *stages, int timeout)
+{
+    for (int i = 0; i < stages->count; ++i)
     {
-        fprintf(stderr, "ERROR: Filtering by path is only supported with udev support\n");
-        goto out;
+        if (stages->stages[i].timeout < 0)
+            stages->stages[i].timeout = timeout;
     }
-#endif
+}
 
-    result = _open_device(udev, vid, pid, usb_path, wait);
-    if (!result)
-    {
-        if (!wait)
-            goto free_udev;
+// VID of the first stage
+uint16_t sdp_stage_vid(const sdp_stages *stages)
+{
+    return stages->stages[0].usb_vid;
+}
+
+// PID of the first stage
+uint16_t sdp_stage_pid(const sdp_stages *stages)
+{
+    return stages->stages[0].usb_pid;
+}
 
-        printf("Waiting for device...\n");
+// The next stage's images are prefetched on a thread of their own while the
+// board re-enumerates, see sdp_prefetch_steps()
+struct prefetch
+{
+    pthread_t thread;
+    const sdp_steps *steps;
+    char track[64];
+    int stage;
+    bool running;
+};
 
-#ifdef WITH_UDEV
-        const char *devpath = sdp_udev_wait(udev, vid, pid, usb_path, 5000);
-        if (!devpath)
-        {
-            fprintf(stderr, "ERROR: Timeout!\n");
-            goto free_udev;
-        }
-        result = hid_open_path(devpath);
-        free((void *)devpath);
-        if (!result)
-            fprintf(stderr, "ERROR: Failed to open device: %ls\n", hid_error(result));
-#else
-        do
-        {
-            usleep(500000ul); // 500ms
-            result = hid_open(vid, pid, NULL);
-        } while (!result);
-#endif
-    }
+static void *prefetch_worker(void *arg)
+{
+    struct prefetch *prefetch = arg;
+    sdp_trace_track(prefetch->track);
+    uint64_t span = sdp_trace_begin();
+    sdp_prefetch_steps(prefetch->steps);
+    sdp_trace_end(span, "prefetch", "stage", prefetch->stage);
+    return NULL;
+}
 
-free_udev:
-#ifdef WITH_UDEV
-    sdp_udev_free(udev);
-out:
-#endif
+static void start_prefetch(struct prefetch *prefetch, const sdp_steps *steps, int stage)
+{
+    // Uncached images were all loaded when the steps were prepared
+    if (!sdp_image_cache_enabled())
+        return;
+    prefetch->steps = steps;
+    prefetch->stage = stage;
+    // Without the thread, the images are still loaded when the steps run
+    int err = pthread_create(&prefetch->thread, NULL, prefetch_worker, prefetch);
+    if (err)
+        fprintf(stderr, "WARN: Failed to start prefetch: %s\n", strerror(err));
+    prefetch->running = !err;
+}
 
-    return result;
+static void finish_prefetch(struct prefetch *prefetch)
+{
+    if (prefetch->running)
+        pthread_join(prefetch->thread, NULL);
+    prefetch->running = false;
 }
 
-int sdp_execute_stages(sdp_stages *stages, bool initial_wait, const char *usb_path)
+// Expects the transport to be initialized already, so it can be called concurrently
+// for different USB paths
+int sdp_run_stages(const sdp_stages *stages, bool initial_wait, const char *usb_path)
 {
-    int res = hid_init();
-    if (res)
-        fprintf(stderr, "ERROR: hidapi init failed\n");
+    // Armed before the first jump and kept across stages, so no re-enumeration
+    // is missed. The mock transport has no devices to watch.
+    sdp_hotplug *hotplug = NULL;
+    if (!sdp_transport_get()->find)
+    {
+        hotplug = sdp_hotplug_new(usb_path);
+        if (!hotplug)
+            return 1;
+    }
+
+    sdp_trace_track(usb_path ? usb_path : "board");
+    struct prefetch prefetch = {.running = false};
+    snprintf(prefetch.track, sizeof(prefetch.track), "%s prefetch", usb_path ? usb_path : "board");
+    sdp_run_report *report = sdp_report_run_begin(usb_path);
+    uint64_t run_start = now_ns();
 
-    int i = 0;
-    for (struct sdp_stage_ *stage = stages; !res && stage; stage = stage->next, i++)
+    int res = 0;
+    bool jumped = false;
+    char *devnode = NULL;
+    for (int i = 0; !res && i < stages->count; ++i)
     {
-        printf("[Stage %d] VID=0x%04x PID=0x%04x\n", i + 1, stage->usb_vid, stage->usb_pid);
+        const struct stage *stage = &stages->stages[i];
+        const struct stage *next = i + 1 < stages->count ? &stages->stages[i + 1] : NULL;
+        sdp_report_printf("[Stage %d] VID=0x%04x PID=0x%04x\n", i + 1, stage->usb_vid, stage->usb_pid);
+        uint64_t stage_start = now_ns();
+        uint64_t span = sdp_trace_begin();
+        sdp_report_stage_begin(report, i + 1, stage->usb_vid, stage->usb_pid);
 
         bool wait = initial_wait || (i > 0);
-        hid_device *handle = open_device(stage->usb_vid, stage->usb_pid, usb_path, wait);
-        if (!handle)
+        uint64_t wait_ns, open_ns;
+        sdp_device *dev = open_device(hotplug, stage, usb_path, wait, !jumped, devnode, &wait_ns,
+                                      &open_ns);
+        devnode = NULL;
+        finish_prefetch(&prefetch);
+        sdp_report_stage_device(report, wait_ns, open_ns);
+        if (!dev)
         {
             res = 1;
+            sdp_report_stage_end(report, res, now_ns() - stage_start);
+            sdp_trace_end(span, "stage", "stage", i + 1);
             break;
         }
 
         uint32_t hab_status, status;
-        res = sdp_error_status(handle, &hab_status, &status);
+        uint64_t status_start = now_ns();
+        res = sdp_error_status(dev, &hab_status, &status);
         if (res)
+        {
+            sdp_device_close(dev);
+            sdp_report_stage_end(report, res, now_ns() - stage_start);
+            sdp_trace_end(span, "stage", "stage", i + 1);
             break;
+        }
+        sdp_report_stage_status(report, now_ns() - status_start, hab_status);
 
-        if (sdp_execute_steps(handle, stage->steps))
+        jumped = sdp_steps_end_with_jump(stage->steps);
+        if (sdp_execute_steps(dev, stage->steps, report) ||
+            (jumped && confirm_jump(dev, stage, next, hotplug, &devnode)))
         {
             fprintf(stderr, "ERROR: Failed to execute stage %d\n", i + 1);
             res = 1;
         }
 
-        hid_close(handle);
+        sdp_device_close(dev);
+        sdp_report_stage_end(report, res, now_ns() - stage_start);
+        sdp_trace_end(span, "stage", "stage", i + 1);
+
+        // While the board runs the new code and re-enumerates
+        if (!res && jumped && next)
+            start_prefetch(&prefetch, next->steps, i + 2);
     }
 
-    if (hid_exit())
-        fprintf(stderr, "ERROR: hidapi exit failed\n");
+    finish_prefetch(&prefetch);
+    sdp_report_run_end(report, res, now_ns() - run_start);
+    free(devnode);
+    if (hotplug)
+        sdp_hotplug_free(hotplug);
+    return res;
+}
+
+int sdp_execute_stages(const sdp_stages *stages, bool initial_wait, const char *usb_path)
+{
+    int res = sdp_transport_init();
+    if (!res)
+    {
+        res = sdp_run_stages(stages, initial_wait, usb_path);
+        sdp_transport_exit();
+    }
 
     if (!res)
-        printf("All stages done\n");
+        sdp_report_printf("All stages done\n");
 
     return res;
 }
 
 void sdp_free_stages(sdp_stages *stages)
 {
-    while (stages)
-	{
-        sdp_free_steps(stages->steps);		
-        void *const to_be_freed = stages;
-		stages = stages->next;
-		free(to_be_freed);
-	}
+    for (int i = 0; i < stages->count; ++i)
+        sdp_free_steps(stages->stages[i].steps);
+    free(stages->stages);
+    free(stages);
 }
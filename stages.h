@@ -3,14 +3,32 @@
 
 #include "steps.h"
 #include <stdbool.h>
+#include <stdint.h>
 
-struct sdp_stage_;
-typedef struct sdp_stage_ sdp_stages;
+struct sdp_stages_;
+typedef struct sdp_stages_ sdp_stages;
 
+struct sdp_stage_info
+{
+    uint16_t usb_vid;
+    uint16_t usb_pid;
+    int timeout; // ms to wait for the device, -1 if unset
+};
+
+sdp_stages *sdp_new_stages(void);
 sdp_stages *sdp_parse_stages(int count, char *s[]);
-sdp_stages *sdp_new_stage(const char *vid, const char *pid, sdp_step *steps);
-sdp_stages *sdp_append_stage(sdp_stages *list, sdp_stages *stage);
-int sdp_execute_stages(sdp_stages *stages, bool initial_wait, const char *usb_path);
+int sdp_add_stage(sdp_stages *stages, const char *vid, const char *pid, const char *timeout,
+                  sdp_steps *steps);
+int sdp_add_stage_info(sdp_stages *stages, const struct sdp_stage_info *info, sdp_steps *steps);
+const sdp_steps *sdp_get_stage_info(const sdp_stages *stages, int index,
+                                    struct sdp_stage_info *info);
+int sdp_stage_count(const sdp_stages *stages);
+int sdp_prepare_stages(sdp_stages *stages);
+void sdp_set_default_timeout(sdp_stages *stages, int timeout);
+uint16_t sdp_stage_vid(const sdp_stages *stages);
+uint16_t sdp_stage_pid(const sdp_stages *stages);
+int sdp_run_stages(const sdp_stages *stages, bool initial_wait, const char *usb_path);
+int sdp_execute_stages(const sdp_stages *stages, bool initial_wait, const char *usb_path);
 void sdp_free_stages(sdp_stages *stages);
 
 #endif
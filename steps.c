@@ -1,39 +1,265 @@
 #include "steps.h"
+#include "imx.h"
+#include "report.h"
 #include "sdp.h"
+#include "trace.h"
+#include <inttypes.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-union step_run_data
+// Where the parts of an image are, as far as the step's options need them
+struct image_layout
 {
-	struct
-	{
-		const char *file_path;
-		uint32_t address;
-	} write_file;
-	struct
-	{
-		uint32_t address;
-	} jump_address;
+	uint64_t range_length; // of the step's range of the image
+	uint64_t length;       // bytes to be written
+	size_t ivt_offset;
+	size_t dcd_offset;
+	size_t dcd_length;
 };
 
 struct sdp_step_
 {
-	int (*exec)(hid_device *, const union step_run_data *);
-	union step_run_data data;
-	struct sdp_step_ *next;
+	int (*exec)(sdp_device *, const struct sdp_step_ *);
+	struct sdp_step_info info; // owns file_path
+	// Set by sdp_prepare_steps(), unless the step was added with its image
+	sdp_image *image;
+	bool own_image; // image isn't backed by file_path, e.g. it comes from a bundle
+	struct image_layout layout;
+	// Set by sdp_prepare_steps(), see coalesce_steps()
+	int coalesced;  // following steps written along with this one
+	int written_by; // number of the step writing this one along with its own, 0 if none
+};
+
+struct sdp_steps_
+{
+	struct sdp_step_ *steps;
+	int count;
+	int capacity;
 };
 
-static int exec_write_file(hid_device *handle, const union step_run_data *data)
+// The headers (IVT, DCD, containers) are expected within this many bytes from
+// the start of the image
+#define HEADER_SEARCH_LENGTH (64 * 1024)
+
+#define MAX_COALESCED_STEPS 16
+// A DCD holds at least this many register writes
+#define MAX_DCD_WRITES ((IMX_DCD_MAX_LENGTH - 8) / 8)
+
+// Locate the parts of the image the step's options refer to, and check that the
+// image can be written with a single WRITE_FILE command. With a range, the image
+// is the range, offsets are relative to its start.
+static int analyze_image(const struct sdp_step_info *info, const sdp_image *image,
+						 struct image_layout *layout)
 {
-	return sdp_write_file(handle, data->write_file.file_path,
-						  data->write_file.address);
+	const char *path = sdp_image_path(image);
+	size_t size = sdp_image_size(image);
+	if (info->offset > size || info->length > size - info->offset ||
+		(info->offset && info->offset == size))
+	{
+		fprintf(stderr, "ERROR: Range 0x%" PRIx32 "+0x%" PRIx32 " beyond the end of \"%s\" (%zu bytes)\n",
+				info->offset, info->length, path, size);
+		return -1;
+	}
+
+	memset(layout, 0, sizeof(*layout));
+	layout->range_length = info->length ? info->length : size - info->offset;
+	layout->length = layout->range_length;
+
+	const unsigned char *head = sdp_image_data(image) + info->offset;
+	size_t length = layout->range_length;
+	if (length > HEADER_SEARCH_LENGTH)
+		length = HEADER_SEARCH_LENGTH;
+
+	if (info->trim)
+	{
+		uint64_t image_length;
+		if (imx_image_length(head, length, &image_length))
+		{
+			fprintf(stderr, "ERROR: Cannot determine the length of \"%s\"\n", path);
+			return -1;
+		}
+		if (image_length < layout->length)
+			layout->length = image_length;
+	}
+
+	if (info->dcd)
+	{
+		struct imx_ivt ivt;
+		if (imx_find_ivt(head, length, &layout->ivt_offset, &ivt))
+		{
+			fprintf(stderr, "ERROR: No IVT found in \"%s\"\n", path);
+			return -1;
+		}
+		if (imx_find_dcd(head, length, layout->ivt_offset, &ivt, &layout->dcd_offset,
+						 &layout->dcd_length))
+			return -1;
+	}
+
+	if (layout->length > UINT32_MAX)
+	{
+		fprintf(stderr, "ERROR: \"%s\" is too large (%" PRIu64 " bytes, 32-bit data count)\n",
+				path, layout->length);
+		return -1;
+	}
+	return 0;
 }
 
-static int exec_jump_address(hid_device *handle, const union step_run_data *data)
+// Open the source of a write_file step with its options applied, executing the
+// image's DCD first if asked to. The image is returned along with it.
+static sdp_source *open_step_source(sdp_device *dev, const struct sdp_step_ *step, sdp_image **image_out)
 {
-	return sdp_jump_address(handle, data->jump_address.address);
+	// With the cache, changes made to the file since the plan was prepared are
+	// picked up (without touching the file system unless it did change)
+	sdp_image *image = (sdp_image_cache_enabled() && !step->own_image) || !step->image
+						   ? sdp_image_get(step->info.file_path)
+						   : sdp_image_ref(step->image);
+	if (!image)
+		return NULL;
+
+	struct image_layout changed_layout;
+	const struct image_layout *layout = &step->layout;
+	if (image != step->image)
+	{
+		if (analyze_image(&step->info, image, &changed_layout))
+			goto put_image;
+		layout = &changed_layout;
+	}
+
+	sdp_source *src = sdp_source_open_image(image);
+	if (!src)
+		goto put_image;
+
+	if (step->info.offset || layout->range_length < sdp_source_size(src))
+	{
+		sdp_report_printf("Taking %" PRIu64 " bytes at offset 0x%08" PRIx32 " of \"%s\"\n",
+						  layout->range_length, step->info.offset, sdp_source_name(src));
+		if (sdp_source_range(src, step->info.offset, layout->range_length))
+			goto close_source;
+	}
+
+	if (layout->length < sdp_source_size(src))
+	{
+		sdp_report_printf("Trimming \"%s\" to %" PRIu64 " of %" PRIu64 " bytes\n",
+						  sdp_source_name(src), layout->length, sdp_source_size(src));
+		if (sdp_source_truncate(src, layout->length))
+			goto close_source;
+	}
+
+	if (step->info.dcd)
+	{
+		// Execute the image's DCD through the ROM, and clear the IVT's DCD pointer
+		// in the data that is sent afterwards, so the ROM doesn't run it again
+		if (sdp_dcd_write(dev, sdp_image_data(image) + step->info.offset + layout->dcd_offset,
+						  layout->dcd_length, step->info.dcd_address))
+			goto close_source;
+		const uint32_t no_dcd = 0;
+		if (sdp_source_patch(src, layout->ivt_offset + IMX_IVT_DCD_OFFSET, &no_dcd, sizeof(no_dcd)))
+			goto close_source;
+	}
+
+	*image_out = image;
+	return src;
+
+close_source:
+	sdp_source_close(src);
+put_image:
+	sdp_image_put(image);
+	return NULL;
+}
+
+// Writes the steps coalesced with this one as well
+static int exec_write_file(sdp_device *dev, const struct sdp_step_ *step)
+{
+	int res = -1;
+	int count = 1 + step->coalesced;
+	sdp_source *srcs[MAX_COALESCED_STEPS];
+	sdp_image *images[MAX_COALESCED_STEPS];
+	int opened;
+
+	// Images that changed in the cache may not line up anymore
+	bool contiguous = true;
+	uint64_t offset = 0;
+	for (opened = 0; opened < count; ++opened)
+	{
+		srcs[opened] = open_step_source(dev, &step[opened], &images[opened]);
+		if (!srcs[opened])
+			goto close_sources;
+		if (step[opened].info.address != step->info.address + offset)
+			contiguous = false;
+		offset += sdp_source_size(srcs[opened]);
+	}
+
+	if (step->info.segment_size)
+		res = sdp_write_segments(dev, srcs[0], step->info.address, step->info.segment_size);
+	else if (contiguous)
+	{
+		res = sdp_write_sources(dev, srcs, count, step->info.address);
+		dev->stats.round_trips_saved = count - 1;
+	}
+	else
+	{
+		res = 0;
+		for (int i = 0; !res && i < count; ++i)
+			res = sdp_write_source(dev, srcs[i], step[i].info.address);
+	}
+
+close_sources:
+	while (opened--)
+	{
+		sdp_source_close(srcs[opened]);
+		sdp_image_put(images[opened]);
+	}
+	return res;
+}
+
+static int exec_jump_address(sdp_device *dev, const struct sdp_step_ *step)
+{
+	return sdp_jump_address(dev, step->info.address);
+}
+
+// Writes the steps batched with this one as well, all in one DCD
+static int exec_write_register(sdp_device *dev, const struct sdp_step_ *step)
+{
+	if (!step->info.dcd)
+		return sdp_write_register(dev, step->info.address, step->info.value, step->info.width);
+
+	int count = 1 + step->coalesced;
+	struct imx_register_write writes[MAX_DCD_WRITES];
+	for (int i = 0; i < count; ++i)
+	{
+		writes[i].address = step[i].info.address;
+		writes[i].value = step[i].info.value;
+		writes[i].width = step[i].info.width;
+	}
+
+	unsigned char dcd[IMX_DCD_MAX_LENGTH];
+	size_t length = imx_build_dcd(dcd, sizeof(dcd), writes, count);
+	if (!length)
+	{
+		fprintf(stderr, "ERROR: Register writes don't fit into a DCD\n");
+		return -1;
+	}
+	sdp_report_printf("Writing %d register(s) with a DCD\n", count);
+	int res = sdp_dcd_write(dev, dcd, length, step->info.dcd_address);
+	dev->stats.round_trips_saved = count - 1;
+	return res;
+}
+
+static int exec_read_register(sdp_device *dev, const struct sdp_step_ *step)
+{
+	uint32_t *values = calloc(step->info.count, sizeof(*values));
+	if (!values)
+	{
+		fprintf(stderr, "ERROR: Allocation failed\n");
+		return -1;
+	}
+	int res = sdp_read_registers(dev, step->info.address, step->info.width, values, step->info.count);
+	free(values);
+	return res;
 }
 
 static int parse_uint32(const char *s, uint32_t *value)
@@ -46,182 +272,549 @@ static int parse_uint32(const char *s, uint32_t *value)
 	return 0;
 }
 
-sdp_step *sdp_parse_step(char *s)
+// Decimal or hex (0x), with an optional K or M suffix
+static int parse_size(const char *s, uint32_t *value)
 {
-	char *saveptr = NULL;
-	const char *tok = strtok_r(s, ":", &saveptr);
-	if (!tok)
+	char *end;
+	unsigned long long ull = strtoull(s, &end, 0);
+	if (s == end)
+		return -1;
+	uint32_t unit = 1;
+	if (*end == 'K')
+		unit = 1024, end++;
+	else if (*end == 'M')
+		unit = 1024 * 1024, end++;
+	// Checked before scaling, so a huge count can't wrap around to a small size
+	if (*end || ull > UINT32_MAX / unit)
+		return -1;
+	*value = (uint32_t)ull * unit;
+	return 0;
+}
+
+static int parse_register_option(struct sdp_step_info *info, const char *op,
+								 const struct sdp_step_option *option)
+{
+	bool write = info->op == SDP_WRITE_REGISTER;
+	if (write && !strcmp(option->key, "value"))
 	{
-		fprintf(stderr, "ERROR: Missing step command\n");
-		return NULL;
+		if (!option->value || parse_uint32(option->value, &info->value))
+		{
+			fprintf(stderr, "ERROR: Invalid write_register value\n");
+			return -1;
+		}
 	}
-
-	sdp_step *result = malloc(sizeof(sdp_step));
-	if (!result)
+	else if (write && !strcmp(option->key, "dcd"))
 	{
-		fprintf(stderr, "ERROR: Allocation failed\n");
-		return NULL;
+		if (!option->value || parse_uint32(option->value, &info->dcd_address))
+		{
+			fprintf(stderr, "ERROR: Invalid write_register DCD address\n");
+			return -1;
+		}
+		info->dcd = true;
+	}
+	else if (!strcmp(option->key, "width"))
+	{
+		// In bits, as in the SDP command's format field
+		char *end;
+		unsigned long bits = option->value ? strtoul(option->value, &end, 10) : 0;
+		if (!bits || *end || (bits != 8 && bits != 16 && bits != 32))
+		{
+			fprintf(stderr, "ERROR: Invalid %s width (8, 16 or 32)\n", op);
+			return -1;
+		}
+		info->width = bits / 8;
+	}
+	else if (!write && !strcmp(option->key, "count"))
+	{
+		if (!option->value || parse_size(option->value, &info->count) || !info->count)
+		{
+			fprintf(stderr, "ERROR: Invalid read_register count\n");
+			return -1;
+		}
+	}
+	else
+	{
+		fprintf(stderr, "ERROR: Unknown %s option \"%s\"\n", op, option->key);
+		return -1;
 	}
-	result->next = NULL;
+	return 0;
+}
 
-	if (!strcmp(tok, "write_file"))
+static int parse_write_file_option(struct sdp_step_info *info, const struct sdp_step_option *option)
+{
+	if (!strcmp(option->key, "dcd"))
 	{
-		const char *file_path = strtok_r(NULL, ":", &saveptr);
-		const char *address = strtok_r(NULL, ":", &saveptr);
-		if (!file_path || !address)
+		if (!option->value || parse_uint32(option->value, &info->dcd_address))
 		{
-			fprintf(stderr, "ERROR: Invalid write_file step\n");
-			goto free_result;
+			fprintf(stderr, "ERROR: Invalid write_file DCD address\n");
+			return -1;
 		}
-		result->exec = exec_write_file;
-		if (parse_uint32(address, &result->data.write_file.address))
+		info->dcd = true;
+	}
+	else if (!strcmp(option->key, "trim"))
+	{
+		// A bare flag on the command line, a boolean in the spec file
+		if (!option->value || !strcmp(option->value, "true"))
+			info->trim = true;
+		else if (strcmp(option->value, "false"))
 		{
-			fprintf(stderr, "ERROR: Invalid write_file address\n");
-			goto free_result;
+			fprintf(stderr, "ERROR: Invalid write_file trim option\n");
+			return -1;
 		}
-		result->data.write_file.file_path = strdup(file_path);
-		if (!result->data.write_file.file_path)
+	}
+	else if (!strcmp(option->key, "segment"))
+	{
+		if (!option->value || parse_size(option->value, &info->segment_size) || !info->segment_size)
 		{
-			fprintf(stderr, "ERROR: Failed to allocate file path\n");
-			goto free_result;
+			fprintf(stderr, "ERROR: Invalid write_file segment size\n");
+			return -1;
 		}
 	}
-	else if (!strcmp(tok, "jump_address"))
+	else if (!strcmp(option->key, "offset"))
 	{
-		const char *address = strtok_r(NULL, ":", &saveptr);
-		if (!address)
+		if (!option->value || parse_size(option->value, &info->offset))
 		{
-			fprintf(stderr, "ERROR: Invalid jump_address step\n");
-			goto free_result;
+			fprintf(stderr, "ERROR: Invalid write_file offset\n");
+			return -1;
 		}
-		result->exec = exec_jump_address;
-		if (parse_uint32(address, &result->data.jump_address.address))
+	}
+	else if (!strcmp(option->key, "length"))
+	{
+		if (!option->value || parse_size(option->value, &info->length) || !info->length)
 		{
-			fprintf(stderr, "ERROR: Invalid jump_address address\n");
-			goto free_result;
+			fprintf(stderr, "ERROR: Invalid write_file length\n");
+			return -1;
 		}
 	}
 	else
 	{
-		fprintf(stderr, "ERROR: Unknown step command \"%s\"\n", tok);
-		goto free_result;
+		fprintf(stderr, "ERROR: Unknown write_file option \"%s\"\n", option->key);
+		return -1;
 	}
+	return 0;
+}
 
-	return result;
-
-free_result:
-	free(result);
-	return NULL;
+sdp_steps *sdp_new_steps(void)
+{
+	sdp_steps *steps = calloc(1, sizeof(sdp_steps));
+	if (!steps)
+		fprintf(stderr, "ERROR: Allocation failed\n");
+	return steps;
 }
 
-sdp_step *sdp_new_step(const char *op, const char *file_path, const char *address)
+// Parse a step from the command line: <OP>:<ARG>...[:<KEY>[=<VALUE>]...]
+int sdp_parse_step(sdp_steps *steps, char *s)
 {
+	char *saveptr = NULL;
+	const char *op = strtok_r(s, ":", &saveptr);
 	if (!op)
 	{
-		fprintf(stderr, "ERROR: Step operation unset\n");
-		return NULL;
+		fprintf(stderr, "ERROR: Missing step command\n");
+		return -1;
 	}
 
-	sdp_step *result = malloc(sizeof(sdp_step));
-	if (!result)
+	const char *file_path = NULL;
+	if (!strcmp(op, "write_file"))
+		file_path = strtok_r(NULL, ":", &saveptr);
+	const char *address = strtok_r(NULL, ":", &saveptr);
+
+	struct sdp_step_option options[MAX_STEP_OPTIONS];
+	int option_count = 0;
+	// The value is an argument on the command line, but an option in the spec file
+	if (!strcmp(op, "write_register"))
 	{
-		fprintf(stderr, "ERROR: Allocation failed\n");
-		return NULL;
+		options[0].key = "value";
+		options[0].value = strtok_r(NULL, ":", &saveptr);
+		option_count++;
+	}
+	char *tok;
+	while ((tok = strtok_r(NULL, ":", &saveptr)))
+	{
+		if (option_count == MAX_STEP_OPTIONS)
+		{
+			fprintf(stderr, "ERROR: Too many step options\n");
+			return -1;
+		}
+		char *eq = strchr(tok, '=');
+		if (eq)
+			*eq = '\0';
+		options[option_count].key = tok;
+		options[option_count].value = eq ? eq + 1 : NULL;
+		option_count++;
+	}
+
+	return sdp_add_step(steps, op, file_path, address, options, option_count);
+}
+
+int sdp_add_step(sdp_steps *steps, const char *op, const char *file_path, const char *address,
+				 const struct sdp_step_option *options, int option_count)
+{
+	if (!op)
+	{
+		fprintf(stderr, "ERROR: Step operation unset\n");
+		return -1;
 	}
-	result->next = NULL;
 
+	struct sdp_step_info info = {0};
 	if (!strcmp(op, "write_file"))
 	{
 		if (!file_path || !address)
 		{
 			fprintf(stderr, "ERROR: Invalid write_file step\n");
-			goto free_result;
+			return -1;
 		}
-		result->exec = exec_write_file;
-		if (parse_uint32(address, &result->data.write_file.address))
+		info.op = SDP_WRITE_FILE;
+		info.file_path = file_path;
+		if (parse_uint32(address, &info.address))
 		{
 			fprintf(stderr, "ERROR: Invalid write_file address\n");
-			goto free_result;
+			return -1;
 		}
-		result->data.write_file.file_path = strdup(file_path);
-		if (!result->data.write_file.file_path)
+		for (int i = 0; i < option_count; ++i)
 		{
-			fprintf(stderr, "ERROR: Failed to allocate file path\n");
-			goto free_result;
+			if (parse_write_file_option(&info, &options[i]))
+				return -1;
 		}
 	}
 	else if (!strcmp(op, "jump_address"))
 	{
-		if (!address)
+		if (!address || option_count)
 		{
 			fprintf(stderr, "ERROR: Invalid jump_address step\n");
-			goto free_result;
+			return -1;
 		}
-		result->exec = exec_jump_address;
-		if (parse_uint32(address, &result->data.jump_address.address))
+		info.op = SDP_JUMP_ADDRESS;
+		if (parse_uint32(address, &info.address))
 		{
 			fprintf(stderr, "ERROR: Invalid jump_address address\n");
-			goto free_result;
+			return -1;
+		}
+	}
+	else if (!strcmp(op, "write_register") || !strcmp(op, "read_register"))
+	{
+		info.op = !strcmp(op, "write_register") ? SDP_WRITE_REGISTER : SDP_READ_REGISTER;
+		if (!address || parse_uint32(address, &info.address))
+		{
+			fprintf(stderr, "ERROR: Invalid %s address\n", op);
+			return -1;
+		}
+		bool has_value = false;
+		for (int i = 0; i < option_count; ++i)
+		{
+			if (parse_register_option(&info, op, &options[i]))
+				return -1;
+			has_value = has_value || !strcmp(options[i].key, "value");
+		}
+		if (info.op == SDP_WRITE_REGISTER && !has_value)
+		{
+			fprintf(stderr, "ERROR: Missing write_register value\n");
+			return -1;
 		}
 	}
 	else
 	{
 		fprintf(stderr, "ERROR: Unknown step command \"%s\"\n", op);
-		goto free_result;
+		return -1;
 	}
 
-	return result;
+	return sdp_add_step_info(steps, &info, NULL);
+}
 
-free_result:
-	free(result);
-	return NULL;
+static int check_register_step(const struct sdp_step_info *info)
+{
+	const char *op = sdp_step_op_name(info->op);
+	uint32_t width = info->width;
+	if (width != 1 && width != 2 && width != 4)
+	{
+		fprintf(stderr, "ERROR: Invalid %s width %" PRIu32 "\n", op, width * 8);
+		return -1;
+	}
+	if (info->address % width)
+	{
+		fprintf(stderr, "ERROR: Unaligned %s address 0x%08" PRIx32 "\n", op, info->address);
+		return -1;
+	}
+	if (width < 4 && info->value >> (width * 8))
+	{
+		fprintf(stderr, "ERROR: write_register value 0x%" PRIx32 " wider than %" PRIu32 " bits\n",
+				info->value, width * 8);
+		return -1;
+	}
+	if ((uint64_t)info->count * width > UINT32_MAX)
+	{
+		fprintf(stderr, "ERROR: Too many registers to read (%" PRIu32 ")\n", info->count);
+		return -1;
+	}
+	return 0;
 }
 
-sdp_step *sdp_append_step(sdp_step *list, sdp_step *step)
+// Add an already parsed step. A write_file step given an image takes a reference
+// to it and uses it instead of loading file_path, which is only used for messages.
+int sdp_add_step_info(sdp_steps *steps, const struct sdp_step_info *info, sdp_image *image)
 {
-	if (!list)
-		return step;
+	if (steps->count == steps->capacity)
+	{
+		int capacity = steps->capacity ? 2 * steps->capacity : 4;
+		struct sdp_step_ *tmp = realloc(steps->steps, capacity * sizeof(struct sdp_step_));
+		if (!tmp)
+		{
+			fprintf(stderr, "ERROR: Allocation failed\n");
+			return -1;
+		}
+		steps->steps = tmp;
+		steps->capacity = capacity;
+	}
+
+	// Only counted once it is complete
+	struct sdp_step_ *result = &steps->steps[steps->count];
+	memset(result, 0, sizeof(*result));
+	result->info = *info;
 
-	sdp_step *it = list;
-	while (it->next)
-		it = it->next;
-	it->next = step;
-	return list;
+	switch (info->op)
+	{
+	case SDP_WRITE_FILE:
+		result->exec = exec_write_file;
+		if (!info->file_path)
+		{
+			fprintf(stderr, "ERROR: Invalid write_file step\n");
+			return -1;
+		}
+		result->info.file_path = strdup(info->file_path);
+		if (!result->info.file_path)
+		{
+			fprintf(stderr, "ERROR: Failed to allocate file path\n");
+			return -1;
+		}
+		if (image)
+		{
+			result->image = sdp_image_ref(image);
+			result->own_image = true;
+		}
+		break;
+	case SDP_JUMP_ADDRESS:
+		result->exec = exec_jump_address;
+		result->info.file_path = NULL;
+		break;
+	case SDP_WRITE_REGISTER:
+	case SDP_READ_REGISTER:
+		result->exec = info->op == SDP_WRITE_REGISTER ? exec_write_register : exec_read_register;
+		result->info.file_path = NULL;
+		if (!result->info.width)
+			result->info.width = 4;
+		if (!result->info.count)
+			result->info.count = 1;
+		if (check_register_step(&result->info))
+			return -1;
+		break;
+	default:
+		fprintf(stderr, "ERROR: Unknown step command %d\n", info->op);
+		return -1;
+	}
+
+	steps->count++;
+	return 0;
+}
+
+// Describe the step at index, along with its image once the steps are prepared
+void sdp_get_step_info(const sdp_steps *steps, int index, struct sdp_step_info *info,
+					   const sdp_image **image)
+{
+	*info = steps->steps[index].info;
+	if (image)
+		*image = steps->steps[index].image;
+}
+
+// Length of the run of write_file steps starting at first whose data is
+// contiguous in memory. Steps with a DCD (executed before the write) or segments
+// only start a run.
+static int contiguous_writes(const struct sdp_step_ *first, int remaining)
+{
+	if (first->info.op != SDP_WRITE_FILE || first->info.segment_size)
+		return 1;
+
+	uint64_t end = first->info.address + first->layout.length;
+	int n = 1;
+	for (; n < MAX_COALESCED_STEPS && n < remaining; ++n)
+	{
+		const struct sdp_step_ *next = &first[n];
+		if (next->info.op != SDP_WRITE_FILE || next->info.dcd || next->info.segment_size ||
+			next->info.address != end || end - first->info.address + next->layout.length > UINT32_MAX)
+			break;
+		end += next->layout.length;
+	}
+	return n;
+}
+
+// Length of the run of write_register steps starting at first that are batched
+// into the same DCD, as long as it fits into the ROM's DCD buffer
+static int batched_register_writes(const struct sdp_step_ *first, int remaining)
+{
+	if (first->info.op != SDP_WRITE_REGISTER || !first->info.dcd)
+		return 1;
+
+	struct imx_register_write writes[MAX_DCD_WRITES];
+	int n = 0;
+	for (; n < MAX_DCD_WRITES && n < remaining; ++n)
+	{
+		const struct sdp_step_ *next = &first[n];
+		if (next->info.op != SDP_WRITE_REGISTER || !next->info.dcd ||
+			next->info.dcd_address != first->info.dcd_address)
+			break;
+		writes[n].address = next->info.address;
+		writes[n].value = next->info.value;
+		writes[n].width = next->info.width;
+		if (imx_dcd_length(writes, n + 1) > IMX_DCD_MAX_LENGTH)
+			break;
+	}
+	return n;
+}
+
+// Runs of write_file steps whose data is contiguous in memory are written with a
+// single WRITE_FILE command, and runs of write_register steps with a DCD address
+// with a single DCD_WRITE command. Either saves the command, HAB status and
+// response round trip of all but the first step.
+static void coalesce_steps(sdp_steps *steps)
+{
+	for (int i = 0; i < steps->count; ++i)
+	{
+		steps->steps[i].coalesced = 0;
+		steps->steps[i].written_by = 0;
+	}
+
+	for (int i = 0; i < steps->count; ++i)
+	{
+		struct sdp_step_ *first = &steps->steps[i];
+		bool registers = first->info.op == SDP_WRITE_REGISTER;
+		int n = registers ? batched_register_writes(first, steps->count - i)
+						  : contiguous_writes(first, steps->count - i);
+		if (n == 1)
+			continue;
+
+		first->coalesced = n - 1;
+		for (int j = 1; j < n; ++j)
+			steps->steps[i + j].written_by = i + 1;
+		i += n - 1;
+	}
+}
+
+// Load and check every image before any device is touched; afterwards the
+// steps aren't modified anymore and can be executed concurrently
+int sdp_prepare_steps(sdp_steps *steps)
+{
+	for (int i = 0; i < steps->count; ++i)
+	{
+		struct sdp_step_ *step = &steps->steps[i];
+		if (step->info.op != SDP_WRITE_FILE)
+			continue;
+
+		if (!step->image)
+			step->image = sdp_image_get(step->info.file_path);
+		if (!step->image)
+			return -1;
+		if (analyze_image(&step->info, step->image, &step->layout))
+			return -1;
+	}
+	coalesce_steps(steps);
+	return 0;
 }
 
-void sdp_free_steps(sdp_step *steps)
+// Check the cached images of the prepared steps for changes while the device of
+// their stage is enumerating, so that a rebuilt image is loaded before the
+// device is open. Only useful with the image cache: without it, every image was
+// loaded when the steps were prepared.
+void sdp_prefetch_steps(const sdp_steps *steps)
 {
-	while (steps)
+	for (int i = 0; i < steps->count; ++i)
 	{
-		if (steps->exec == exec_write_file)
-			free((void *)steps->data.write_file.file_path);
-		void *const to_be_freed = steps;
-		steps = steps->next;
-		free(to_be_freed);
+		const struct sdp_step_ *step = &steps->steps[i];
+		if (step->info.op != SDP_WRITE_FILE || step->own_image)
+			continue;
+
+		// Failures are reported again when the step is executed
+		sdp_image *image = sdp_image_get(step->info.file_path);
+		if (image)
+			sdp_image_put(image);
 	}
 }
 
-int sdp_execute_steps(hid_device *handle, sdp_step *step)
+void sdp_free_steps(sdp_steps *steps)
 {
-	for (int i = 1; step; ++i)
+	for (int i = 0; i < steps->count; ++i)
 	{
-		printf("[Step %d] ", i);
-		if (step->exec(handle, &step->data))
+		free((void *)steps->steps[i].info.file_path);
+		if (steps->steps[i].image)
+			sdp_image_put(steps->steps[i].image);
+	}
+	free(steps->steps);
+	free(steps);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Every step is timed and added to the report, which may be NULL
+int sdp_execute_steps(sdp_device *dev, const sdp_steps *steps, sdp_run_report *report)
+{
+	for (int i = 0; i < steps->count; ++i)
+	{
+		const struct sdp_step_ *step = &steps->steps[i];
+		memset(&dev->stats, 0, sizeof(dev->stats));
+		if (step->written_by)
 		{
-			fprintf(stderr, "ERROR: Failed to execute step %d\n", i);
+			sdp_report_printf("[Step %d] Written with step %d\n", i + 1, step->written_by);
+			sdp_report_step(report, i + 1, &step->info, 0, 0, &dev->stats);
+			continue;
+		}
+
+		// Coalesced steps are only announced when they are written
+		if (step->coalesced == 1)
+			sdp_report_printf("[Step %d] %s, along with step %d\n", i + 1,
+							  sdp_step_op_name(step->info.op), i + 2);
+		else if (step->coalesced)
+			sdp_report_printf("[Step %d] %s, along with steps %d-%d\n", i + 1,
+							  sdp_step_op_name(step->info.op), i + 2, i + 1 + step->coalesced);
+		else
+			sdp_report_printf("[Step %d] %s\n", i + 1, sdp_step_op_name(step->info.op));
+		uint64_t start = now_ns();
+		uint64_t span = sdp_trace_begin();
+		int res = step->exec(dev, step);
+		sdp_trace_end(span, sdp_step_op_name(step->info.op), "step", i + 1);
+		sdp_report_step(report, i + 1, &step->info, res, now_ns() - start, &dev->stats);
+		if (res)
+		{
+			fprintf(stderr, "ERROR: Failed to execute step %d\n", i + 1);
 			return 1;
 		}
-		step = step->next;
 	}
 	return 0;
 }
 
-sdp_step *sdp_next_step(sdp_step *step)
+const char *sdp_step_op_name(enum sdp_step_op op)
+{
+	switch (op)
+	{
+	case SDP_WRITE_FILE:
+		return "write_file";
+	case SDP_JUMP_ADDRESS:
+		return "jump_address";
+	case SDP_WRITE_REGISTER:
+		return "write_register";
+	case SDP_READ_REGISTER:
+		return "read_register";
+	}
+	return "unknown";
+}
+
+int sdp_step_count(const sdp_steps *steps)
 {
-	return step->next;
+	return steps->count;
 }
 
-void sdp_set_next_step(sdp_step *step, sdp_step *next)
+bool sdp_steps_end_with_jump(const sdp_steps *steps)
 {
-	step->next = next;
+	return steps->count && steps->steps[steps->count - 1].info.op == SDP_JUMP_ADDRESS;
 }
@@ -1,17 +1,61 @@
 #ifndef STEPS_H_
 #define STEPS_H_
 
-#include <hidapi/hidapi.h>
-
-struct sdp_step_;
-typedef struct sdp_step_ sdp_step;
-
-sdp_step *sdp_parse_step(char *s);
-sdp_step *sdp_new_step(const char *op, const char *file_path, const char *address);
-sdp_step *sdp_append_step(sdp_step *list, sdp_step *step);
-void sdp_free_steps(sdp_step *steps);
-int sdp_execute_steps(hid_device *handle, sdp_step *steo);
-sdp_step *sdp_next_step(sdp_step *step);
-void sdp_set_next_step(sdp_step *step, sdp_step *next);
+#include "image.h"
+#include "transport.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+struct sdp_steps_;
+typedef struct sdp_steps_ sdp_steps;
+struct sdp_run_report_;
+
+#define MAX_STEP_OPTIONS 8
+
+struct sdp_step_option
+{
+	const char *key;
+	const char *value;
+};
+
+enum sdp_step_op
+{
+	SDP_WRITE_FILE,
+	SDP_JUMP_ADDRESS,
+	SDP_WRITE_REGISTER,
+	SDP_READ_REGISTER,
+};
+
+// A step after its arguments and options are parsed
+struct sdp_step_info
+{
+	enum sdp_step_op op;
+	const char *file_path; // write_file only
+	uint32_t address;
+	bool dcd; // write_register: batched into a DCD executed at dcd_address
+	uint32_t dcd_address;
+	bool trim;
+	uint32_t segment_size; // 0: a single WRITE_FILE command
+	uint32_t offset;       // write_file only: range of the file to write
+	uint32_t length;       // 0: up to the end of the file
+	uint32_t value;        // write_register only
+	uint8_t width;         // of the registers in bytes (1, 2 or 4), 0 for 4
+	uint32_t count;        // read_register only: consecutive registers, 0 for 1
+};
+
+sdp_steps *sdp_new_steps(void);
+int sdp_parse_step(sdp_steps *steps, char *s);
+int sdp_add_step(sdp_steps *steps, const char *op, const char *file_path, const char *address,
+				 const struct sdp_step_option *options, int option_count);
+int sdp_add_step_info(sdp_steps *steps, const struct sdp_step_info *info, sdp_image *image);
+void sdp_get_step_info(const sdp_steps *steps, int index, struct sdp_step_info *info,
+					   const sdp_image **image);
+int sdp_prepare_steps(sdp_steps *steps);
+void sdp_prefetch_steps(const sdp_steps *steps);
+void sdp_free_steps(sdp_steps *steps);
+int sdp_execute_steps(sdp_device *dev, const sdp_steps *steps, struct sdp_run_report_ *report);
+const char *sdp_step_op_name(enum sdp_step_op op);
+int sdp_step_count(const sdp_steps *steps);
+bool sdp_steps_end_with_jump(const sdp_steps *steps);
 
 #endif
@@ -0,0 +1,224 @@
+#include "sysfs.h"
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define USB_DEVICES "/sys/bus/usb/devices"
+#define UHID_DEVICES "/sys/devices/virtual/misc/uhid"
+
+static int read_sysfs_int(const char *dir, const char *attr, const char *format, int *value)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, attr);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+    int res = fscanf(f, format, value) == 1 ? 0 : -1;
+    fclose(f);
+    return res;
+}
+
+// Read a property (e.g. HID_PHYS) from the uevent file of a sysfs device
+static char *read_uevent(const char *dir, const char *key)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/uevent", dir);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return NULL;
+
+    char *result = NULL;
+    char line[256];
+    size_t key_len = strlen(key);
+    while (!result && fgets(line, sizeof(line), f))
+    {
+        if (strncmp(line, key, key_len) || line[key_len] != '=')
+            continue;
+        line[strcspn(line, "\n")] = '\0';
+        result = strdup(line + key_len + 1);
+    }
+    fclose(f);
+    return result;
+}
+
+// Return /dev/<name> for the hidraw node below the HID device directory
+static char *hidraw_node(const char *hid_dir)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/hidraw", hid_dir);
+    DIR *dir = opendir(path);
+    if (!dir)
+        return NULL;
+
+    char *result = NULL;
+    struct dirent *entry;
+    while (!result && (entry = readdir(dir)))
+    {
+        if (strncmp(entry->d_name, "hidraw", 6))
+            continue;
+        size_t length = sizeof("/dev/") + strlen(entry->d_name);
+        result = malloc(length);
+        if (result)
+            snprintf(result, length, "/dev/%s", entry->d_name);
+    }
+    closedir(dir);
+    return result;
+}
+
+// HID devices are named <BUS>:<VID>:<PID>.<ID>
+static bool is_hid_device(const char *name, uint16_t vid, uint16_t pid)
+{
+    unsigned int bus, hid_vid, hid_pid, id;
+    return sscanf(name, "%x:%x:%x.%x", &bus, &hid_vid, &hid_pid, &id) == 4 &&
+           hid_vid == vid && hid_pid == pid;
+}
+
+// Look through the HID devices below the interfaces of a USB device
+static char *usb_hidraw(const char *usb_dir, const char *usb_path, uint16_t vid, uint16_t pid)
+{
+    char *result = NULL;
+    int dev_vid, dev_pid;
+    if (read_sysfs_int(usb_dir, "idVendor", "%x", &dev_vid) ||
+        read_sysfs_int(usb_dir, "idProduct", "%x", &dev_pid) ||
+        dev_vid != vid || dev_pid != pid)
+        return NULL;
+
+    DIR *dir = opendir(usb_dir);
+    if (!dir)
+        return NULL;
+
+    // Interfaces are named <USB path>:<configuration>.<interface>
+    size_t path_len = strlen(usb_path);
+    struct dirent *entry;
+    while (!result && (entry = readdir(dir)))
+    {
+        if (strncmp(entry->d_name, usb_path, path_len) || entry->d_name[path_len] != ':')
+            continue;
+
+        char intf_path[PATH_MAX];
+        if (snprintf(intf_path, sizeof(intf_path), "%s/%s", usb_dir, entry->d_name) >= (int)sizeof(intf_path))
+            continue;
+        DIR *intf = opendir(intf_path);
+        if (!intf)
+            continue;
+        struct dirent *hid;
+        while (!result && (hid = readdir(intf)))
+        {
+            if (!is_hid_device(hid->d_name, vid, pid))
+                continue;
+            char hid_path[PATH_MAX];
+            if (snprintf(hid_path, sizeof(hid_path), "%s/%s", intf_path, hid->d_name) < (int)sizeof(hid_path))
+                result = hidraw_node(hid_path);
+        }
+        closedir(intf);
+    }
+    closedir(dir);
+    return result;
+}
+
+// Virtual devices have no USB device, match their HID_PHYS instead
+static char *uhid_hidraw(const char *phys, uint16_t vid, uint16_t pid)
+{
+    DIR *dir = opendir(UHID_DEVICES);
+    if (!dir)
+        return NULL;
+
+    char *result = NULL;
+    struct dirent *entry;
+    while (!result && (entry = readdir(dir)))
+    {
+        if (!is_hid_device(entry->d_name, vid, pid))
+            continue;
+        char hid_path[PATH_MAX];
+        snprintf(hid_path, sizeof(hid_path), UHID_DEVICES "/%s", entry->d_name);
+        char *hid_phys = read_uevent(hid_path, "HID_PHYS");
+        if (hid_phys && !strcmp(hid_phys, phys))
+            result = hidraw_node(hid_path);
+        free(hid_phys);
+    }
+    closedir(dir);
+    return result;
+}
+
+// Find the hidraw node of the device with the given VID/PID at usb_path.
+// Returns NULL if there is none (or a device with a different VID/PID).
+char *sdp_sysfs_hidraw(const char *usb_path, uint16_t vid, uint16_t pid)
+{
+    if (!*usb_path || strchr(usb_path, '/') || !strcmp(usb_path, ".."))
+        return NULL;
+
+    char usb_dir[PATH_MAX];
+    snprintf(usb_dir, sizeof(usb_dir), USB_DEVICES "/%s", usb_path);
+    if (access(usb_dir, F_OK))
+        return uhid_hidraw(usb_path, vid, pid);
+    return usb_hidraw(usb_dir, usb_path, vid, pid);
+}
+
+// Resolve /dev/hidrawN to the sysfs directory of its HID device
+static int hid_device_dir(const char *devnode, char *path)
+{
+    const char *sysname = strrchr(devnode, '/');
+    sysname = sysname ? sysname + 1 : devnode;
+
+    char link[PATH_MAX];
+    snprintf(link, sizeof(link), "/sys/class/hidraw/%s/device", sysname);
+    if (!realpath(link, path))
+    {
+        fprintf(stderr, "ERROR: Cannot resolve %s: %s\n", link, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// The path of the HID device is .../<USB device>/<interface>/<HID device>
+static int usb_device_dir(char *path)
+{
+    for (int i = 0; i < 2; ++i)
+    {
+        char *slash = strrchr(path, '/');
+        if (!slash || slash == path)
+            return -1;
+        *slash = '\0';
+    }
+    return 0;
+}
+
+// Return the USB path (or the HID_PHYS of a virtual device) of a hidraw node
+char *sdp_sysfs_usb_path(const char *devnode)
+{
+    char path[PATH_MAX];
+    if (hid_device_dir(devnode, path))
+        return NULL;
+
+    if (!strncmp(path, UHID_DEVICES "/", strlen(UHID_DEVICES "/")))
+        return read_uevent(path, "HID_PHYS");
+
+    int busnum;
+    if (usb_device_dir(path) || read_sysfs_int(path, "busnum", "%d", &busnum))
+    {
+        fprintf(stderr, "ERROR: %s is not a USB device\n", devnode);
+        return NULL;
+    }
+    return strdup(strrchr(path, '/') + 1);
+}
+
+// Resolve /dev/hidrawN to the bus number and address of its USB device
+int sdp_sysfs_usb_address(const char *devnode, int *busnum, int *devnum)
+{
+    char path[PATH_MAX];
+    if (hid_device_dir(devnode, path))
+        return -1;
+
+    if (usb_device_dir(path) || read_sysfs_int(path, "busnum", "%d", busnum) ||
+        read_sysfs_int(path, "devnum", "%d", devnum))
+    {
+        fprintf(stderr, "ERROR: %s is not a USB device\n", devnode);
+        return -1;
+    }
+    return 0;
+}
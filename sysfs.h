@@ -0,0 +1,16 @@
+#ifndef SYSFS_H_
+#define SYSFS_H_
+
+#include <stdint.h>
+
+/*
+ * Direct lookups between USB paths (e.g. 3-1.1) and hidraw nodes in sysfs,
+ * without enumerating all HID devices. Virtual (uhid) devices are identified
+ * by their HID_PHYS property instead of a USB path.
+ */
+
+char *sdp_sysfs_hidraw(const char *usb_path, uint16_t vid, uint16_t pid);
+char *sdp_sysfs_usb_path(const char *devnode);
+int sdp_sysfs_usb_address(const char *devnode, int *busnum, int *devnum);
+
+#endif
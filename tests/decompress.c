@@ -0,0 +1,143 @@
+#include "config.h"
+#include "image.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef WITH_LZMA
+#include <lzma.h>
+#endif
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+
+/*
+ * Loads files of two concatenated gzip members, xz streams and zstd frames,
+ * and of a single one, checking the size and the data. The parts decode to
+ * more than the image's first buffer, so that it has to grow.
+ */
+
+#define PART_SIZE (1024 * 1024)
+
+typedef size_t (*compress_fn)(const unsigned char *in, size_t length, unsigned char *out,
+                              size_t size);
+
+#ifdef WITH_ZLIB
+static size_t compress_gzip(const unsigned char *in, size_t length, unsigned char *out, size_t size)
+{
+    z_stream z = {0};
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return 0;
+    z.next_in = (unsigned char *)in;
+    z.avail_in = length;
+    z.next_out = out;
+    z.avail_out = size;
+    int res = deflate(&z, Z_FINISH);
+    size_t n = size - z.avail_out;
+    deflateEnd(&z);
+    return res == Z_STREAM_END ? n : 0;
+}
+#endif
+
+#ifdef WITH_LZMA
+static size_t compress_xz(const unsigned char *in, size_t length, unsigned char *out, size_t size)
+{
+    size_t pos = 0;
+    if (lzma_easy_buffer_encode(6, LZMA_CHECK_CRC32, NULL, in, length, out, &pos, size) != LZMA_OK)
+        return 0;
+    return pos;
+}
+#endif
+
+#ifdef WITH_ZSTD
+static size_t compress_zstd(const unsigned char *in, size_t length, unsigned char *out, size_t size)
+{
+    size_t n = ZSTD_compress(out, size, in, length, 3);
+    return ZSTD_isError(n) ? 0 : n;
+}
+#endif
+
+// Compress each part on its own into the file, then load it as a whole
+static int check(const char *name, compress_fn compress, const unsigned char *data, int parts)
+{
+    char path[] = "/tmp/imx-sdp-test-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return -1;
+
+    size_t size = 2 * PART_SIZE;
+    unsigned char *buf = malloc(size);
+    int res = -1;
+    for (int i = 0; i < parts; ++i)
+    {
+        size_t n = compress(data + i * PART_SIZE, PART_SIZE, buf, size);
+        if (!n || write(fd, buf, n) != (ssize_t)n)
+        {
+            fprintf(stderr, "%s: failed to compress\n", name);
+            goto out;
+        }
+    }
+
+    sdp_image *image = sdp_image_get(path);
+    if (!image)
+    {
+        fprintf(stderr, "%s: failed to load %d part(s)\n", name, parts);
+        goto out;
+    }
+    if (sdp_image_size(image) != (size_t)parts * PART_SIZE ||
+        memcmp(sdp_image_data(image), data, sdp_image_size(image)))
+        fprintf(stderr, "%s: wrong data of %d part(s)\n", name, parts);
+    else
+        res = 0;
+    sdp_image_put(image);
+
+out:
+    free(buf);
+    close(fd);
+    unlink(path);
+    return res;
+}
+
+int main(void)
+{
+    static const struct
+    {
+        const char *name;
+        compress_fn compress;
+    } formats[] = {
+#ifdef WITH_ZLIB
+        {"gzip", compress_gzip},
+#endif
+#ifdef WITH_LZMA
+        {"xz", compress_xz},
+#endif
+#ifdef WITH_ZSTD
+        {"zstd", compress_zstd},
+#endif
+        {NULL, NULL},
+    };
+
+    // Compressible, but not trivially
+    unsigned char *data = malloc(2 * PART_SIZE);
+    if (!data)
+        return 1;
+    srand(1);
+    for (size_t i = 0; i < 2 * PART_SIZE; ++i)
+        data[i] = (i / 64) % 7 ? 'a' : rand();
+
+    int failed = 0;
+    for (int i = 0; formats[i].name; ++i)
+    {
+        for (int parts = 1; parts <= 2; ++parts)
+        {
+            if (check(formats[i].name, formats[i].compress, data, parts))
+                failed++;
+        }
+    }
+    free(data);
+    return failed ? 1 : 0;
+}
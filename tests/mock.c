@@ -0,0 +1,233 @@
+#include "report.h"
+#include "rom.h"
+#include "sdp.h"
+#include "stages.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Runs boot plans through the mock transport and checks what they left in the
+ * ROM model: the written memory and the jump of each stage, coalesced writes,
+ * a batched DCD and register reads, and that an injected fault fails the step.
+ */
+
+#define IMAGE_SIZE (40 * 1024)
+#define MAX_STAGES 4
+
+static char dir[] = "/tmp/imx-sdp-test-XXXXXX";
+static unsigned char images[3][IMAGE_SIZE];
+static const char *const image_names[] = {"spl.bin", "u-boot.bin", "payload.bin"};
+
+// What each stage's ROM was left with, in the order of the stages
+static struct
+{
+    int count;
+    bool jumped[MAX_STAGES];
+    uint32_t jump_address[MAX_STAGES];
+    unsigned char memory[MAX_STAGES][2 * IMAGE_SIZE];
+    unsigned char registers[MAX_STAGES][8];
+} roms;
+
+// The report events of the steps that were executed
+static struct
+{
+    int count;
+    struct sdp_report_event events[16];
+} steps;
+
+static int failed;
+
+static void fail(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "FAIL: ");
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+    failed++;
+}
+
+static void on_close(const sdp_rom *rom, void *ctx)
+{
+    if (roms.count == MAX_STAGES)
+        return;
+    int i = roms.count++;
+    roms.jumped[i] = sdp_rom_jumped(rom, &roms.jump_address[i]);
+    sdp_rom_read_memory(rom, i ? 0x90000000 : 0x80000000, roms.memory[i], sizeof(roms.memory[i]));
+    sdp_rom_read_memory(rom, 0x020c4068, roms.registers[i], sizeof(roms.registers[i]));
+}
+
+static void on_event(const struct sdp_report_event *event, void *ctx)
+{
+    int max = sizeof(steps.events) / sizeof(steps.events[0]);
+    if (event->type == SDP_EVENT_STEP && steps.count < max)
+        steps.events[steps.count++] = *event;
+}
+
+static const struct sdp_report_event *find_step(enum sdp_step_op op)
+{
+    for (int i = 0; i < steps.count; ++i)
+    {
+        if (steps.events[i].info.op == op)
+            return &steps.events[i];
+    }
+    return NULL;
+}
+
+// Run the plan given as STAGE arguments on a fresh mock transport
+static int run(const char *transport, int count, ...)
+{
+    // The %s in a stage stand for the directory of the images
+    char buf[MAX_STAGES][512];
+    char *args[MAX_STAGES];
+    va_list ap;
+    va_start(ap, count);
+    for (int i = 0; i < count; ++i)
+    {
+        snprintf(buf[i], sizeof(buf[i]), va_arg(ap, const char *), dir, dir, dir);
+        args[i] = buf[i];
+    }
+    va_end(ap);
+
+    memset(&roms, 0, sizeof(roms));
+    memset(&steps, 0, sizeof(steps));
+    int res = -1;
+    sdp_stages *stages = sdp_parse_stages(count, args);
+    if (!stages || sdp_prepare_stages(stages) || sdp_transport_select(transport))
+        fail("plan not prepared");
+    else
+        res = sdp_execute_stages(stages, false, NULL);
+
+    if (stages)
+        sdp_free_stages(stages);
+    return res;
+}
+
+static void check_plan(void)
+{
+    // Two contiguous images, a DCD batch of two registers and a read of both
+    int res = run("mock:seed=1", 2,
+                  "15a2:0080,write_register:020c4068:12345678:dcd=00910000,"
+                  "write_register:020c406c:9abcdef0:dcd=00910000,read_register:020c4068:count=2,"
+                  "write_file:%s/spl.bin:80000000,write_file:%s/u-boot.bin:8000a000,jump_address:80000000",
+                  "15a2:0061,write_file:%s/payload.bin:90000000,jump_address:90000000");
+    if (res)
+        fail("plan failed");
+    if (roms.count != 2)
+    {
+        fail("%d devices opened instead of 2", roms.count);
+        return;
+    }
+
+    if (memcmp(roms.memory[0], images[0], IMAGE_SIZE) ||
+        memcmp(roms.memory[0] + IMAGE_SIZE, images[1], IMAGE_SIZE))
+        fail("stage 1 memory");
+    if (memcmp(roms.memory[1], images[2], IMAGE_SIZE))
+        fail("stage 2 memory");
+    if (!roms.jumped[0] || roms.jump_address[0] != 0x80000000)
+        fail("stage 1 didn't jump to 0x80000000");
+    if (!roms.jumped[1] || roms.jump_address[1] != 0x90000000)
+        fail("stage 2 didn't jump to 0x90000000");
+
+    // Little-endian, as in the SoC's memory
+    static const unsigned char registers[] = {0x78, 0x56, 0x34, 0x12, 0xf0, 0xde, 0xbc, 0x9a};
+    if (memcmp(roms.registers[0], registers, sizeof(registers)))
+        fail("registers written by the DCD");
+
+    const struct sdp_report_event *dcd = find_step(SDP_WRITE_REGISTER);
+    if (!dcd || dcd->result || dcd->stats.round_trips_saved != 1)
+        fail("write_register steps not batched into one DCD");
+    const struct sdp_report_event *write = find_step(SDP_WRITE_FILE);
+    if (!write || write->result || write->stats.round_trips_saved != 1 ||
+        write->stats.bytes != 2 * IMAGE_SIZE)
+        fail("write_file steps not coalesced");
+    const struct sdp_report_event *read = find_step(SDP_READ_REGISTER);
+    if (!read || read->result)
+        fail("read_register step");
+}
+
+// Register reads return what was written, in the ROM's 64 byte reports
+static void check_registers(void)
+{
+    if (sdp_transport_select("mock:seed=1") || sdp_transport_init())
+    {
+        fail("mock transport init");
+        return;
+    }
+    sdp_device *dev = sdp_device_open(NULL, 0x15a2, 0x0080, NULL);
+    if (!dev)
+    {
+        fail("mock device open");
+        sdp_transport_exit();
+        return;
+    }
+
+    uint32_t values[20] = {0};
+    if (sdp_write_register(dev, 0x020c4068, 0x12345678, 4) ||
+        sdp_write_register(dev, 0x020c40b4, 0xcafe, 2) ||
+        sdp_read_registers(dev, 0x020c4068, 4, values, 20))
+        fail("register access");
+    else if (values[0] != 0x12345678 || values[19] != 0xcafe || values[1])
+        fail("register values read back");
+
+    if (sdp_read_registers(dev, 0x020c40b4, 2, values, 1) || values[0] != 0xcafe)
+        fail("16-bit register read back");
+
+    sdp_device_close(dev);
+    sdp_transport_exit();
+}
+
+// A write of 40 reports with one in ten failing can't get through
+static void check_fault(void)
+{
+    int res = run("mock:fault=0.1,seed=1", 1, "15a2:0080,write_file:%s/spl.bin:80000000");
+    const struct sdp_report_event *write = find_step(SDP_WRITE_FILE);
+    if (!res || !write || !write->result)
+        fail("injected fault didn't fail the write_file step");
+}
+
+int main(void)
+{
+    if (!mkdtemp(dir))
+        return 1;
+
+    srand(1);
+    int res = 1;
+    for (int i = 0; i < 3; ++i)
+    {
+        for (int j = 0; j < IMAGE_SIZE; ++j)
+            images[i][j] = rand();
+
+        char path[64];
+        snprintf(path, sizeof(path), "%s/%s", dir, image_names[i]);
+        FILE *f = fopen(path, "wb");
+        if (!f)
+            goto out;
+        size_t n = fwrite(images[i], 1, IMAGE_SIZE, f);
+        if (fclose(f) || n != IMAGE_SIZE)
+            goto out;
+    }
+
+    sdp_report_quiet(true);
+    sdp_report_listen(on_event, NULL);
+    sdp_mock_on_close(on_close, NULL);
+
+    check_plan();
+    check_registers();
+    check_fault();
+    res = failed ? 1 : 0;
+
+out:
+    for (int i = 0; i < 3; ++i)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "%s/%s", dir, image_names[i]);
+        unlink(path);
+    }
+    rmdir(dir);
+    return res;
+}
@@ -0,0 +1,199 @@
+#include "trace.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TRACE_SPANS (1 << 20)
+
+struct span
+{
+    const char *name;
+    const char *arg_name;
+    int64_t arg;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    int track;
+};
+
+static struct
+{
+    bool enabled;
+    FILE *file;
+    uint64_t start_ns;
+    struct span *spans;
+    atomic_uint_fast64_t next; // spans recorded so far, including dropped ones
+    atomic_int track_count;
+    pthread_mutex_t lock;
+    char **track_names; // indexed by track, NULL if unnamed
+    int track_capacity;
+} trace = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static _Thread_local int thread_track = -1;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int current_track(void)
+{
+    if (thread_track < 0)
+        thread_track = atomic_fetch_add(&trace.track_count, 1);
+    return thread_track;
+}
+
+// The file is created right away, so that a bad path fails before any device
+// is touched
+int sdp_trace_init(const char *path)
+{
+    trace.file = fopen(path, "w");
+    if (!trace.file)
+    {
+        fprintf(stderr, "ERROR: Failed to create trace \"%s\": %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    trace.spans = calloc(TRACE_SPANS, sizeof(struct span));
+    if (!trace.spans)
+    {
+        fprintf(stderr, "ERROR: Failed to allocate trace buffer\n");
+        fclose(trace.file);
+        trace.file = NULL;
+        return -1;
+    }
+
+    trace.start_ns = now_ns();
+    atomic_init(&trace.next, 0);
+    atomic_init(&trace.track_count, 0);
+    trace.enabled = true;
+    return 0;
+}
+
+// Name the calling thread's track, e.g. after the board's USB path
+void sdp_trace_track(const char *name)
+{
+    if (!trace.enabled)
+        return;
+
+    int track = current_track();
+    pthread_mutex_lock(&trace.lock);
+    if (track >= trace.track_capacity)
+    {
+        int capacity = trace.track_capacity ? trace.track_capacity : 8;
+        while (track >= capacity)
+            capacity *= 2;
+        char **tmp = realloc(trace.track_names, capacity * sizeof(char *));
+        if (!tmp)
+            goto unlock;
+        memset(tmp + trace.track_capacity, 0, (capacity - trace.track_capacity) * sizeof(char *));
+        trace.track_names = tmp;
+        trace.track_capacity = capacity;
+    }
+    free(trace.track_names[track]);
+    trace.track_names[track] = strdup(name);
+unlock:
+    pthread_mutex_unlock(&trace.lock);
+}
+
+uint64_t sdp_trace_begin(void)
+{
+    return trace.enabled ? now_ns() : 0;
+}
+
+void sdp_trace_end(uint64_t start, const char *name, const char *arg_name, int64_t arg)
+{
+    if (!start)
+        return;
+
+    uint64_t end = now_ns();
+    uint64_t index = atomic_fetch_add_explicit(&trace.next, 1, memory_order_relaxed);
+    struct span *span = &trace.spans[index % TRACE_SPANS];
+    span->name = name;
+    span->arg_name = arg_name;
+    span->arg = arg;
+    span->start_ns = start;
+    span->duration_ns = end - start;
+    span->track = current_track();
+}
+
+static void write_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; ++s)
+    {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+// Write the recorded spans. Must only be called once all traced threads are done.
+int sdp_trace_finish(void)
+{
+    if (!trace.enabled)
+        return 0;
+    trace.enabled = false;
+
+    FILE *f = trace.file;
+    uint64_t next = atomic_load(&trace.next);
+    uint64_t first = next > TRACE_SPANS ? next - TRACE_SPANS : 0;
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped_spans\":%" PRIu64 "},"
+               "\"traceEvents\":[\n",
+            first);
+    fprintf(f, "{\"ph\":\"M\",\"pid\":1,\"name\":\"process_name\",\"args\":{\"name\":\"imx-sdp\"}}");
+    for (int i = 0; i < atomic_load(&trace.track_count); ++i)
+    {
+        fprintf(f, ",\n{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_name\",\"args\":{\"name\":",
+                i + 1);
+        if (i < trace.track_capacity && trace.track_names[i])
+            write_string(f, trace.track_names[i]);
+        else
+            fprintf(f, "\"thread %d\"", i + 1);
+        fprintf(f, "}}");
+    }
+
+    for (uint64_t i = first; i < next; ++i)
+    {
+        const struct span *span = &trace.spans[i % TRACE_SPANS];
+        fprintf(f, ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"name\":\"%s\",\"ts\":%.3f,\"dur\":%.3f",
+                span->track + 1, span->name, (span->start_ns - trace.start_ns) / 1e3,
+                span->duration_ns / 1e3);
+        if (span->arg_name)
+            fprintf(f, ",\"args\":{\"%s\":%" PRId64 "}", span->arg_name, span->arg);
+        fputc('}', f);
+    }
+    fprintf(f, "\n]}\n");
+
+    int res = 0;
+    if (fclose(f))
+    {
+        fprintf(stderr, "ERROR: Failed to write trace: %s\n", strerror(errno));
+        res = -1;
+    }
+    trace.file = NULL;
+
+    for (int i = 0; i < trace.track_capacity; ++i)
+        free(trace.track_names[i]);
+    free(trace.track_names);
+    trace.track_names = NULL;
+    trace.track_capacity = 0;
+    free(trace.spans);
+    trace.spans = NULL;
+    return res;
+}
@@ -0,0 +1,23 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+
+/*
+ * Opt-in tracing of timed spans (reports, waits, steps) in the Chrome trace
+ * event format, which Perfetto and chrome://tracing load. Every thread, i.e.
+ * every board, gets its own track. Spans go into a ring allocated up front and
+ * are only written out by sdp_trace_finish(), so the oldest are dropped if it
+ * overflows.
+ */
+
+int sdp_trace_init(const char *path);
+int sdp_trace_finish(void);
+void sdp_trace_track(const char *name);
+
+// Returns the start of a span, 0 if tracing is off. name and arg_name must be
+// static strings; arg_name may be NULL.
+uint64_t sdp_trace_begin(void);
+void sdp_trace_end(uint64_t start, const char *name, const char *arg_name, int64_t arg);
+
+#endif
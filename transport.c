@@ -0,0 +1,166 @@
+#include "transport.h"
+#include "config.h"
+#include "record.h"
+#include <hidapi/hidapi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const struct sdp_transport *const transports[] = {
+    &sdp_hid_transport,
+#ifdef WITH_LIBUSB
+    &sdp_usb_transport,
+#endif
+    &sdp_mock_transport,
+    &sdp_replay_transport,
+};
+
+static const struct sdp_transport *transport = &sdp_hid_transport;
+static char *transport_options;
+
+// Select the transport by "NAME[:OPTIONS]"
+int sdp_transport_select(const char *spec)
+{
+    const char *colon = strchr(spec, ':');
+    size_t name_length = colon ? (size_t)(colon - spec) : strlen(spec);
+
+    for (size_t i = 0; i < sizeof(transports) / sizeof(transports[0]); ++i)
+    {
+        if (strlen(transports[i]->name) != name_length ||
+            strncmp(transports[i]->name, spec, name_length))
+            continue;
+
+        free(transport_options);
+        transport_options = NULL;
+        if (colon)
+        {
+            transport_options = strdup(colon + 1);
+            if (!transport_options)
+            {
+                fprintf(stderr, "ERROR: Failed to allocate transport options\n");
+                return 1;
+            }
+        }
+        transport = transports[i];
+        return 0;
+    }
+
+    fprintf(stderr, "ERROR: Unknown transport \"%.*s\"\n", (int)name_length, spec);
+    return 1;
+}
+
+const struct sdp_transport *sdp_transport_get(void)
+{
+    return transport;
+}
+
+// Devices are always discovered through hidapi, regardless of the transport
+int sdp_transport_init(void)
+{
+    if (hid_init())
+    {
+        fprintf(stderr, "ERROR: hidapi init failed\n");
+        return 1;
+    }
+    if (transport->init && transport->init(transport_options))
+    {
+        fprintf(stderr, "ERROR: %s transport init failed\n", transport->name);
+        hid_exit();
+        return 1;
+    }
+    return 0;
+}
+
+void sdp_transport_exit(void)
+{
+    if (transport->exit)
+        transport->exit();
+    if (hid_exit())
+        fprintf(stderr, "ERROR: hidapi exit failed\n");
+}
+
+// Open the device behind devnode, or let the transport find it if it doesn't
+// discover devices through hidraw (devnode is NULL then)
+sdp_device *sdp_device_open(const char *devnode, uint16_t vid, uint16_t pid, const char *usb_path)
+{
+    uint64_t start = sdp_record_begin();
+    sdp_device *dev = devnode ? transport->open(devnode) : transport->find(vid, pid, usb_path);
+    uint32_t session = sdp_record_open(start, vid, pid, usb_path, dev ? 0 : -1);
+    if (dev)
+        dev->record_session = session;
+    return dev;
+}
+
+// Failed calls are recorded with the transport's error instead of the report
+static void record(sdp_device *dev, uint64_t start, enum sdp_record_type type, int result,
+                   const void *data, size_t length)
+{
+    if (!start)
+        return;
+    uint8_t flags = 0;
+    if (result < 0)
+    {
+        data = dev->transport->error(dev);
+        length = strlen(data);
+        if (dev->disconnected)
+            flags |= SDP_RECORD_DISCONNECTED;
+    }
+    sdp_record_event(start, dev->record_session, type, result, flags, data, length);
+}
+
+void sdp_device_close(sdp_device *dev)
+{
+    uint64_t start = sdp_record_begin();
+    uint32_t session = dev->record_session;
+    dev->transport->close(dev);
+    sdp_record_event(start, session, SDP_RECORD_CLOSE, 0, 0, NULL, 0);
+}
+
+int sdp_device_write(sdp_device *dev, const unsigned char *buf, size_t length)
+{
+    uint64_t start = sdp_record_begin();
+    dev->disconnected = false;
+    int res = dev->transport->write(dev, buf, length);
+    record(dev, start, SDP_RECORD_WRITE, res, buf, length);
+    return res;
+}
+
+// Recorded like a write, a replay doesn't depend on the transport
+int sdp_device_write_queued(sdp_device *dev, const unsigned char *buf, size_t length)
+{
+    uint64_t start = sdp_record_begin();
+    dev->disconnected = false;
+    int res = dev->transport->write_queued ? dev->transport->write_queued(dev, buf, length)
+                                           : dev->transport->write(dev, buf, length);
+    record(dev, start, SDP_RECORD_WRITE, res, buf, length);
+    return res;
+}
+
+int sdp_device_flush(sdp_device *dev)
+{
+    uint64_t start = sdp_record_begin();
+    int res = dev->transport->flush ? dev->transport->flush(dev) : 0;
+    record(dev, start, SDP_RECORD_FLUSH, res, NULL, 0);
+    return res;
+}
+
+int sdp_device_read(sdp_device *dev, unsigned char *buf, size_t length, int timeout)
+{
+    uint64_t start = sdp_record_begin();
+    dev->disconnected = false;
+    int res = dev->transport->read(dev, buf, length, timeout);
+    record(dev, start, SDP_RECORD_READ, res, buf, res > 0 ? (size_t)res : 0);
+    return res;
+}
+
+const char *sdp_device_error(sdp_device *dev)
+{
+    return dev->transport->error(dev);
+}
+
+// Whether the last failed read or write found the device gone, rather than
+// failing with the device still there
+bool sdp_device_disconnected(const sdp_device *dev)
+{
+    return dev->disconnected;
+}
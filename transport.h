@@ -0,0 +1,71 @@
+#ifndef TRANSPORT_H_
+#define TRANSPORT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct sdp_device_;
+typedef struct sdp_device_ sdp_device;
+
+struct sdp_transport
+{
+    const char *name;
+    int (*init)(const char *options);
+    void (*exit)(void);
+    // Optional, for backends that don't discover devices through hidraw
+    sdp_device *(*find)(uint16_t vid, uint16_t pid, const char *usb_path);
+    // Open the device behind the given hidraw device node
+    sdp_device *(*open)(const char *devnode);
+    void (*close)(sdp_device *dev);
+    int (*write)(sdp_device *dev, const unsigned char *buf, size_t length);
+    // Queue a report; it is only guaranteed to be sent after flush()
+    int (*write_queued)(sdp_device *dev, const unsigned char *buf, size_t length);
+    int (*flush)(sdp_device *dev);
+    // Like hid_read_timeout(): returns the number of bytes read, 0 on timeout
+    // or -1 on error; a negative timeout blocks indefinitely
+    int (*read)(sdp_device *dev, unsigned char *buf, size_t length, int timeout);
+    const char *(*error)(sdp_device *dev);
+};
+
+// Accumulated by the SDP commands, reset by whoever measures them
+struct sdp_device_stats
+{
+    uint64_t bytes;             // payload sent in data reports
+    uint64_t data_ns;           // sending data reports, including the final flush
+    uint64_t hab_ns;            // waiting for HAB status reports
+    uint64_t response_ns;       // waiting for response reports
+    uint32_t retries;           // segments sent again
+    uint32_t round_trips_saved; // by writing coalesced steps along with this one
+};
+
+// Every device starts with this, backends embed it into their own state
+struct sdp_device_
+{
+    const struct sdp_transport *transport;
+    struct sdp_device_stats stats;
+    uint32_t record_session; // 0 if not recorded
+    bool disconnected;       // set by the backend if the last read or write
+                             // failed because the device is gone
+};
+
+extern const struct sdp_transport sdp_hid_transport;
+extern const struct sdp_transport sdp_usb_transport;
+extern const struct sdp_transport sdp_mock_transport;
+extern const struct sdp_transport sdp_replay_transport;
+
+int sdp_transport_select(const char *spec);
+const struct sdp_transport *sdp_transport_get(void);
+int sdp_transport_init(void);
+void sdp_transport_exit(void);
+
+sdp_device *sdp_device_open(const char *devnode, uint16_t vid, uint16_t pid, const char *usb_path);
+void sdp_device_close(sdp_device *dev);
+int sdp_device_write(sdp_device *dev, const unsigned char *buf, size_t length);
+int sdp_device_write_queued(sdp_device *dev, const unsigned char *buf, size_t length);
+int sdp_device_flush(sdp_device *dev);
+int sdp_device_read(sdp_device *dev, unsigned char *buf, size_t length, int timeout);
+const char *sdp_device_error(sdp_device *dev);
+bool sdp_device_disconnected(const sdp_device *dev);
+
+#endif
@@ -1,10 +1,13 @@
 #include "udev.h"
+#include "report.h"
+#include "trace.h"
 #include <errno.h>
 #include <libudev.h>
 #include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 struct sdp_udev_
 {
@@ -51,47 +54,111 @@ void sdp_udev_free(sdp_udev *udev)
     free(udev);
 }
 
-char *sdp_udev_wait(sdp_udev *udev, uint16_t vid, uint16_t pid, const char *usb_path, int timeout)
+// Identify the device behind a hidraw node by its USB path, VID and PID.
+// Virtual (uhid) devices have no USB parent, their HID_PHYS and HID_ID
+// properties are used instead.
+static const char *device_identity(struct udev_device *dev, uint16_t *vid, uint16_t *pid)
 {
-    char vid_str[5], pid_str[5];
-    sprintf(vid_str, "%04x", vid);
-    sprintf(pid_str, "%04x", pid);
+    struct udev_device *parent = udev_device_get_parent_with_subsystem_devtype(dev, "usb", "usb_device");
+    if (parent)
+    {
+        // Use VID/PID from the environment properties instead of sysattr
+        // because the latter is not available yet.
+        const char *vid_prop = udev_device_get_property_value(parent, "ID_VENDOR_ID");
+        const char *pid_prop = udev_device_get_property_value(parent, "ID_MODEL_ID");
+        if (!vid_prop || !pid_prop)
+            return NULL;
+        *vid = strtoul(vid_prop, NULL, 16);
+        *pid = strtoul(pid_prop, NULL, 16);
+        return udev_device_get_sysname(parent);
+    }
+
+    parent = udev_device_get_parent_with_subsystem_devtype(dev, "hid", NULL);
+    if (!parent)
+        return NULL;
+    const char *hid_id = udev_device_get_property_value(parent, "HID_ID");
+    unsigned int bus, hid_vid, hid_pid;
+    if (!hid_id || sscanf(hid_id, "%x:%x:%x", &bus, &hid_vid, &hid_pid) != 3)
+        return NULL;
+    *vid = hid_vid;
+    *pid = hid_pid;
+    return udev_device_get_property_value(parent, "HID_PHYS");
+}
 
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+// Poll timeout left until deadline; a negative timeout waits forever
+static int remaining_ms(uint64_t deadline, int timeout)
+{
+    if (timeout < 0)
+        return -1;
+    uint64_t now = now_ms();
+    return now < deadline ? (int)(deadline - now) : 0;
+}
+
+// Wait for a hidraw device to be added at usb_path, or anywhere if it is NULL.
+// With found_usb_path, any VID and PID match and are returned in vid and pid.
+static char *wait_device(sdp_udev *udev, uint16_t *vid, uint16_t *pid, const char *usb_path,
+                         int timeout, char **found_usb_path)
+{
     char *result = NULL;
     int ret;
     struct pollfd pollfd = {
         .fd = udev_monitor_get_fd(udev->mon),
         .events = POLLIN,
     };
-    while (!result && (ret = poll(&pollfd, 1, timeout)))
+    // The timeout applies to the whole wait, not to each unrelated event
+    uint64_t deadline = now_ms() + timeout;
+    while (!result && (ret = poll(&pollfd, 1, remaining_ms(deadline, timeout))))
     {
+        if (ret < 0)
+        {
+            if (errno != EINTR)
+                fprintf(stderr, "ERROR: poll failed: %s\n", strerror(errno));
+            break;
+        }
         if ((pollfd.revents & POLLIN) == 0)
         {
-            printf("poll failed: revents=0x%x\n", pollfd.revents);
+            sdp_report_printf("poll failed: revents=0x%x\n", pollfd.revents);
             break;
         }
         struct udev_device *dev = udev_monitor_receive_device(udev->mon);
         if (!dev)
             continue;
-        struct udev_device *parent = udev_device_get_parent_with_subsystem_devtype(dev, "usb", "usb_device");
-        if (!parent)
-            goto unref_dev;
-        // Use VID/PID from the environment properties instead of sysattr
-        // because the latter is not available yet.
-        const char *vid_prop = udev_device_get_property_value(parent, "ID_VENDOR_ID");
-        if (!vid_prop || strcmp(vid_str, vid_prop))
+        const char *action = udev_device_get_action(dev);
+        if (action && !strcmp(action, "remove"))
             goto unref_dev;
-        const char *pid_prop = udev_device_get_property_value(parent, "ID_MODEL_ID");
-        if (!pid_prop || strcasecmp(pid_str, pid_prop))
+        uint16_t dev_vid, dev_pid;
+        const char *dev_path = device_identity(dev, &dev_vid, &dev_pid);
+        if (!dev_path || (!found_usb_path && (dev_vid != *vid || dev_pid != *pid)))
             goto unref_dev;
-        if (usb_path && strcmp(udev_device_get_sysname(parent), usb_path))
+        if (usb_path && strcmp(dev_path, usb_path))
             goto unref_dev;
         const char *devnode = udev_device_get_devnode(dev);
         if (!devnode)
             goto unref_dev;
 
+        if (found_usb_path)
+        {
+            *found_usb_path = strdup(dev_path);
+            if (!*found_usb_path)
+                goto unref_dev;
+            *vid = dev_vid;
+            *pid = dev_pid;
+        }
+
         // got the device path to our device, return a copy
         result = strdup(devnode);
+        if (!result && found_usb_path)
+        {
+            free(*found_usb_path);
+            *found_usb_path = NULL;
+        }
 
     unref_dev:
         udev_device_unref(dev);
@@ -99,35 +166,21 @@ char *sdp_udev_wait(sdp_udev *udev, uint16_t vid, uint16_t pid, const char *usb_
     return result;
 }
 
-bool sdp_udev_matching_usb_path(sdp_udev *udev, const char *device_path, const char *usb_path)
+char *sdp_udev_wait(sdp_udev *udev, uint16_t vid, uint16_t pid, const char *usb_path, int timeout)
 {
-    bool result = false;
-
-    const char *sysname = strstr(device_path, "hidraw");
-    if (!sysname)
-    {
-        fprintf(stderr, "ERROR: Device has unexpected path (no hidraw device?): %s\n", device_path);
-        goto out;
-    }
-
-    struct udev_device *dev = udev_device_new_from_subsystem_sysname(udev->udev, "hidraw", sysname);
-    if (!dev)
-    {
-        fprintf(stderr, "ERROR: Cannot open udev device for %s: %s\n", device_path, strerror(errno));
-        goto out;
-    }
-
-    struct udev_device *parent = udev_device_get_parent_with_subsystem_devtype(dev, "usb", "usb_device");
-    if (!parent)
-    {
-        fprintf(stderr, "ERROR: Failed to find USB device parent for %s: %s\n", device_path, strerror(errno));
-        goto unref_device;
-    }
-
-    result = !strcmp(usb_path, udev_device_get_sysname(parent));
+    uint64_t span = sdp_trace_begin();
+    char *result = wait_device(udev, &vid, &pid, usb_path, timeout, NULL);
+    sdp_trace_end(span, "udev wait", "found", result != NULL);
+    return result;
+}
 
-unref_device:
-    udev_device_unref(dev);
-out:
+// Wait for any device on any USB path, which is returned in usb_path along with
+// its VID and PID
+char *sdp_udev_wait_any(sdp_udev *udev, int timeout, char **usb_path, uint16_t *vid, uint16_t *pid)
+{
+    *usb_path = NULL;
+    uint64_t span = sdp_trace_begin();
+    char *result = wait_device(udev, vid, pid, NULL, timeout, usb_path);
+    sdp_trace_end(span, "udev wait", "found", result != NULL);
     return result;
 }
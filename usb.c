@@ -0,0 +1,355 @@
+#include "transport.h"
+#include "sysfs.h"
+#include <errno.h>
+#include <libusb.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * libusb transport: output reports are sent as asynchronous SET_REPORT control
+ * transfers, keeping up to queue_depth of them in flight, so the next data
+ * report is already queued while the previous one is on the wire.
+ */
+
+#define HID_SET_REPORT 0x09
+#define HID_REPORT_TYPE_OUTPUT 0x02
+#define REPORT_TIMEOUT 1000 // ms
+#define MAX_REPORT_SIZE 1025
+
+struct usb_sdp_device;
+
+struct queued_transfer
+{
+    struct libusb_transfer *transfer;
+    struct usb_sdp_device *dev;
+    atomic_bool busy;
+    unsigned char buf[LIBUSB_CONTROL_SETUP_SIZE + MAX_REPORT_SIZE];
+};
+
+struct usb_sdp_device
+{
+    sdp_device base;
+    libusb_device_handle *handle;
+    uint8_t in_endpoint;
+    struct queued_transfer *queue;
+    // Completions may be handled by whichever thread runs libusb's event loop
+    atomic_int in_flight;
+    atomic_int status; // first failure of a queued transfer
+    int completed;
+    const char *error;
+};
+
+static libusb_context *ctx;
+static int queue_depth = 8;
+
+static int usb_transport_init(const char *options)
+{
+    if (options)
+    {
+        char *end;
+        if (strncmp(options, "depth=", 6) ||
+            (queue_depth = strtol(options + 6, &end, 10)) < 1 || *end)
+        {
+            fprintf(stderr, "ERROR: Invalid libusb transport options \"%s\" (expected depth=<N>)\n", options);
+            return 1;
+        }
+    }
+
+    int res = libusb_init(&ctx);
+    if (res)
+    {
+        fprintf(stderr, "ERROR: libusb init failed: %s\n", libusb_error_name(res));
+        return 1;
+    }
+    return 0;
+}
+
+static void usb_transport_exit(void)
+{
+    libusb_exit(ctx);
+    ctx = NULL;
+}
+
+static int find_in_endpoint(libusb_device *device, uint8_t *endpoint)
+{
+    struct libusb_config_descriptor *config;
+    int res = libusb_get_active_config_descriptor(device, &config);
+    if (res)
+        return res;
+
+    res = LIBUSB_ERROR_NOT_FOUND;
+    const struct libusb_interface_descriptor *intf = &config->interface[0].altsetting[0];
+    for (int i = 0; i < intf->bNumEndpoints; ++i)
+    {
+        const struct libusb_endpoint_descriptor *ep = &intf->endpoint[i];
+        if ((ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN &&
+            (ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) == LIBUSB_TRANSFER_TYPE_INTERRUPT)
+        {
+            *endpoint = ep->bEndpointAddress;
+            res = 0;
+            break;
+        }
+    }
+
+    libusb_free_config_descriptor(config);
+    return res;
+}
+
+static void transfer_done(struct libusb_transfer *transfer)
+{
+    struct queued_transfer *qt = transfer->user_data;
+    struct usb_sdp_device *dev = qt->dev;
+
+    int status = 0;
+    if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE)
+        status = LIBUSB_ERROR_NO_DEVICE;
+    else if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT)
+        status = LIBUSB_ERROR_TIMEOUT;
+    else if (transfer->status != LIBUSB_TRANSFER_COMPLETED ||
+             transfer->actual_length != transfer->length - LIBUSB_CONTROL_SETUP_SIZE)
+        status = LIBUSB_ERROR_IO;
+    int expected = 0;
+    if (status)
+        atomic_compare_exchange_strong(&dev->status, &expected, status);
+
+    atomic_store(&qt->busy, false);
+    atomic_fetch_sub(&dev->in_flight, 1);
+    dev->completed = 1;
+}
+
+// Run the event loop until at most max_in_flight transfers are pending
+static int wait_in_flight(struct usb_sdp_device *dev, int max_in_flight)
+{
+    while (atomic_load(&dev->in_flight) > max_in_flight)
+    {
+        dev->completed = 0;
+        if (atomic_load(&dev->in_flight) <= max_in_flight)
+            break;
+        int res = libusb_handle_events_completed(ctx, &dev->completed);
+        if (res && res != LIBUSB_ERROR_INTERRUPTED)
+        {
+            dev->error = libusb_error_name(res);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static sdp_device *usb_transport_open(const char *devnode)
+{
+    int busnum, devnum;
+    if (sdp_sysfs_usb_address(devnode, &busnum, &devnum))
+        return NULL;
+
+    struct usb_sdp_device *dev = calloc(1, sizeof(struct usb_sdp_device));
+    if (!dev)
+    {
+        fprintf(stderr, "ERROR: Failed to allocate device\n");
+        return NULL;
+    }
+    dev->base.transport = &sdp_usb_transport;
+
+    libusb_device **list;
+    ssize_t count = libusb_get_device_list(ctx, &list);
+    if (count < 0)
+    {
+        fprintf(stderr, "ERROR: Failed to list USB devices: %s\n", libusb_error_name(count));
+        goto free_dev;
+    }
+
+    int res = LIBUSB_ERROR_NOT_FOUND;
+    for (ssize_t i = 0; i < count; ++i)
+    {
+        if (libusb_get_bus_number(list[i]) != busnum || libusb_get_device_address(list[i]) != devnum)
+            continue;
+        res = find_in_endpoint(list[i], &dev->in_endpoint);
+        if (!res)
+            res = libusb_open(list[i], &dev->handle);
+        break;
+    }
+    libusb_free_device_list(list, 1);
+    if (res)
+    {
+        fprintf(stderr, "ERROR: Failed to open device: %s\n", libusb_error_name(res));
+        goto free_dev;
+    }
+
+    libusb_set_auto_detach_kernel_driver(dev->handle, 1);
+    res = libusb_claim_interface(dev->handle, 0);
+    if (res)
+    {
+        fprintf(stderr, "ERROR: Failed to claim interface: %s\n", libusb_error_name(res));
+        goto close_handle;
+    }
+
+    dev->queue = calloc(queue_depth, sizeof(struct queued_transfer));
+    if (!dev->queue)
+    {
+        fprintf(stderr, "ERROR: Failed to allocate transfer queue\n");
+        goto release_interface;
+    }
+    for (int i = 0; i < queue_depth; ++i)
+    {
+        dev->queue[i].dev = dev;
+        dev->queue[i].transfer = libusb_alloc_transfer(0);
+        if (!dev->queue[i].transfer)
+        {
+            fprintf(stderr, "ERROR: Failed to allocate transfer\n");
+            goto free_queue;
+        }
+    }
+
+    return &dev->base;
+
+free_queue:
+    for (int i = 0; i < queue_depth; ++i)
+        libusb_free_transfer(dev->queue[i].transfer);
+    free(dev->queue);
+release_interface:
+    libusb_release_interface(dev->handle, 0);
+close_handle:
+    libusb_close(dev->handle);
+free_dev:
+    free(dev);
+    return NULL;
+}
+
+static int usb_transport_flush(sdp_device *base)
+{
+    struct usb_sdp_device *dev = (struct usb_sdp_device *)base;
+    if (wait_in_flight(dev, 0))
+        return -1;
+
+    int status = atomic_exchange(&dev->status, 0);
+    if (status)
+    {
+        dev->error = libusb_error_name(status);
+        return -1;
+    }
+    return 0;
+}
+
+static void usb_transport_close(sdp_device *base)
+{
+    struct usb_sdp_device *dev = (struct usb_sdp_device *)base;
+
+    for (int i = 0; i < queue_depth; ++i)
+    {
+        if (atomic_load(&dev->queue[i].busy))
+            libusb_cancel_transfer(dev->queue[i].transfer);
+    }
+    usb_transport_flush(base);
+    for (int i = 0; i < queue_depth; ++i)
+        libusb_free_transfer(dev->queue[i].transfer);
+    free(dev->queue);
+
+    libusb_release_interface(dev->handle, 0);
+    libusb_close(dev->handle);
+    free(dev);
+}
+
+static int usb_transport_write(sdp_device *base, const unsigned char *buf, size_t length)
+{
+    struct usb_sdp_device *dev = (struct usb_sdp_device *)base;
+    int res = libusb_control_transfer(dev->handle,
+                                      LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+                                      HID_SET_REPORT, (HID_REPORT_TYPE_OUTPUT << 8) | buf[0], 0,
+                                      (unsigned char *)buf, length, REPORT_TIMEOUT);
+    if (res < 0)
+    {
+        dev->error = libusb_error_name(res);
+        dev->base.disconnected = res == LIBUSB_ERROR_NO_DEVICE;
+        return -1;
+    }
+    return res;
+}
+
+static int usb_transport_write_queued(sdp_device *base, const unsigned char *buf, size_t length)
+{
+    struct usb_sdp_device *dev = (struct usb_sdp_device *)base;
+
+    if (length > MAX_REPORT_SIZE)
+    {
+        dev->error = "report too large";
+        return -1;
+    }
+
+    if (wait_in_flight(dev, queue_depth - 1))
+        return -1;
+    int status = atomic_load(&dev->status);
+    if (status)
+    {
+        dev->error = libusb_error_name(status);
+        dev->base.disconnected = status == LIBUSB_ERROR_NO_DEVICE;
+        return -1;
+    }
+
+    struct queued_transfer *qt = NULL;
+    for (int i = 0; !qt; ++i)
+    {
+        if (!atomic_load(&dev->queue[i].busy))
+            qt = &dev->queue[i];
+    }
+
+    libusb_fill_control_setup(qt->buf,
+                              LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+                              HID_SET_REPORT, (HID_REPORT_TYPE_OUTPUT << 8) | buf[0], 0, length);
+    memcpy(qt->buf + LIBUSB_CONTROL_SETUP_SIZE, buf, length);
+    libusb_fill_control_transfer(qt->transfer, dev->handle, qt->buf, transfer_done, qt, REPORT_TIMEOUT);
+
+    // Account for the transfer first, it may complete on another thread
+    atomic_store(&qt->busy, true);
+    atomic_fetch_add(&dev->in_flight, 1);
+    int res = libusb_submit_transfer(qt->transfer);
+    if (res)
+    {
+        atomic_fetch_sub(&dev->in_flight, 1);
+        atomic_store(&qt->busy, false);
+        dev->error = libusb_error_name(res);
+        dev->base.disconnected = res == LIBUSB_ERROR_NO_DEVICE;
+        return -1;
+    }
+    return length;
+}
+
+static int usb_transport_read(sdp_device *base, unsigned char *buf, size_t length, int timeout)
+{
+    struct usb_sdp_device *dev = (struct usb_sdp_device *)base;
+    int transferred = 0;
+    // libusb treats 0 as "no timeout"
+    unsigned int usb_timeout = timeout < 0 ? 0 : timeout == 0 ? 1 : timeout;
+    int res = libusb_interrupt_transfer(dev->handle, dev->in_endpoint, buf, length,
+                                        &transferred, usb_timeout);
+    if (res == LIBUSB_ERROR_TIMEOUT)
+        return transferred;
+    if (res)
+    {
+        dev->error = libusb_error_name(res);
+        dev->base.disconnected = res == LIBUSB_ERROR_NO_DEVICE;
+        return -1;
+    }
+    return transferred;
+}
+
+static const char *usb_transport_error(sdp_device *base)
+{
+    struct usb_sdp_device *dev = (struct usb_sdp_device *)base;
+    return dev->error ? dev->error : "unknown error";
+}
+
+const struct sdp_transport sdp_usb_transport = {
+    .name = "libusb",
+    .init = usb_transport_init,
+    .exit = usb_transport_exit,
+    .open = usb_transport_open,
+    .close = usb_transport_close,
+    .write = usb_transport_write,
+    .write_queued = usb_transport_write_queued,
+    .flush = usb_transport_flush,
+    .read = usb_transport_read,
+    .error = usb_transport_error,
+};
@@ -0,0 +1,350 @@
+#include "config.h"
+#include "rom.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/uhid.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Companion program that creates virtual i.MX boot ROMs through /dev/uhid, so
+ * that imx-sdp can be benchmarked end to end (hidapi, enumeration and udev
+ * hotplug included) without hardware. After a successful jump the device is
+ * destroyed and re-created with the next stage's VID/PID, like a real board
+ * re-enumerating.
+ */
+
+static const unsigned char report_descriptor[] = {
+    0x06, 0x00, 0xff, // Usage Page (Vendor Defined 0xFF00)
+    0x09, 0x01,       // Usage (0x01)
+    0xa1, 0x01,       // Collection (Application)
+    0x15, 0x00,       //   Logical Minimum (0)
+    0x26, 0xff, 0x00, //   Logical Maximum (255)
+    0x75, 0x08,       //   Report Size (8)
+    0x85, 0x01,       //   Report ID (1): command
+    0x95, 0x10,       //   Report Count (16)
+    0x09, 0x01,       //   Usage (0x01)
+    0x91, 0x02,       //   Output (Data,Var,Abs)
+    0x85, 0x02,       //   Report ID (2): data
+    0x96, 0x00, 0x04, //   Report Count (1024)
+    0x09, 0x01,       //   Usage (0x01)
+    0x91, 0x02,       //   Output (Data,Var,Abs)
+    0x85, 0x03,       //   Report ID (3): HAB status
+    0x95, 0x04,       //   Report Count (4)
+    0x09, 0x01,       //   Usage (0x01)
+    0x81, 0x02,       //   Input (Data,Var,Abs)
+    0x85, 0x04,       //   Report ID (4): response
+    0x95, 0x40,       //   Report Count (64)
+    0x09, 0x01,       //   Usage (0x01)
+    0x81, 0x02,       //   Input (Data,Var,Abs)
+    0xc0,             // End Collection
+};
+
+struct stage_id
+{
+    uint16_t vid;
+    uint16_t pid;
+};
+
+struct board
+{
+    int index;
+    int fd;
+    int stage;
+    sdp_rom *rom;
+    unsigned int boots;
+};
+
+static const struct stage_id *stage_ids;
+static int stage_count;
+static bool loop;
+static volatile sig_atomic_t stop;
+
+static void handle_signal(int sig)
+{
+    stop = 1;
+}
+
+static int send_event(int fd, const struct uhid_event *ev)
+{
+    ssize_t res = write(fd, ev, sizeof(*ev));
+    if (res != sizeof(*ev))
+    {
+        fprintf(stderr, "ERROR: Failed to write uhid event: %s\n", res < 0 ? strerror(errno) : "short write");
+        return 1;
+    }
+    return 0;
+}
+
+static int create_device(struct board *board)
+{
+    board->rom = sdp_rom_new();
+    if (!board->rom)
+    {
+        fprintf(stderr, "ERROR: Failed to allocate ROM model\n");
+        return 1;
+    }
+
+    struct uhid_event ev = {.type = UHID_CREATE2};
+    snprintf((char *)ev.u.create2.name, sizeof(ev.u.create2.name), "imx-sdp virtual ROM %d", board->index);
+    // imx-sdp uses the physical path to tell boards apart (--path vrom-N)
+    snprintf((char *)ev.u.create2.phys, sizeof(ev.u.create2.phys), "vrom-%d", board->index);
+    memcpy(ev.u.create2.rd_data, report_descriptor, sizeof(report_descriptor));
+    ev.u.create2.rd_size = sizeof(report_descriptor);
+    ev.u.create2.bus = BUS_USB;
+    ev.u.create2.vendor = stage_ids[board->stage].vid;
+    ev.u.create2.product = stage_ids[board->stage].pid;
+    return send_event(board->fd, &ev);
+}
+
+static int destroy_device(struct board *board)
+{
+    struct uhid_event ev = {.type = UHID_DESTROY};
+    sdp_rom_free(board->rom);
+    board->rom = NULL;
+    return send_event(board->fd, &ev);
+}
+
+static int send_input(struct board *board)
+{
+    struct uhid_event ev = {.type = UHID_INPUT2};
+    size_t n;
+    while ((n = sdp_rom_input(board->rom, ev.u.input2.data, sizeof(ev.u.input2.data))))
+    {
+        ev.u.input2.size = n;
+        if (send_event(board->fd, &ev))
+            return 1;
+    }
+    return 0;
+}
+
+static int handle_output(struct board *board, const unsigned char *data, size_t size)
+{
+    if (sdp_rom_output(board->rom, data, size))
+        fprintf(stderr, "vrom-%d: Protocol error (report %d, %zu bytes)\n", board->index, size ? data[0] : 0, size);
+    if (send_input(board))
+        return 1;
+
+    uint32_t address;
+    if (!sdp_rom_jumped(board->rom, &address))
+        return 0;
+
+    // Re-enumerate as the next stage
+    printf("vrom-%d: Stage %d jumped to 0x%08x\n", board->index, board->stage + 1, address);
+    if (destroy_device(board))
+        return 1;
+    if (++board->stage == stage_count)
+    {
+        board->boots++;
+        board->stage = 0;
+        if (!loop)
+            return 0;
+    }
+    return create_device(board);
+}
+
+static int handle_event(struct board *board)
+{
+    struct uhid_event ev;
+    ssize_t res = read(board->fd, &ev, sizeof(ev));
+    if (res < 0)
+    {
+        fprintf(stderr, "ERROR: Failed to read uhid event: %s\n", strerror(errno));
+        return 1;
+    }
+
+    switch (ev.type)
+    {
+    case UHID_OUTPUT:
+        return handle_output(board, ev.u.output.data, ev.u.output.size);
+    case UHID_SET_REPORT:
+        {
+            struct uhid_event reply = {.type = UHID_SET_REPORT_REPLY};
+            reply.u.set_report_reply.id = ev.u.set_report.id;
+            if (send_event(board->fd, &reply))
+                return 1;
+            return handle_output(board, ev.u.set_report.data, ev.u.set_report.size);
+        }
+    case UHID_GET_REPORT:
+        {
+            struct uhid_event reply = {.type = UHID_GET_REPORT_REPLY};
+            reply.u.get_report_reply.id = ev.u.get_report.id;
+            reply.u.get_report_reply.err = EIO;
+            return send_event(board->fd, &reply);
+        }
+    default:
+        // START, STOP, OPEN and CLOSE need no action
+        return 0;
+    }
+}
+
+static int parse_stage_ids(int count, char *s[])
+{
+    struct stage_id *ids = calloc(count, sizeof(struct stage_id));
+    if (!ids)
+        return 1;
+
+    for (int i = 0; i < count; ++i)
+    {
+        unsigned int vid, pid;
+        if (sscanf(s[i], "%04x:%04x", &vid, &pid) != 2 || vid > 0xffff || pid > 0xffff)
+        {
+            fprintf(stderr, "ERROR: Invalid VID:PID \"%s\"\n", s[i]);
+            free(ids);
+            return 1;
+        }
+        ids[i].vid = vid;
+        ids[i].pid = pid;
+    }
+
+    stage_ids = ids;
+    stage_count = count;
+    return 0;
+}
+
+static void usage(const char *progname)
+{
+    printf(
+        "Usage: %s [OPTION...] <VID>:<PID>...\n"
+        "\n"
+        "Create virtual i.MX boot ROM devices through /dev/uhid. Each board starts\n"
+        "with the first VID:PID and re-enumerates with the next one after every\n"
+        "successful jump. The boards can be selected with imx-sdp --path vrom-<N>.\n"
+        "\n"
+        "The following OPTIONs are available:\n"
+        "\n"
+        "  -h, --help  print this usage message\n"
+        "  -l, --loop  start over with the first VID:PID after the last stage\n"
+        "  -n, --count  number of boards to create (default: 1)\n"
+        "  -V, --version  print version\n",
+        progname);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option longopts[] = {
+        {"count", required_argument, NULL, 'n'},
+        {"help", no_argument, NULL, 'h'},
+        {"loop", no_argument, NULL, 'l'},
+        {"version", no_argument, NULL, 'V'},
+        {0},
+    };
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    int opt;
+    int count = 1;
+    while ((opt = getopt_long(argc, argv, "hln:V", longopts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'h':
+            usage(argv[0]);
+            return EXIT_SUCCESS;
+        case 'l':
+            loop = true;
+            break;
+        case 'n':
+            count = atoi(optarg);
+            if (count < 1)
+            {
+                fprintf(stderr, "ERROR: Invalid board count\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'V':
+            puts(VERSION);
+            return EXIT_SUCCESS;
+        default:
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind >= argc)
+    {
+        fprintf(stderr, "ERROR: Expected at least one VID:PID\n");
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (parse_stage_ids(argc - optind, argv + optind))
+        return EXIT_FAILURE;
+
+    struct board *boards = calloc(count, sizeof(struct board));
+    struct pollfd *fds = calloc(count, sizeof(struct pollfd));
+    if (!boards || !fds)
+    {
+        fprintf(stderr, "ERROR: Failed to allocate boards\n");
+        return EXIT_FAILURE;
+    }
+
+    int res = EXIT_SUCCESS;
+    for (int i = 0; i < count; ++i)
+    {
+        boards[i].index = i + 1;
+        boards[i].fd = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+        if (boards[i].fd < 0)
+        {
+            fprintf(stderr, "ERROR: Failed to open /dev/uhid: %s\n", strerror(errno));
+            res = EXIT_FAILURE;
+            goto close_boards;
+        }
+        if (create_device(&boards[i]))
+        {
+            res = EXIT_FAILURE;
+            goto close_boards;
+        }
+        fds[i].fd = boards[i].fd;
+        fds[i].events = POLLIN;
+    }
+
+    struct sigaction sa = {.sa_handler = handle_signal};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    printf("Created %d virtual board(s)\n", count);
+
+    while (!stop)
+    {
+        if (poll(fds, count, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "ERROR: poll failed: %s\n", strerror(errno));
+            res = EXIT_FAILURE;
+            break;
+        }
+        for (int i = 0; i < count; ++i)
+        {
+            if ((fds[i].revents & POLLIN) && handle_event(&boards[i]))
+            {
+                res = EXIT_FAILURE;
+                stop = 1;
+            }
+        }
+    }
+
+    unsigned int boots = 0;
+    for (int i = 0; i < count; ++i)
+        boots += boards[i].boots;
+    printf("%u board(s) booted\n", boots);
+
+close_boards:
+    for (int i = 0; i < count; ++i)
+    {
+        if (boards[i].rom)
+            destroy_device(&boards[i]);
+        if (boards[i].fd > 0)
+            close(boards[i].fd);
+    }
+    free(fds);
+    free(boards);
+    free((void *)stage_ids);
+    return res;
+}